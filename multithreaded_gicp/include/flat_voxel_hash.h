@@ -0,0 +1,213 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+// Integer coordinates of a voxel
+struct VoxelKey {
+  int x, y, z;
+
+  VoxelKey() : x(0), y(0), z(0) {}
+  VoxelKey(int x_, int y_, int z_) : x(x_), y(y_), z(z_) {}
+
+  // Key of the voxel of side resolution containing (px, py, pz)
+  static VoxelKey fromPoint(double px, double py, double pz,
+                            double inverse_resolution) {
+    return VoxelKey(static_cast<int>(std::floor(px * inverse_resolution)),
+                    static_cast<int>(std::floor(py * inverse_resolution)),
+                    static_cast<int>(std::floor(pz * inverse_resolution)));
+  }
+
+  // Key of the voxel containing this one in a grid factor times coarser
+  VoxelKey coarsen(int factor) const {
+    return VoxelKey(floorDiv(x, factor), floorDiv(y, factor),
+                    floorDiv(z, factor));
+  }
+
+  static int floorDiv(int a, int b) {
+    return (a >= 0 ? a : a - b + 1) / b;
+  }
+
+  bool operator==(const VoxelKey& other) const {
+    return x == other.x && y == other.y && z == other.z;
+  }
+
+  bool operator<(const VoxelKey& other) const {
+    if (x != other.x)
+      return x < other.x;
+    if (y != other.y)
+      return y < other.y;
+    return z < other.z;
+  }
+};
+
+// Relative coordinates of the voxel and its 6 face neighbours, first 1 and 7
+// entries are the 1 and 7 neighbourhoods
+const VoxelKey kVoxelNeighbors7[7] = {VoxelKey(0, 0, 0),
+                                      VoxelKey(1, 0, 0),
+                                      VoxelKey(-1, 0, 0),
+                                      VoxelKey(0, 1, 0),
+                                      VoxelKey(0, -1, 0),
+                                      VoxelKey(0, 0, 1),
+                                      VoxelKey(0, 0, -1)};
+
+// Relative coordinates of the voxel and all its 26 neighbours, starting with
+// the 7 neighbourhood
+inline const std::vector<VoxelKey>& VoxelNeighbors27() {
+  static const std::vector<VoxelKey> neighbors = [] {
+    std::vector<VoxelKey> n(kVoxelNeighbors7, kVoxelNeighbors7 + 7);
+    for (int x = -1; x <= 1; x++)
+      for (int y = -1; y <= 1; y++)
+        for (int z = -1; z <= 1; z++)
+          if (std::abs(x) + std::abs(y) + std::abs(z) > 1)
+            n.emplace_back(x, y, z);
+    return n;
+  }();
+  return neighbors;
+}
+
+// Open addressing hash map from voxel coordinates to a value. Entries are
+// stored in one flat array with linear probing, so a lookup touches one or two
+// cache lines and no node is allocated per voxel. The full key is stored,
+// lookups never return the value of a colliding voxel.
+template <typename Value>
+class FlatVoxelHash {
+public:
+  FlatVoxelHash() : size_(0), mask_(0) {}
+
+  void clear() {
+    slots_.clear();
+    size_ = 0;
+    mask_ = 0;
+  }
+
+  // Prepare for n entries without rehashing
+  void reserve(size_t n) {
+    size_t capacity = 16;
+    // Keep the load factor under 1/2
+    while (capacity < 2 * n)
+      capacity <<= 1;
+    if (capacity > slots_.size())
+      rehash(capacity);
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  // Value of key, nullptr if key is not in the map
+  const Value* find(const VoxelKey& key) const {
+    if (size_ == 0)
+      return nullptr;
+    for (size_t i = hash(key) & mask_;; i = (i + 1) & mask_) {
+      const Slot& slot = slots_[i];
+      if (!slot.occupied)
+        return nullptr;
+      if (slot.key == key)
+        return &slot.value;
+    }
+  }
+
+  Value* find(const VoxelKey& key) {
+    return const_cast<Value*>(
+        static_cast<const FlatVoxelHash&>(*this).find(key));
+  }
+
+  // Insert key with value if it is not in the map yet. Returns the value of
+  // key and whether it was inserted. The reference is invalidated by the next
+  // insertion
+  std::pair<Value*, bool> insert(const VoxelKey& key, const Value& value) {
+    if (2 * (size_ + 1) > slots_.size())
+      rehash(slots_.empty() ? 16 : 2 * slots_.size());
+    for (size_t i = hash(key) & mask_;; i = (i + 1) & mask_) {
+      Slot& slot = slots_[i];
+      if (!slot.occupied) {
+        slot.occupied = true;
+        slot.key = key;
+        slot.value = value;
+        size_++;
+        return std::make_pair(&slot.value, true);
+      }
+      if (slot.key == key)
+        return std::make_pair(&slot.value, false);
+    }
+  }
+
+  // Remove key, returns whether it was in the map. The following entries of
+  // its probe sequence are shifted back into the hole, so no tombstone is left
+  // and lookups stay as short as after inserting the remaining keys
+  bool erase(const VoxelKey& key) {
+    if (size_ == 0)
+      return false;
+    size_t hole = hash(key) & mask_;
+    for (;; hole = (hole + 1) & mask_) {
+      if (!slots_[hole].occupied)
+        return false;
+      if (slots_[hole].key == key)
+        break;
+    }
+    for (size_t i = (hole + 1) & mask_; slots_[i].occupied;
+         i = (i + 1) & mask_) {
+      // Move the entry unless the hole lies before its home slot
+      const size_t home = hash(slots_[i].key) & mask_;
+      if (((i - home) & mask_) >= ((i - hole) & mask_)) {
+        slots_[hole] = slots_[i];
+        hole = i;
+      }
+    }
+    slots_[hole] = Slot();
+    size_--;
+    return true;
+  }
+
+  // Call f(key, value) for each entry, in unspecified order
+  template <typename Function>
+  void forEach(Function f) const {
+    for (const Slot& slot : slots_)
+      if (slot.occupied)
+        f(slot.key, slot.value);
+  }
+
+private:
+  struct Slot {
+    VoxelKey key;
+    bool occupied;
+    Value value;
+
+    Slot() : occupied(false), value() {}
+  };
+
+  static size_t hash(const VoxelKey& key) {
+    uint64_t h = static_cast<uint64_t>(static_cast<uint32_t>(key.x)) *
+        73856093ull;
+    h ^= static_cast<uint64_t>(static_cast<uint32_t>(key.y)) * 19349669ull;
+    h ^= static_cast<uint64_t>(static_cast<uint32_t>(key.z)) * 83492791ull;
+    // Mix the high bits into the low bits used by the mask
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 32;
+    return static_cast<size_t>(h);
+  }
+
+  void rehash(size_t capacity) {
+    std::vector<Slot> old_slots(capacity);
+    old_slots.swap(slots_);
+    mask_ = capacity - 1;
+    size_ = 0;
+    for (const Slot& slot : old_slots)
+      if (slot.occupied)
+        insert(slot.key, slot.value);
+  }
+
+  std::vector<Slot> slots_;
+  size_t size_;
+  size_t mask_;
+};
@@ -41,13 +41,19 @@
 #ifndef MULTITHREADED_GICP_H_
 #define MULTITHREADED_GICP_H_
 
-#include <omp.h>
+#include <chrono>
 
+#include <flat_voxel_hash.h>
 #include <frontend_utils/CommonFunctions.h>
 #include <frontend_utils/CommonStructs.h>
+#include <multithreaded_gicp/gicp_simd.h>
 #include <pcl/registration/bfgs.h>
 #include <pcl/registration/gicp.h>
 #include <pcl/registration/icp.h>
+#include <registration_batch.h>
+#include <registration_settings.h>
+#include <registration_stats.h>
+#include <registration_thread_pool.h>
 #include <ros/ros.h>
 
 namespace pcl
@@ -72,12 +78,15 @@ public:
   using IterativeClosestPoint<PointSource, PointTarget>::input_;
   using IterativeClosestPoint<PointSource, PointTarget>::tree_;
   using IterativeClosestPoint<PointSource, PointTarget>::tree_reciprocal_;
+  using IterativeClosestPoint<PointSource, PointTarget>::source_cloud_updated_;
+  using IterativeClosestPoint<PointSource, PointTarget>::target_cloud_updated_;
   using IterativeClosestPoint<PointSource, PointTarget>::nr_iterations_;
   using IterativeClosestPoint<PointSource, PointTarget>::max_iterations_;
   using IterativeClosestPoint<PointSource, PointTarget>::previous_transformation_;
   using IterativeClosestPoint<PointSource, PointTarget>::final_transformation_;
   using IterativeClosestPoint<PointSource, PointTarget>::transformation_;
   using IterativeClosestPoint<PointSource, PointTarget>::transformation_epsilon_;
+  using IterativeClosestPoint<PointSource, PointTarget>::euclidean_fitness_epsilon_;
   using IterativeClosestPoint<PointSource, PointTarget>::converged_;
   using IterativeClosestPoint<PointSource, PointTarget>::corr_dist_threshold_;
   using IterativeClosestPoint<PointSource, PointTarget>::inlier_threshold_;
@@ -101,11 +110,13 @@ public:
 
   typedef typename Registration<PointSource, PointTarget>::KdTree InputKdTree;
   typedef typename Registration<PointSource, PointTarget>::KdTreePtr InputKdTreePtr;
+  typedef typename Registration<PointSource, PointTarget>::KdTreeReciprocalPtr InputKdTreeReciprocalPtr;
 
   typedef boost::shared_ptr<MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>> Ptr;
   typedef boost::shared_ptr<const MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>> ConstPtr;
 
   typedef Eigen::Matrix<double, 6, 1> Vector6d;
+  typedef Eigen::Matrix<double, 6, 6> Matrix6d;
 
   /** \brief Empty constructor. */
   MultithreadedGeneralizedIterativeClosestPoint()
@@ -119,6 +130,20 @@ public:
     , rotation_epsilon_(2e-3)
     , mahalanobis_(0)
     , max_inner_iterations_(20)
+    , solver_(GicpSolver::BFGS)
+    , search_method_(GicpSearchMethod::KDTREE)
+    , voxel_hash_updated_(true)
+    , mahalanobis_cache_rotation_threshold_(0.)
+    , inlier_ratio_epsilon_(0.)
+    , cost_decrease_epsilon_(0.)
+    , single_precision_(false)
+    , num_correspondences_(0)
+    , pyramid_target_updated_(true)
+    , pyramid_source_updated_(true)
+    , target_cache_resolution_(1e-3)
+    , target_cache_pending_(false)
+    , robust_kernel_(RobustKernel::NONE)
+    , robust_kernel_width_(1.)
   {
     min_number_correspondences_ = 4;
     reg_name_ = "MultithreadedGeneralizedIterativeClosestPoint";
@@ -131,11 +156,32 @@ public:
     setNumThreads(k_num_threads_);
   }
 
+  /** \brief Run on a pool of num_threads threads owned by this instance. The
+   * thread count of other components of the process is not affected.
+   */
   void setNumThreads(int num_threads)
   {
     assert(num_threads > 0);
+    if (thread_pool_ && thread_pool_->numThreads() == num_threads)
+      return;
     k_num_threads_ = num_threads;
-    omp_set_num_threads(k_num_threads_);
+    thread_pool_ = std::make_shared<RegistrationThreadPool>(k_num_threads_);
+  }
+
+  /** \brief Run on a thread pool provided by the caller, e.g. shared with
+   * other registration instances or with pinned workers. Calls from different
+   * threads to instances sharing a pool are serialized.
+   */
+  void setThreadPool(const RegistrationThreadPool::Ptr& thread_pool)
+  {
+    assert(thread_pool);
+    thread_pool_ = thread_pool;
+    k_num_threads_ = thread_pool_->numThreads();
+  }
+
+  inline RegistrationThreadPool::Ptr getThreadPool() const
+  {
+    return thread_pool_;
   }
 
   void enableTimingOutput(bool enable)
@@ -143,6 +189,235 @@ public:
     k_enable_timing_output_ = enable;
   }
 
+  /** \brief Select the solver estimating the transformation at each iteration.
+   * BFGS minimizes over Euler angles with a line search, Gauss-Newton and
+   * Levenberg-Marquardt solve the normal equations of the linearized residuals
+   * on SE(3) and usually need only a few steps.
+   * \param[in] solver the solver to use
+   */
+  void setSolver(GicpSolver solver)
+  {
+    solver_ = solver;
+    switch (solver_)
+    {
+      case GicpSolver::GAUSS_NEWTON:
+        rigid_transformation_estimation_ = boost::bind(
+            &MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::estimateRigidTransformationGN,
+            this, _1, _2, _3, _4, _5);
+        break;
+      case GicpSolver::LEVENBERG_MARQUARDT:
+        rigid_transformation_estimation_ = boost::bind(
+            &MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::estimateRigidTransformationLM,
+            this, _1, _2, _3, _4, _5);
+        break;
+      default:
+        rigid_transformation_estimation_ = boost::bind(
+            &MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::estimateRigidTransformationBFGS,
+            this, _1, _2, _3, _4, _5);
+        break;
+    }
+  }
+
+  /** \brief Get the solver estimating the transformation at each iteration */
+  GicpSolver getSolver() const
+  {
+    return (solver_);
+  }
+
+  /** \brief Select how correspondences are searched in the target. KDTREE is
+   * exact, VOXEL_HASH1/7/27 look for the nearest target point in the 1, 7 or
+   * 27 voxels around the query of a hash grid whose resolution is the maximum
+   * correspondence distance. VOXEL_HASH27 finds every point within that
+   * distance, the smaller neighbourhoods are approximate. A source point with
+   * no target point in its neighbourhood gets no correspondence.
+   * \param[in] method the search method to use
+   */
+  void setSearchMethod(GicpSearchMethod method)
+  {
+    search_method_ = method;
+  }
+
+  /** \brief Reuse the mahalanobis matrix of a source point across iterations
+   * while its key does not change: the index of its nearest neighbour and the
+   * bucket of the rotation, a cell of side threshold in rotation vector space.
+   * Late iterations rarely change correspondences, so most inversions are
+   * skipped.
+   * \param[in] threshold the rotation bucket size in radians, 0 disables
+   * caching
+   */
+  void setMahalanobisCacheRotationThreshold(double threshold)
+  {
+    mahalanobis_cache_rotation_threshold_ = threshold;
+  }
+
+  /** \brief Get the mahalanobis cache rotation threshold, 0 if disabled */
+  double getMahalanobisCacheRotationThreshold() const
+  {
+    return (mahalanobis_cache_rotation_threshold_);
+  }
+
+  /** \brief Stop iterating once the ratio of source points with a
+   * correspondence changes by less than epsilon between two iterations.
+   * \param[in] epsilon the inlier ratio epsilon, 0 disables the criterion
+   */
+  void setInlierRatioEpsilon(double epsilon)
+  {
+    inlier_ratio_epsilon_ = epsilon;
+  }
+
+  /** \brief Get the inlier ratio epsilon, 0 if disabled */
+  double getInlierRatioEpsilon() const
+  {
+    return (inlier_ratio_epsilon_);
+  }
+
+  /** \brief Stop iterating once an iteration decreases the cost by less than
+   * epsilon, relative to the cost before the iteration. Both costs are mean
+   * costs over the correspondences of that iteration.
+   * \param[in] epsilon the relative cost decrease epsilon, 0 disables the
+   * criterion
+   */
+  void setCostDecreaseEpsilon(double epsilon)
+  {
+    cost_decrease_epsilon_ = epsilon;
+  }
+
+  /** \brief Get the cost decrease epsilon, 0 if disabled */
+  double getCostDecreaseEpsilon() const
+  {
+    return (cost_decrease_epsilon_);
+  }
+
+  /** \brief Evaluate the BFGS cost function and gradient in single precision
+   * on packed float correspondences, with AVX2 kernels when the CPU supports
+   * them. Halves the memory traffic of the hot loop at the price of float
+   * rounding in the per chunk sums. The Gauss-Newton and Levenberg-Marquardt
+   * solvers always run in double precision.
+   * \param[in] enable true to use single precision
+   */
+  void setSinglePrecision(bool enable)
+  {
+    single_precision_ = enable;
+  }
+
+  /** \brief Get whether the cost function is evaluated in single precision */
+  bool getSinglePrecision() const
+  {
+    return (single_precision_);
+  }
+
+  /** \brief Get the statistics of the last call to align() */
+  const RegistrationStats& getRegistrationStats() const
+  {
+    return (stats_);
+  }
+
+  /** \brief Get the correspondences of the last iteration of the last call to
+   * align(), searched before that iteration updated the transformation. Each
+   * holds the source index, the target index and their squared distance.
+   * Points without a target point within the maximum correspondence distance
+   * are left out. Empty if the search failed.
+   */
+  const pcl::Correspondences& getFinalCorrespondences() const
+  {
+    return (final_correspondences_);
+  }
+
+  /** \brief Get the correspondence search method */
+  GicpSearchMethod getSearchMethod() const
+  {
+    return (search_method_);
+  }
+
+  /** \brief Down weight correspondences with a robust kernel of the
+   * mahalanobis distance s = sqrt(res' * M * res). The weights are computed at
+   * the start of each outer iteration (iteratively reweighted least squares)
+   * and scale the mahalanobis matrices, so every solver and cost kernel uses
+   * them. With the kernel width c: Huber w = min(1, c / s), Cauchy
+   * w = 1 / (1 + (s / c)^2), Geman-McClure w = 1 / (1 + (s / c)^2)^2.
+   * \param[in] kernel the robust kernel, NONE for the plain squared distance
+   * \param[in] width the kernel width c, in mahalanobis distance units
+   */
+  void setRobustKernel(RobustKernel kernel, double width)
+  {
+    robust_kernel_ = kernel;
+    robust_kernel_width_ = width;
+  }
+
+  /** \brief Get the robust kernel */
+  RobustKernel getRobustKernel() const
+  {
+    return (robust_kernel_);
+  }
+
+  /** \brief Get the robust kernel width */
+  double getRobustKernelWidth() const
+  {
+    return (robust_kernel_width_);
+  }
+
+  /** \brief Align voxel downsampled versions of source and target before the
+   * full resolution registration, coarse to fine, each level starting from the
+   * result of the previous one. A voxel is represented by its point closest to
+   * the voxel centroid, which keeps the covariance computed on the full
+   * resolution cloud, so no level computes covariances. The correspondence
+   * distance of a level is the maximum of the correspondence distance and
+   * twice its resolution, so coarse levels converge from further away.
+   * \param[in] resolutions voxel sizes of the levels, coarsest first, empty to
+   * disable the pyramid
+   * \param[in] iterations maximum number of iterations of each level
+   * \return false if the sizes do not match or a resolution is not positive,
+   * the pyramid is then disabled
+   */
+  bool setPyramidLevels(const std::vector<double>& resolutions, const std::vector<int>& iterations)
+  {
+    pyramid_levels_.clear();
+    pyramid_target_updated_ = true;
+    pyramid_source_updated_ = true;
+    if (resolutions.size() != iterations.size())
+    {
+      PCL_ERROR("[pcl::%s::setPyramidLevels] %lu resolutions but %lu iteration counts given!\n",
+                getClassName().c_str(), resolutions.size(), iterations.size());
+      return (false);
+    }
+    for (size_t l = 0; l < resolutions.size(); l++)
+    {
+      if (resolutions[l] <= 0.)
+      {
+        PCL_ERROR("[pcl::%s::setPyramidLevels] Invalid resolution %f!\n", getClassName().c_str(), resolutions[l]);
+        pyramid_levels_.clear();
+        return (false);
+      }
+      PyramidLevel level;
+      level.resolution = resolutions[l];
+      level.iterations = iterations[l];
+      pyramid_levels_.push_back(level);
+    }
+    return (true);
+  }
+
+  /** \brief Get the number of pyramid levels, 0 if disabled */
+  size_t getNumPyramidLevels() const
+  {
+    return (pyramid_levels_.size());
+  }
+
+  /** \brief Align several sources, or several initial guesses of one source,
+   * against the current target. The target search structures and covariances
+   * are built once and shared by all the items, the covariances of each
+   * source are computed once. Items run in parallel on the thread pool, one
+   * item per thread, with the settings of this instance; the result of an
+   * item does not depend on the number of threads.
+   * \param[in] sources one source, or one source per item
+   * \param[in] guesses initial guess of each item, empty for identity
+   * \param[out] results transformation, fitness score and statistics of each
+   * item
+   * \return false if the sizes do not match, a source is empty or no target
+   * is set
+   */
+  bool alignBatch(const std::vector<PointCloudSourceConstPtr>& sources, const RegistrationTransformations& guesses,
+                  RegistrationBatchResults& results);
+
   // template <typename PointSource, typename PointTarget>
   // static GeneralizedIterativeClosestPoint<PointSource, PointTarget>
   // MultithreadedGeneralizedIterativeClosestPoint ()
@@ -161,6 +436,8 @@ public:
    */
   inline void setInputSource(const PointCloudSourceConstPtr& cloud)
   {
+    // The correspondences index the previous source, even if cloud is rejected
+    final_correspondences_.clear();
     if (cloud->points.empty())
     {
       PCL_ERROR(
@@ -169,13 +446,30 @@ public:
           getClassName().c_str());
       return;
     }
-    PointCloudSource input = *cloud;
-    // Set all the point.data[3] values to 1 to aid the rigid transformation
-    for (size_t i = 0; i < input.size(); ++i)
-      input[i].data[3] = 1.0;
-
+    // No copy is made, the kernels only use the xyz part of the points so
+    // point.data[3] does not need to be set to 1
     pcl::IterativeClosestPoint<PointSource, PointTarget>::setInputSource(cloud);
     input_covariances_.reset();
+    pyramid_source_updated_ = true;
+  }
+
+  /** \brief Provide a shared input source together with the structures
+   * already computed for it, so that nothing is copied or rebuilt. The cloud
+   * is held by pointer and must not be modified while it is in use.
+   * \param[in] cloud the input point cloud source
+   * \param[in] covariances the covariances of cloud, computed if empty
+   * \param[in] tree a search tree already built on cloud, built if empty
+   */
+  inline void setInputSourceShared(const PointCloudSourceConstPtr& cloud, const MatricesVectorPtr& covariances,
+                                   const InputKdTreeReciprocalPtr& tree = InputKdTreeReciprocalPtr())
+  {
+    setInputSource(cloud);
+    input_covariances_ = covariances;
+    if (tree)
+    {
+      tree_reciprocal_ = tree;
+      source_cloud_updated_ = false;
+    }
   }
 
   /** \brief Provide a pointer to the covariances of the input source (if
@@ -197,6 +491,51 @@ public:
   {
     pcl::IterativeClosestPoint<PointSource, PointTarget>::setInputTarget(target);
     target_covariances_.reset();
+    final_correspondences_.clear();
+    voxel_hash_updated_ = true;
+    pyramid_target_updated_ = true;
+    target_cache_pending_ = false;
+  }
+
+  /** \brief Provide the input target together with its pose in a frame where
+   * target points do not move between calls, e.g. the map a local target is
+   * fetched from. A point that was already in the previous cached target,
+   * identified by its coordinates in that frame quantized to the cache
+   * resolution, gets its covariance from the cache (rotated into the target
+   * frame), only new points have their covariance computed. Cached points
+   * missing from the new target are evicted. The search tree is rebuilt.
+   * \param[in] target the input point cloud target
+   * \param[in] cache_from_target the transformation from the target frame to
+   * the cache frame
+   */
+  inline void setInputTargetCached(const PointCloudTargetConstPtr& target, const Eigen::Matrix4f& cache_from_target)
+  {
+    setInputTarget(target);
+    target_cache_from_target_ = cache_from_target;
+    target_cache_pending_ = true;
+  }
+
+  /** \brief Set the size of the cells identifying a target point in the cache
+   * frame of setInputTargetCached(). Two points within a cell share their
+   * covariance. Default 1 mm.
+   */
+  inline void setTargetCacheResolution(double resolution)
+  {
+    if (resolution != target_cache_resolution_)
+      clearTargetCache();
+    target_cache_resolution_ = resolution;
+  }
+
+  inline double getTargetCacheResolution() const
+  {
+    return (target_cache_resolution_);
+  }
+
+  /** \brief Drop the covariances cached by setInputTargetCached() */
+  inline void clearTargetCache()
+  {
+    target_cache_.clear();
+    target_cache_covariances_.clear();
   }
 
   /** \brief Provide a pointer to the covariances of the input target (if
@@ -210,6 +549,58 @@ public:
     target_covariances_ = covariances;
   }
 
+  /** \brief Provide a shared input target together with the structures
+   * already computed for it, so that nothing is copied or rebuilt. The cloud
+   * is held by pointer and must not be modified while it is in use.
+   * \param[in] target the input point cloud target
+   * \param[in] covariances the covariances of target, computed if empty
+   * \param[in] tree a search tree already built on target, built if empty
+   */
+  inline void setInputTargetShared(const PointCloudTargetConstPtr& target, const MatricesVectorPtr& covariances,
+                                   const InputKdTreePtr& tree = InputKdTreePtr())
+  {
+    setInputTarget(target);
+    target_covariances_ = covariances;
+    if (tree)
+    {
+      tree_ = tree;
+      target_cloud_updated_ = false;
+    }
+  }
+
+  /** \brief Promote the current input source to be the target of the next
+   * registration (frame-to-frame rolling registration). The source search tree
+   * and source covariances computed during the last align() are handed over
+   * to the target side by pointer swap, so neither is rebuilt for the next
+   * frame. The source must have been aligned without being transformed
+   * beforehand (pass any prior as the align() guess instead), otherwise its
+   * covariances are not expressed in the frame of the next target.
+   * \return false if there is no source whose search tree has been built, in
+   * which case the target is left untouched and the caller has to set it
+   */
+  inline bool rollSourceToTarget()
+  {
+    static_assert(std::is_same<PointSource, PointTarget>::value,
+                  "Rolling registration requires the same source and target point type");
+    // The reciprocal tree is only (re)built in computeTransformation, check it indexes the current input
+    if (!input_ || source_cloud_updated_)
+      return (false);
+
+    pcl::IterativeClosestPoint<PointSource, PointTarget>::setInputTarget(input_);
+    voxel_hash_updated_ = true;
+    final_correspondences_.clear();
+    std::swap(tree_, tree_reciprocal_);
+    // tree_ already indexes the new target, prevent initCompute from rebuilding it
+    target_cloud_updated_ = false;
+    // The swapped-out tree no longer matches any source, force a rebuild on the next setInputSource
+    source_cloud_updated_ = true;
+    target_covariances_.swap(input_covariances_);
+    input_covariances_.reset();
+    target_cache_pending_ = false;
+    rollPyramidLevels();
+    return (true);
+  }
+
   /** \brief Estimate a rigid rotation transformation between a source and a
    * target point cloud using an iterative non-linear Levenberg-Marquardt
    * approach. \param[in] cloud_src the source point cloud dataset \param[in]
@@ -223,6 +614,28 @@ public:
                                        const PointCloudTarget& cloud_tgt, const std::vector<int>& indices_tgt,
                                        Eigen::Matrix4f& transformation_matrix);
 
+  /** \brief Estimate a rigid rotation transformation between a source and a
+   * target point cloud with Gauss-Newton steps on SE(3). Parameters as in
+   * estimateRigidTransformationBFGS.
+   */
+  void estimateRigidTransformationGN(const PointCloudSource& cloud_src, const std::vector<int>& indices_src,
+                                     const PointCloudTarget& cloud_tgt, const std::vector<int>& indices_tgt,
+                                     Eigen::Matrix4f& transformation_matrix)
+  {
+    estimateRigidTransformationNewton(cloud_src, indices_src, cloud_tgt, indices_tgt, transformation_matrix, false);
+  }
+
+  /** \brief Estimate a rigid rotation transformation between a source and a
+   * target point cloud with Levenberg-Marquardt steps on SE(3). Parameters as
+   * in estimateRigidTransformationBFGS.
+   */
+  void estimateRigidTransformationLM(const PointCloudSource& cloud_src, const std::vector<int>& indices_src,
+                                     const PointCloudTarget& cloud_tgt, const std::vector<int>& indices_tgt,
+                                     Eigen::Matrix4f& transformation_matrix)
+  {
+    estimateRigidTransformationNewton(cloud_src, indices_src, cloud_tgt, indices_tgt, transformation_matrix, true);
+  }
+
   /** \brief \return Mahalanobis distance matrix for the given point index */
   inline const Eigen::Matrix3d& mahalanobis(size_t index) const
   {
@@ -341,6 +754,189 @@ protected:
   /** \brief maximum number of optimizations */
   int max_inner_iterations_;
 
+  /** \brief Per thread nearest neighbour buffers of computeCovariances */
+  std::vector<std::vector<int>> covariance_nn_indices_;
+  std::vector<std::vector<float>> covariance_nn_dists_;
+
+  /** \brief solver estimating the transformation at each iteration */
+  GicpSolver solver_;
+
+  /** \brief correspondence search method */
+  GicpSearchMethod search_method_;
+
+  /** \brief Source and target indices of the correspondences, reused across
+   * iterations
+   */
+  std::vector<int> source_indices_;
+  std::vector<int> target_indices_;
+
+  /** \brief Squared distance of the correspondence of each source point,
+   * valid where the point has a target index
+   */
+  std::vector<float> correspondence_distances_;
+
+  /** \brief Correspondences of the last iteration */
+  pcl::Correspondences final_correspondences_;
+
+  /** \brief Rotation threshold of the mahalanobis cache, 0 if disabled */
+  double mahalanobis_cache_rotation_threshold_;
+
+  /** \brief Target index mahalanobis_[i] was computed for, -1 if none */
+  std::vector<int> mahalanobis_targets_;
+
+  /** \brief Rotation bucket mahalanobis_[i] was computed in */
+  std::vector<VoxelKey> mahalanobis_buckets_;
+
+  /** \brief Inlier ratio change under which iterations stop, 0 if disabled */
+  double inlier_ratio_epsilon_;
+
+  /** \brief Relative cost decrease under which iterations stop, 0 if disabled */
+  double cost_decrease_epsilon_;
+
+  /** \brief Statistics of the last call to align() */
+  RegistrationStats stats_;
+
+  /** \brief A level of the coarse to fine pyramid */
+  struct PyramidLevel
+  {
+    double resolution;
+    int iterations;
+    /** \brief Downsampled clouds with the covariances of their full
+     * resolution points
+     */
+    PointCloudSourcePtr source;
+    PointCloudTargetPtr target;
+    MatricesVectorPtr source_covariances;
+    MatricesVectorPtr target_covariances;
+    /** \brief Registration of the level, keeps the target search tree while
+     * the target does not change
+     */
+    Ptr engine;
+  };
+
+  /** \brief Pyramid levels, coarsest first, empty if disabled */
+  std::vector<PyramidLevel> pyramid_levels_;
+
+  /** \brief True if the downsampled targets do not match target_ */
+  bool pyramid_target_updated_;
+
+  /** \brief True if the downsampled sources do not match input_ */
+  bool pyramid_source_updated_;
+
+  /** \brief Keep the points of cloud closest to the centroid of their voxel
+   * of side resolution, together with their covariances
+   */
+  template <typename PointT>
+  void downsample(const pcl::PointCloud<PointT>& cloud, const MatricesVector& covariances, double resolution,
+                  pcl::PointCloud<PointT>& downsampled, MatricesVector& downsampled_covariances) const;
+
+  /** \brief Align the pyramid levels, coarse to fine, starting from guess.
+   * Covariances of input_ and target_ must be computed.
+   * \return the transformation to start the full resolution registration from
+   */
+  Eigen::Matrix4f alignPyramid(const Eigen::Matrix4f& guess);
+
+  /** \brief Hand the downsampled sources and their search trees over to the
+   * target side of the levels, see rollSourceToTarget()
+   */
+  void rollPyramidLevels();
+
+  /** \brief Cell size of the target covariance cache keys */
+  double target_cache_resolution_;
+
+  /** \brief True if the covariances of target_ are to be computed through
+   * the cache
+   */
+  bool target_cache_pending_;
+
+  /** \brief Transformation from the target frame to the cache frame */
+  Eigen::Matrix4f target_cache_from_target_;
+
+  /** \brief Cell of each cached target point, indexes
+   * target_cache_covariances_
+   */
+  FlatVoxelHash<int> target_cache_;
+
+  /** \brief Cached target covariances, in the cache frame */
+  MatricesVector target_cache_covariances_;
+
+  /** \brief Microseconds elapsed between start and end */
+  static int64_t elapsedMicroseconds(const std::chrono::steady_clock::time_point& start,
+                                     const std::chrono::steady_clock::time_point& end)
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+  }
+
+  /** \brief Target points bucketed by voxel, read only once built so that the
+   * engines of alignBatch() can share it
+   */
+  struct VoxelHashGrid
+  {
+    /** \brief Voxel of each occupied target voxel, indexes point_begin */
+    FlatVoxelHash<int> hash;
+
+    /** \brief Points of voxel v are in [point_begin[v], point_begin[v + 1]) */
+    std::vector<int> point_begin;
+
+    /** \brief Target points sorted by voxel */
+    std::vector<Eigen::Vector3f> points;
+
+    /** \brief Target index of the points in points */
+    std::vector<int> point_indices;
+
+    /** \brief Resolution the grid was built with */
+    double resolution;
+  };
+
+  /** \brief Voxel hash of the target, NULL until built */
+  boost::shared_ptr<const VoxelHashGrid> voxel_hash_;
+
+  /** \brief True if the target changed since voxel_hash_ was built */
+  bool voxel_hash_updated_;
+
+  /** \brief Build voxel_hash_ on the target with the maximum correspondence
+   * distance as resolution
+   */
+  void buildVoxelHash();
+
+  /** \brief Search for the closest target point in the voxel neighbourhood
+   * of a given point.
+   * \param query the point to search a nearest neighbour for
+   * \param[out] index the index of the nearest neighbour found
+   * \param[out] sq_distance the squared distance to the nearest neighbour
+   * \return false if there is no target point in the neighbourhood
+   */
+  inline bool searchVoxelHash(const Eigen::Vector3f& query, int& index, float& sq_distance) const
+  {
+    int num_neighbors = 27;
+    if (search_method_ == GicpSearchMethod::VOXEL_HASH1)
+      num_neighbors = 1;
+    else if (search_method_ == GicpSearchMethod::VOXEL_HASH7)
+      num_neighbors = 7;
+    const VoxelKey* neighbors = VoxelNeighbors27().data();
+    const VoxelHashGrid& grid = *voxel_hash_;
+    const VoxelKey key = VoxelKey::fromPoint(query[0], query[1], query[2], 1. / grid.resolution);
+    index = -1;
+    sq_distance = std::numeric_limits<float>::max();
+    for (int n = 0; n < num_neighbors; n++)
+    {
+      const int* voxel =
+          grid.hash.find(VoxelKey(key.x + neighbors[n].x, key.y + neighbors[n].y, key.z + neighbors[n].z));
+      if (!voxel)
+        continue;
+      for (int j = grid.point_begin[*voxel]; j < grid.point_begin[*voxel + 1]; j++)
+      {
+        const float d = (grid.points[j] - query).squaredNorm();
+        if (d < sq_distance)
+        {
+          sq_distance = d;
+          index = grid.point_indices[j];
+        }
+      }
+    }
+    return (index >= 0);
+  }
+
   /** \brief compute points covariances matrices according to the K nearest
    * neighbors. K is set via setCorrespondenceRandomness() methode.
    * \param cloud pointer to point cloud
@@ -348,11 +944,34 @@ protected:
    * \param[out] cloud_covariances covariances matrices for each point in the
    * \param recompute recompute covariance matrices based on the inner algorithm
    * cloud
+   * \param indices if not NULL, only the covariances of these points are
+   * computed, the others are left untouched
    */
   template <typename PointT>
   void computeCovariances(typename pcl::PointCloud<PointT>::ConstPtr cloud,
                           const typename pcl::search::KdTree<PointT>::Ptr tree, MatricesVector& cloud_covariances,
-                          bool recompute = false);
+                          bool recompute = false, const std::vector<int>* indices = NULL);
+
+  /** \brief Compute the target covariances, reusing the cached covariances of
+   * the points that were in the previous target, see setInputTargetCached()
+   */
+  void computeTargetCovariancesCached();
+
+  /** \brief Compute the target covariances and voxel hash if missing */
+  void computeTargetStructures();
+
+  /** \brief Copy the registration settings of this instance to engine */
+  void configureEngine(MultithreadedGeneralizedIterativeClosestPoint& engine) const;
+
+  /** \brief True if engine has the registration settings and pyramid levels
+   * of this instance
+   */
+  bool hasSameSettings(const MultithreadedGeneralizedIterativeClosestPoint& engine) const;
+
+  /** \brief Registrations of alignBatch(), one per thread, sharing the target
+   * structures of this instance
+   */
+  std::vector<Ptr> batch_engines_;
 
   /** \return trace of mat1^t . mat2
    * \param mat1 matrix of dimension nxm
@@ -396,7 +1015,7 @@ protected:
   /// \brief optimization functor structure
   struct OptimizationFunctorWithIndices : public BFGSDummyFunctor<double, 6>
   {
-    OptimizationFunctorWithIndices(const MultithreadedGeneralizedIterativeClosestPoint* gicp)
+    OptimizationFunctorWithIndices(MultithreadedGeneralizedIterativeClosestPoint* gicp)
       : BFGSDummyFunctor<double, 6>(), gicp_(gicp)
     {
     }
@@ -404,9 +1023,159 @@ protected:
     void df(const Vector6d& x, Vector6d& df);
     void fdf(const Vector6d& x, double& f, Vector6d& df);
 
-    const MultithreadedGeneralizedIterativeClosestPoint* gicp_;
+    MultithreadedGeneralizedIterativeClosestPoint* gicp_;
   };
 
+  /** \brief Correspondences of the current optimization stored as structure of
+   * arrays: source points mapped by base_transformation_, target points and the
+   * upper triangle of the mahalanobis matrix of each pair.
+   */
+  struct CorrespondencesSoA
+  {
+    std::vector<double> src_x, src_y, src_z;
+    std::vector<double> tgt_x, tgt_y, tgt_z;
+    std::vector<double> m_xx, m_xy, m_xz, m_yy, m_yz, m_zz;
+
+    void resize(size_t n)
+    {
+      for (std::vector<double>* v : { &src_x, &src_y, &src_z, &tgt_x, &tgt_y, &tgt_z, &m_xx, &m_xy, &m_xz, &m_yy,
+                                      &m_yz, &m_zz })
+        v->resize(n);
+    }
+
+    size_t size() const
+    {
+      return src_x.size();
+    }
+  };
+
+  /** \brief Cost and gradient sums over one chunk of correspondences. */
+  struct PartialSums
+  {
+    double f;
+    Eigen::Vector3d g;
+    Eigen::Matrix3d R;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  /** \brief Number of correspondences summed per chunk. Chunks do not depend on
+   * the number of threads and are reduced in order, so the result is the same
+   * for any number of threads.
+   */
+  static const int k_correspondence_chunk_size_ = 256;
+
+  /** \brief Packed correspondences, filled once per optimizer call. */
+  CorrespondencesSoA correspondences_;
+
+  /** \brief Packed correspondences when evaluating in single precision. */
+  gicp_simd::CorrespondencesSoAf correspondences_f_;
+
+  /** \brief Evaluate the cost function in single precision if possible */
+  bool single_precision_;
+
+  /** \brief Number of packed correspondences */
+  int num_correspondences_;
+
+  /** \brief True if the packed correspondences are in correspondences_f_ */
+  inline bool useSinglePrecision() const
+  {
+    return (single_precision_ && solver_ == GicpSolver::BFGS);
+  }
+
+  /** \brief Per chunk partial sums, reused across evaluations. */
+  std::vector<PartialSums, Eigen::aligned_allocator<PartialSums>> partial_sums_;
+
+  /** \brief Pack the correspondences and their mahalanobis matrices into
+   * correspondences_ for the cost function evaluations. The mahalanobis
+   * matrices are scaled by the robust kernel weights of the residuals at
+   * transformation_matrix.
+   */
+  void packCorrespondences(const PointCloudSource& cloud_src, const std::vector<int>& indices_src,
+                           const PointCloudTarget& cloud_tgt, const std::vector<int>& indices_tgt,
+                           const Eigen::Matrix4f& transformation_matrix);
+
+  /** \brief Pack the correspondences into the double or float layout c. */
+  template <typename SoA>
+  void packCorrespondences(const PointCloudSource& cloud_src, const std::vector<int>& indices_src,
+                           const PointCloudTarget& cloud_tgt, const std::vector<int>& indices_tgt,
+                           const Eigen::Matrix4f& transformation_matrix, SoA& c);
+
+  /** \brief Robust kernel in use */
+  RobustKernel robust_kernel_;
+
+  /** \brief Width of the robust kernel, in mahalanobis distance units */
+  double robust_kernel_width_;
+
+  /** \brief IRLS weight of a correspondence with squared mahalanobis
+   * distance sq_distance
+   */
+  inline double robustWeight(double sq_distance) const
+  {
+    const double c2 = robust_kernel_width_ * robust_kernel_width_;
+    switch (robust_kernel_)
+    {
+      case RobustKernel::HUBER:
+        return (sq_distance <= c2 ? 1. : robust_kernel_width_ / std::sqrt(sq_distance));
+      case RobustKernel::CAUCHY:
+        return (c2 / (c2 + sq_distance));
+      case RobustKernel::GEMAN_MCCLURE:
+      {
+        const double w = c2 / (c2 + sq_distance);
+        return (w * w);
+      }
+      default:
+        return (1.);
+    }
+  }
+
+  /** \brief Evaluate the cost function on the packed correspondences.
+   * \param[in] x the state at which the cost function is evaluated
+   * \param[out] g the gradient at x, not computed if NULL
+   * \return the cost at x
+   */
+  double evaluateCorrespondences(const Vector6d& x, Vector6d* g);
+
+  /** \brief Sum the cost (and gradient) terms of all the packed
+   * correspondences at the transformation A, in parallel.
+   */
+  void sumCorrespondences(const Eigen::Matrix4d& A, bool with_gradient, PartialSums& sums);
+
+  /** \brief Mean cost of the packed correspondences at the given
+   * transformation, NaN if there is none.
+   */
+  double computeCost(const Eigen::Matrix4f& transformation_matrix);
+
+  /** \brief Sum the cost (and gradient) terms of the packed correspondences
+   * in [begin, end) at the transformation A.
+   */
+  template <bool with_gradient>
+  void accumulateCorrespondences(const Eigen::Matrix4d& A, int begin, int end, PartialSums& sums) const;
+
+  /** \brief Cost and normal equations sums over one chunk of correspondences. */
+  struct NormalEquationsSums
+  {
+    double f;
+    Matrix6d H;
+    Vector6d b;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  /** \brief Per chunk normal equations sums, reused across evaluations. */
+  std::vector<NormalEquationsSums, Eigen::aligned_allocator<NormalEquationsSums>> normal_equations_sums_;
+
+  /** \brief Build the normal equations H*dx = -b of the packed correspondences
+   * linearized at A, for a left perturbation dx = [translation, rotation].
+   * \return the cost at A
+   */
+  double buildNormalEquations(const Eigen::Matrix4d& A, Matrix6d& H, Vector6d& b);
+
+  /** \brief Gauss-Newton (damped = false) or Levenberg-Marquardt (damped =
+   * true) estimation on the packed correspondences.
+   */
+  void estimateRigidTransformationNewton(const PointCloudSource& cloud_src, const std::vector<int>& indices_src,
+                                         const PointCloudTarget& cloud_tgt, const std::vector<int>& indices_tgt,
+                                         Eigen::Matrix4f& transformation_matrix, bool damped);
+
   boost::function<void(const pcl::PointCloud<PointSource>& cloud_src, const std::vector<int>& src_indices,
                        const pcl::PointCloud<PointTarget>& cloud_tgt, const std::vector<int>& tgt_indices,
                        Eigen::Matrix4f& transformation_matrix)>
@@ -416,6 +1185,9 @@ private:
   /** \brief Number of threads that GICP is allowed to use. */
   int k_num_threads_;
 
+  /** \brief Workers running the parallel loops */
+  RegistrationThreadPool::Ptr thread_pool_;
+
   /** \brief Enables log print statements with GICP timing information. */
   bool k_enable_timing_output_;
 
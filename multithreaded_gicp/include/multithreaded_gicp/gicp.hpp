@@ -41,9 +41,10 @@
 #define IMPL_MULTITHREADEd_GICP_HPP_
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
 #include <fstream>
-#include <omp.h>
+#include <pcl/common/io.h>
 #include <pcl/features/feature.h>
 #include <pcl/registration/boost.h>
 #include <pcl/registration/exceptions.h>
@@ -68,7 +69,8 @@ void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
     computeCovariances(typename pcl::PointCloud<PointT>::ConstPtr cloud,
                        const typename pcl::search::KdTree<PointT>::Ptr kdtree,
                        MatricesVector& cloud_covariances,
-                       bool recompute) {
+                       bool recompute,
+                       const std::vector<int>* indices) {
   if (k_correspondences_ > int(cloud->size())) {
     PCL_ERROR("[pcl::MultithreadedGeneralizedIterativeClosestPoint::"
               "computeCovariances] Number or points in cloud (%lu) is less "
@@ -79,79 +81,102 @@ void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
   }
 
   if (std::is_same<PointSource, PointF>::value and !recompute) {
-    CalculateCovarianceFromNormals(cloud, cloud_covariances, k_num_threads_);
+    // Same covariance as CalculateCovarianceFromNormals, the plane of the
+    // normal with gicp_epsilon_ along it, on the registration pool and in
+    // place for a subset of indices
+    if (cloud_covariances.size() < cloud->size()) {
+      cloud_covariances.resize(cloud->size());
+    }
+    thread_pool_->parallelFor(
+        static_cast<int>(indices ? indices->size() : cloud->size()),
+        256,
+        [&](int begin, int end, int) {
+          for (int j = begin; j < end; j++) {
+            const int i = indices ? (*indices)[j] : j;
+            const PointT& pt = cloud->points[i];
+            const Eigen::Vector3d normal(pt.normal_x, pt.normal_y, pt.normal_z);
+            cloud_covariances[i] = Eigen::Matrix3d::Identity() -
+                (1. - gicp_epsilon_) * normal * normal.transpose();
+          }
+        });
   } else {
     // TODO cloud->points.size() vs cloud->size() ? any difference?
     if (cloud_covariances.size() < cloud->size()) {
       cloud_covariances.resize(cloud->size());
     }
 
-    int enable_omp = (1 < k_num_threads_);
-#pragma omp parallel for schedule(dynamic, 1) if (enable_omp)
-    for (int i = 0; i < cloud->points.size(); i++) {
-      if (k_enable_timing_output_) {
-        if (0 == i) {
-          ROS_INFO_STREAM("Using " << omp_get_num_threads() << " threads");
-        }
-      }
+    // Per thread neighbour buffers, kept across calls
+    const int num_threads = thread_pool_->numThreads();
+    if (static_cast<int>(covariance_nn_indices_.size()) < num_threads) {
+      covariance_nn_indices_.resize(num_threads);
+      covariance_nn_dists_.resize(num_threads);
+    }
 
-      Eigen::Vector3d mean;
-      std::vector<int> nn_indices(k_correspondences_);
-      std::vector<float> nn_dist_sq(k_correspondences_);
-      const PointT& query_point = cloud->points[i];
-      Eigen::Matrix3d& cov = cloud_covariances[i];
-      // Zero out the cov and mean
-      cov.setZero();
-      mean.setZero();
+    if (k_enable_timing_output_) {
+      ROS_INFO_STREAM("Using " << num_threads << " threads");
+    }
 
-      // Search for the K nearest neighbours
-      kdtree->nearestKSearch(
-          query_point, k_correspondences_, nn_indices, nn_dist_sq);
+    thread_pool_->parallelFor(
+        static_cast<int>(indices ? indices->size() : cloud->points.size()),
+        64,
+        [&](int begin, int end, int thread) {
+          std::vector<int>& nn_indices = covariance_nn_indices_[thread];
+          std::vector<float>& nn_dist_sq = covariance_nn_dists_[thread];
+          for (int j = begin; j < end; j++) {
+            const int i = indices ? (*indices)[j] : j;
+            Eigen::Vector3d mean;
+            const PointT& query_point = cloud->points[i];
+            Eigen::Matrix3d& cov = cloud_covariances[i];
+            // Zero out the cov and mean
+            cov.setZero();
+            mean.setZero();
 
-      // Find the covariance matrix
-      for (int j = 0; j < k_correspondences_; j++) {
-        const PointT& pt = (*cloud)[nn_indices[j]];
+            // Search for the K nearest neighbours
+            kdtree->nearestKSearch(
+                query_point, k_correspondences_, nn_indices, nn_dist_sq);
 
-        mean[0] += pt.x;
-        mean[1] += pt.y;
-        mean[2] += pt.z;
+            // Find the covariance matrix
+            for (int k = 0; k < k_correspondences_; k++) {
+              const PointT& pt = (*cloud)[nn_indices[k]];
 
-        cov(0, 0) += pt.x * pt.x;
+              mean[0] += pt.x;
+              mean[1] += pt.y;
+              mean[2] += pt.z;
 
-        cov(1, 0) += pt.y * pt.x;
-        cov(1, 1) += pt.y * pt.y;
+              cov(0, 0) += pt.x * pt.x;
 
-        cov(2, 0) += pt.z * pt.x;
-        cov(2, 1) += pt.z * pt.y;
-        cov(2, 2) += pt.z * pt.z;
-      }
+              cov(1, 0) += pt.y * pt.x;
+              cov(1, 1) += pt.y * pt.y;
 
-      mean /= static_cast<double>(k_correspondences_);
-      // Get the actual covariance
-      for (int k = 0; k < 3; k++) {
-        for (int l = 0; l <= k; l++) {
-          cov(k, l) /= static_cast<double>(k_correspondences_);
-          cov(k, l) -= mean[k] * mean[l];
-          cov(l, k) = cov(k, l);
-        }
-      }
+              cov(2, 0) += pt.z * pt.x;
+              cov(2, 1) += pt.z * pt.y;
+              cov(2, 2) += pt.z * pt.z;
+            }
 
-      // Compute the SVD (covariance matrix is symmetric so U = V')
-      Eigen::JacobiSVD<Eigen::Matrix3d> svd(cov, Eigen::ComputeFullU);
-      cov.setZero();
-      Eigen::Matrix3d U = svd.matrixU();
-
-      // Reconstitute the covariance matrix with modified singular values using
-      // the column     // vectors in V.
-      for (int k = 0; k < 3; k++) {
-        Eigen::Vector3d col = U.col(k);
-        double v = 1.; // biggest 2 singular values replaced by 1
-        if (k == 2) {  // smallest singular value replaced by gicp_epsilon
-          v = gicp_epsilon_;
-        }
-        cov += v * col * col.transpose();
-      }
-    }
+            mean /= static_cast<double>(k_correspondences_);
+            // Get the actual covariance
+            for (int k = 0; k < 3; k++) {
+              for (int l = 0; l <= k; l++) {
+                cov(k, l) /= static_cast<double>(k_correspondences_);
+                cov(k, l) -= mean[k] * mean[l];
+                cov(l, k) = cov(k, l);
+              }
+            }
+
+            // Closed form eigen decomposition, the covariance matrix is
+            // symmetric so its eigenvectors are its singular vectors
+            Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigen_solver;
+            eigen_solver.computeDirect(cov);
+            // Eigenvector of the smallest eigenvalue (increasing order)
+            const Eigen::Vector3d normal = eigen_solver.eigenvectors().col(0);
+
+            // Reconstitute the covariance matrix with the biggest 2 singular
+            // values replaced by 1 and the smallest by gicp_epsilon:
+            // U diag(1, 1, eps) U' = I - (1 - eps) n n'
+            cov = Eigen::Matrix3d::Identity() -
+                (1. - gicp_epsilon_) * normal * normal.transpose();
+          }
+        });
   }
 }
 
@@ -245,6 +270,8 @@ void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
   tmp_tgt_ = &cloud_tgt;
   tmp_idx_src_ = &indices_src;
   tmp_idx_tgt_ = &indices_tgt;
+  packCorrespondences(
+      cloud_src, indices_src, cloud_tgt, indices_tgt, transformation_matrix);
 
   // Optimize using forward-difference approximation LM
   const double gradient_tol = 1e-2;
@@ -286,34 +313,396 @@ void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
   }
 }
 
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget>::
+    packCorrespondences(const PointCloudSource& cloud_src,
+                        const std::vector<int>& indices_src,
+                        const PointCloudTarget& cloud_tgt,
+                        const std::vector<int>& indices_tgt,
+                        const Eigen::Matrix4f& transformation_matrix) {
+  num_correspondences_ = static_cast<int>(indices_src.size());
+  if (useSinglePrecision()) {
+    packCorrespondences(cloud_src,
+                        indices_src,
+                        cloud_tgt,
+                        indices_tgt,
+                        transformation_matrix,
+                        correspondences_f_);
+  } else {
+    packCorrespondences(cloud_src,
+                        indices_src,
+                        cloud_tgt,
+                        indices_tgt,
+                        transformation_matrix,
+                        correspondences_);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+template <typename SoA>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget>::
+    packCorrespondences(const PointCloudSource& cloud_src,
+                        const std::vector<int>& indices_src,
+                        const PointCloudTarget& cloud_tgt,
+                        const std::vector<int>& indices_tgt,
+                        const Eigen::Matrix4f& transformation_matrix,
+                        SoA& c) {
+  const int m = static_cast<int>(indices_src.size());
+  c.resize(m);
+  const Eigen::Matrix4d base = base_transformation_.cast<double>();
+  const Eigen::Matrix4d T = transformation_matrix.cast<double>();
+  const bool robust = robust_kernel_ != RobustKernel::NONE;
+
+  thread_pool_->parallelFor(
+      m, k_correspondence_chunk_size_, [&](int begin, int end, int) {
+        for (int i = begin; i < end; ++i) {
+          const Eigen::Vector3d p = cloud_src.points[indices_src[i]]
+                                        .getVector3fMap()
+                                        .template cast<double>();
+          const Eigen::Vector3d p_src =
+              base.topLeftCorner<3, 3>() * p + base.block<3, 1>(0, 3);
+          const PointTarget& p_tgt = cloud_tgt.points[indices_tgt[i]];
+          const Eigen::Matrix3d& M = mahalanobis(indices_src[i]);
+          // IRLS weight of the residual at the current transformation
+          double w = 1.;
+          if (robust) {
+            const Eigen::Vector3d res =
+                T.topLeftCorner<3, 3>() * p + T.block<3, 1>(0, 3) -
+                p_tgt.getVector3fMap().template cast<double>();
+            w = robustWeight(res.dot(M * res));
+          }
+          c.src_x[i] = p_src[0];
+          c.src_y[i] = p_src[1];
+          c.src_z[i] = p_src[2];
+          c.tgt_x[i] = p_tgt.x;
+          c.tgt_y[i] = p_tgt.y;
+          c.tgt_z[i] = p_tgt.z;
+          c.m_xx[i] = w * M(0, 0);
+          c.m_xy[i] = w * M(0, 1);
+          c.m_xz[i] = w * M(0, 2);
+          c.m_yy[i] = w * M(1, 1);
+          c.m_yz[i] = w * M(1, 2);
+          c.m_zz[i] = w * M(2, 2);
+        }
+      });
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+template <bool with_gradient>
+inline void
+pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
+    accumulateCorrespondences(const Eigen::Matrix4d& A,
+                              int begin,
+                              int end,
+                              PartialSums& sums) const {
+  const CorrespondencesSoA& c = correspondences_;
+  const double* sx = c.src_x.data();
+  const double* sy = c.src_y.data();
+  const double* sz = c.src_z.data();
+  const double* tx = c.tgt_x.data();
+  const double* ty = c.tgt_y.data();
+  const double* tz = c.tgt_z.data();
+  const double* mxx = c.m_xx.data();
+  const double* mxy = c.m_xy.data();
+  const double* mxz = c.m_xz.data();
+  const double* myy = c.m_yy.data();
+  const double* myz = c.m_yz.data();
+  const double* mzz = c.m_zz.data();
+
+  const double a00 = A(0, 0), a01 = A(0, 1), a02 = A(0, 2), a03 = A(0, 3);
+  const double a10 = A(1, 0), a11 = A(1, 1), a12 = A(1, 2), a13 = A(1, 3);
+  const double a20 = A(2, 0), a21 = A(2, 1), a22 = A(2, 2), a23 = A(2, 3);
+
+  double f = 0., g0 = 0., g1 = 0., g2 = 0.;
+  double r00 = 0., r01 = 0., r02 = 0., r10 = 0., r11 = 0., r12 = 0., r20 = 0.,
+         r21 = 0., r22 = 0.;
+#pragma omp simd reduction(+ : f, g0, g1, g2, r00, r01, r02, r10, r11, r12, \
+                           r20, r21, r22)
+  for (int i = begin; i < end; ++i) {
+    // res = A*p_src - p_tgt
+    const double res0 = a00 * sx[i] + a01 * sy[i] + a02 * sz[i] + a03 - tx[i];
+    const double res1 = a10 * sx[i] + a11 * sy[i] + a12 * sz[i] + a13 - ty[i];
+    const double res2 = a20 * sx[i] + a21 * sy[i] + a22 * sz[i] + a23 - tz[i];
+    // temp = M*res
+    const double temp0 = mxx[i] * res0 + mxy[i] * res1 + mxz[i] * res2;
+    const double temp1 = mxy[i] * res0 + myy[i] * res1 + myz[i] * res2;
+    const double temp2 = mxz[i] * res0 + myz[i] * res1 + mzz[i] * res2;
+    f += res0 * temp0 + res1 * temp1 + res2 * temp2;
+    if (with_gradient) {
+      // Translation gradient
+      g0 += temp0;
+      g1 += temp1;
+      g2 += temp2;
+      // Rotation gradient, R += p_src * temp'
+      r00 += sx[i] * temp0;
+      r01 += sx[i] * temp1;
+      r02 += sx[i] * temp2;
+      r10 += sy[i] * temp0;
+      r11 += sy[i] * temp1;
+      r12 += sy[i] * temp2;
+      r20 += sz[i] * temp0;
+      r21 += sz[i] * temp1;
+      r22 += sz[i] * temp2;
+    }
+  }
+  sums.f = f;
+  sums.g << g0, g1, g2;
+  sums.R << r00, r01, r02, r10, r11, r12, r20, r21, r22;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget>::
+    sumCorrespondences(const Eigen::Matrix4d& A,
+                       bool with_gradient,
+                       PartialSums& sums) {
+  const int m = num_correspondences_;
+  const int chunk_size = k_correspondence_chunk_size_;
+  const int num_chunks = (m + chunk_size - 1) / chunk_size;
+  partial_sums_.resize(num_chunks);
+  const bool single_precision = useSinglePrecision();
+  // Row major 3x4 transformation for the single precision kernels
+  float A_f[12];
+  for (int r = 0; r < 3; r++) {
+    for (int col = 0; col < 4; col++) {
+      A_f[4 * r + col] = static_cast<float>(A(r, col));
+    }
+  }
+
+  thread_pool_->parallelFor(m, chunk_size, [&](int begin, int end, int) {
+    const int k = begin / chunk_size;
+    if (single_precision) {
+      gicp_simd::Sums chunk_sums;
+      if (with_gradient)
+        gicp_simd::accumulate<true>(
+            A_f, correspondences_f_, begin, end, chunk_sums);
+      else
+        gicp_simd::accumulate<false>(
+            A_f, correspondences_f_, begin, end, chunk_sums);
+      partial_sums_[k].f = chunk_sums.f;
+      partial_sums_[k].g = Eigen::Map<const Eigen::Vector3d>(chunk_sums.g);
+      partial_sums_[k].R =
+          Eigen::Map<const Eigen::Matrix<double, 3, 3, Eigen::RowMajor>>(
+              chunk_sums.R);
+    } else if (with_gradient) {
+      accumulateCorrespondences<true>(A, begin, end, partial_sums_[k]);
+    } else {
+      accumulateCorrespondences<false>(A, begin, end, partial_sums_[k]);
+    }
+  });
+
+  // Reduce in chunk order so that the result does not depend on the threads
+  sums.f = 0.;
+  sums.g.setZero();
+  sums.R.setZero();
+  for (int k = 0; k < num_chunks; ++k) {
+    sums.f += partial_sums_[k].f;
+    sums.g += partial_sums_[k].g;
+    sums.R += partial_sums_[k].R;
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+double
+pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
+    evaluateCorrespondences(const Vector6d& x, Vector6d* g) {
+  Eigen::Matrix4f transformation_matrix = base_transformation_;
+  applyState(transformation_matrix, x);
+  // The packed source points are already mapped by base_transformation_
+  const Eigen::Matrix4d A = transformation_matrix.cast<double>() *
+      base_transformation_.cast<double>().inverse();
+
+  const int m = num_correspondences_;
+  PartialSums sums;
+  sumCorrespondences(A, g != NULL, sums);
+  if (g) {
+    g->setZero();
+    // g.head<3> () = 2*sum(M*res)/num_matches
+    g->head<3>() = sums.g * (2.0 / m);
+    sums.R *= 2.0 / m;
+    computeRDerivative(x, sums.R, *g);
+  }
+  return sums.f / double(m);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+double
+pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
+    computeCost(const Eigen::Matrix4f& transformation_matrix) {
+  const int m = num_correspondences_;
+  if (m == 0) {
+    return std::numeric_limits<double>::quiet_NaN();
+  }
+  // The packed source points are already mapped by base_transformation_
+  const Eigen::Matrix4d A = transformation_matrix.cast<double>() *
+      base_transformation_.cast<double>().inverse();
+  PartialSums sums;
+  sumCorrespondences(A, false, sums);
+  return sums.f / double(m);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+double
+pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
+    buildNormalEquations(const Eigen::Matrix4d& A, Matrix6d& H, Vector6d& b) {
+  const CorrespondencesSoA& c = correspondences_;
+  const int m = static_cast<int>(c.size());
+  const int chunk_size = k_correspondence_chunk_size_;
+  const int num_chunks = (m + chunk_size - 1) / chunk_size;
+  normal_equations_sums_.resize(num_chunks);
+
+  thread_pool_->parallelFor(m, chunk_size, [&](int begin, int end, int) {
+    NormalEquationsSums& sums = normal_equations_sums_[begin / chunk_size];
+    sums.f = 0.;
+    sums.H.setZero();
+    sums.b.setZero();
+    Eigen::Matrix<double, 3, 6> J;
+    J.leftCols<3>().setIdentity();
+    for (int i = begin; i < end; ++i) {
+      const Eigen::Vector3d p =
+          A.topLeftCorner<3, 3>() *
+              Eigen::Vector3d(c.src_x[i], c.src_y[i], c.src_z[i]) +
+          A.block<3, 1>(0, 3);
+      const Eigen::Vector3d res =
+          p - Eigen::Vector3d(c.tgt_x[i], c.tgt_y[i], c.tgt_z[i]);
+      Eigen::Matrix3d M;
+      M << c.m_xx[i], c.m_xy[i], c.m_xz[i], c.m_xy[i], c.m_yy[i], c.m_yz[i],
+          c.m_xz[i], c.m_yz[i], c.m_zz[i];
+      const Eigen::Vector3d temp = M * res;
+      // d(res)/d(dx) = [I, -[p]x]
+      J.rightCols<3>() << 0., p[2], -p[1], -p[2], 0., p[0], p[1], -p[0], 0.;
+      const Eigen::Matrix<double, 6, 3> JtM = J.transpose() * M;
+      sums.f += res.dot(temp);
+      sums.H.noalias() += JtM * J;
+      sums.b.noalias() += J.transpose() * temp;
+    }
+  });
+
+  // Reduce in chunk order so that the result does not depend on the threads
+  double f = 0.;
+  H.setZero();
+  b.setZero();
+  for (int k = 0; k < num_chunks; ++k) {
+    f += normal_equations_sums_[k].f;
+    H += normal_equations_sums_[k].H;
+    b += normal_equations_sums_[k].b;
+  }
+  return f / double(m);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget>::
+    estimateRigidTransformationNewton(const PointCloudSource& cloud_src,
+                                      const std::vector<int>& indices_src,
+                                      const PointCloudTarget& cloud_tgt,
+                                      const std::vector<int>& indices_tgt,
+                                      Eigen::Matrix4f& transformation_matrix,
+                                      bool damped) {
+  if (indices_src.size() < 4) { // need at least 4 samples
+    PCL_THROW_EXCEPTION(
+        NotEnoughPointsException,
+        "[pcl::MultithreadedGeneralizedIterativeClosestPoint::"
+        "estimateRigidTransformationNewton] Need at least 4 points to estimate "
+        "a transform! Source and target have "
+            << indices_src.size() << " points!");
+    return;
+  }
+  packCorrespondences(
+      cloud_src, indices_src, cloud_tgt, indices_tgt, transformation_matrix);
+
+  // Stop once both the translation and rotation increments are this small
+  const double increment_tol = 1e-6;
+  // Levenberg-Marquardt damping, relative to the diagonal of H
+  double lambda = 1e-3;
+
+  // The packed source points are already mapped by base_transformation_
+  const Eigen::Matrix4d base_inverse =
+      base_transformation_.cast<double>().inverse();
+  Eigen::Matrix4d T = transformation_matrix.cast<double>();
+  Matrix6d H;
+  Vector6d b;
+  double f = buildNormalEquations(T * base_inverse, H, b);
+
+  int inner_iterations = 0;
+  while (inner_iterations < max_inner_iterations_) {
+    inner_iterations++;
+    Matrix6d H_damped = H;
+    if (damped) {
+      H_damped.diagonal() += lambda * H.diagonal();
+    }
+    const Vector6d dx = H_damped.ldlt().solve(-b);
+    if (!dx.allFinite()) {
+      PCL_THROW_EXCEPTION(
+          SolverDidntConvergeException,
+          "[pcl::" << getClassName()
+                   << "::estimateRigidTransformationNewton] Degenerate normal "
+                      "equations, solver didn't converge!");
+    }
+
+    // T <- exp(dx) * T
+    Eigen::Matrix4d T_update = Eigen::Matrix4d::Identity();
+    const double angle = dx.tail<3>().norm();
+    if (angle > 0.) {
+      T_update.topLeftCorner<3, 3>() =
+          Eigen::AngleAxisd(angle, dx.tail<3>() / angle).toRotationMatrix();
+    }
+    T_update.block<3, 1>(0, 3) = dx.head<3>();
+    const Eigen::Matrix4d T_new = T_update * T;
+    const bool converged =
+        dx.head<3>().norm() < increment_tol && angle < increment_tol;
+
+    if (!damped) {
+      T = T_new;
+      if (converged) {
+        break;
+      }
+      f = buildNormalEquations(T * base_inverse, H, b);
+      continue;
+    }
+
+    // Levenberg-Marquardt only keeps steps that decrease the cost
+    Matrix6d H_new;
+    Vector6d b_new;
+    const double f_new =
+        buildNormalEquations(T_new * base_inverse, H_new, b_new);
+    if (f_new < f) {
+      T = T_new;
+      f = f_new;
+      H = H_new;
+      b = b_new;
+      lambda = std::max(lambda * 0.1, 1e-7);
+    } else {
+      lambda *= 10.;
+    }
+    if (converged) {
+      break;
+    }
+  }
+  PCL_DEBUG("[pcl::%s::estimateRigidTransformationNewton] Finished after %d "
+            "iterations with cost %f\n",
+            getClassName().c_str(),
+            inner_iterations,
+            f);
+  transformation_matrix = T.cast<float>();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////
 template <typename PointSource, typename PointTarget>
 inline double
 pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
     OptimizationFunctorWithIndices::operator()(const Vector6d& x) {
-  Eigen::Matrix4f transformation_matrix = gicp_->base_transformation_;
-  gicp_->applyState(transformation_matrix, x);
-  double f = 0;
-  int m = static_cast<int>(gicp_->tmp_idx_src_->size());
-  for (int i = 0; i < m; ++i) {
-    // The last coordinate, p_src[3] is guaranteed to be set to 1.0 in
-    // registration.hpp
-    Vector4fMapConst p_src =
-        gicp_->tmp_src_->points[(*gicp_->tmp_idx_src_)[i]].getVector4fMap();
-    // The last coordinate, p_tgt[3] is guaranteed to be set to 1.0 in
-    // registration.hpp
-    Vector4fMapConst p_tgt =
-        gicp_->tmp_tgt_->points[(*gicp_->tmp_idx_tgt_)[i]].getVector4fMap();
-    Eigen::Vector4f pp(transformation_matrix * p_src);
-    // Estimate the distance (cost function)
-    // The last coordiante is still guaranteed to be set to 1.0
-    Eigen::Vector3d res(pp[0] - p_tgt[0], pp[1] - p_tgt[1], pp[2] - p_tgt[2]);
-    Eigen::Vector3d temp(gicp_->mahalanobis((*gicp_->tmp_idx_src_)[i]) * res);
-    // increment= res'*temp/num_matches = temp'*M*temp/num_matches (we postpone
-    // 1/num_matches after the loop closes)
-    f += double(res.transpose() * temp);
-  }
-  return f / m;
+  return gicp_->evaluateCorrespondences(x, NULL);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
@@ -321,40 +710,7 @@ template <typename PointSource, typename PointTarget>
 inline void
 pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
     OptimizationFunctorWithIndices::df(const Vector6d& x, Vector6d& g) {
-  Eigen::Matrix4f transformation_matrix = gicp_->base_transformation_;
-  gicp_->applyState(transformation_matrix, x);
-  // Zero out g
-  g.setZero();
-  // Eigen::Vector3d g_t = g.head<3> ();
-  Eigen::Matrix3d R = Eigen::Matrix3d::Zero();
-  int m = static_cast<int>(gicp_->tmp_idx_src_->size());
-  for (int i = 0; i < m; ++i) {
-    // The last coordinate, p_src[3] is guaranteed to be set to 1.0 in
-    // registration.hpp
-    Vector4fMapConst p_src =
-        gicp_->tmp_src_->points[(*gicp_->tmp_idx_src_)[i]].getVector4fMap();
-    // The last coordinate, p_tgt[3] is guaranteed to be set to 1.0 in
-    // registration.hpp
-    Vector4fMapConst p_tgt =
-        gicp_->tmp_tgt_->points[(*gicp_->tmp_idx_tgt_)[i]].getVector4fMap();
-
-    Eigen::Vector4f pp(transformation_matrix * p_src);
-    // The last coordiante is still guaranteed to be set to 1.0
-    Eigen::Vector3d res(pp[0] - p_tgt[0], pp[1] - p_tgt[1], pp[2] - p_tgt[2]);
-    // temp = M*res
-    Eigen::Vector3d temp(gicp_->mahalanobis((*gicp_->tmp_idx_src_)[i]) * res);
-    // Increment translation gradient
-    // g.head<3> ()+= 2*M*res/num_matches (we postpone 2/num_matches after the
-    // loop closes)
-    g.head<3>() += temp;
-    // Increment rotation gradient
-    pp = gicp_->base_transformation_ * p_src;
-    Eigen::Vector3d p_src3(pp[0], pp[1], pp[2]);
-    R += p_src3 * temp.transpose();
-  }
-  g.head<3>() *= 2.0 / m;
-  R *= 2.0 / m;
-  gicp_->computeRDerivative(x, R, g);
+  gicp_->evaluateCorrespondences(x, &g);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
@@ -364,41 +720,464 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
     OptimizationFunctorWithIndices::fdf(const Vector6d& x,
                                         double& f,
                                         Vector6d& g) {
-  Eigen::Matrix4f transformation_matrix = gicp_->base_transformation_;
-  gicp_->applyState(transformation_matrix, x);
-  f = 0;
-  g.setZero();
-  Eigen::Matrix3d R = Eigen::Matrix3d::Zero();
-  const int m = static_cast<const int>(gicp_->tmp_idx_src_->size());
-  for (int i = 0; i < m; ++i) {
-    // The last coordinate, p_src[3] is guaranteed to be set to 1.0 in
-    // registration.hpp
-    Vector4fMapConst p_src =
-        gicp_->tmp_src_->points[(*gicp_->tmp_idx_src_)[i]].getVector4fMap();
-    // The last coordinate, p_tgt[3] is guaranteed to be set to 1.0 in
-    // registration.hpp
-    Vector4fMapConst p_tgt =
-        gicp_->tmp_tgt_->points[(*gicp_->tmp_idx_tgt_)[i]].getVector4fMap();
-    Eigen::Vector4f pp(transformation_matrix * p_src);
-    // The last coordiante is still guaranteed to be set to 1.0
-    Eigen::Vector3d res(pp[0] - p_tgt[0], pp[1] - p_tgt[1], pp[2] - p_tgt[2]);
-    // temp = M*res
-    Eigen::Vector3d temp(gicp_->mahalanobis((*gicp_->tmp_idx_src_)[i]) * res);
-    // Increment total error
-    f += double(res.transpose() * temp);
-    // Increment translation gradient
-    // g.head<3> ()+= 2*M*res/num_matches (we postpone 2/num_matches after the
-    // loop closes)
-    g.head<3>() += temp;
-    pp = gicp_->base_transformation_ * p_src;
-    Eigen::Vector3d p_src3(pp[0], pp[1], pp[2]);
-    // Increment rotation gradient
-    R += p_src3 * temp.transpose();
-  }
-  f /= double(m);
-  g.head<3>() *= double(2.0 / m);
-  R *= 2.0 / m;
-  gicp_->computeRDerivative(x, R, g);
+  f = gicp_->evaluateCorrespondences(x, &g);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget>::
+    buildVoxelHash() {
+  // Built into a new grid, the previous one may still be shared by engines
+  boost::shared_ptr<VoxelHashGrid> grid(new VoxelHashGrid);
+  grid->resolution = corr_dist_threshold_;
+  const double inverse_resolution = 1. / grid->resolution;
+  const int N = static_cast<int>(target_->size());
+
+  // Assign a voxel to each point and count the points per voxel
+  std::vector<int> point_voxels(N, -1);
+  std::vector<int> voxel_sizes;
+  for (int i = 0; i < N; i++) {
+    const PointTarget& pt = target_->points[i];
+    if (!pcl::isFinite(pt)) {
+      continue;
+    }
+    std::pair<int*, bool> voxel = grid->hash.insert(
+        VoxelKey::fromPoint(pt.x, pt.y, pt.z, inverse_resolution),
+        static_cast<int>(voxel_sizes.size()));
+    if (voxel.second) {
+      voxel_sizes.push_back(0);
+    }
+    point_voxels[i] = *voxel.first;
+    voxel_sizes[*voxel.first]++;
+  }
+
+  // Lay the points out contiguously per voxel, in index order
+  std::vector<int>& point_begin = grid->point_begin;
+  point_begin.resize(voxel_sizes.size() + 1);
+  point_begin[0] = 0;
+  for (size_t v = 0; v < voxel_sizes.size(); v++) {
+    point_begin[v + 1] = point_begin[v] + voxel_sizes[v];
+  }
+  std::vector<int> voxel_fill(point_begin.begin(), point_begin.end() - 1);
+  grid->points.resize(point_begin.back());
+  grid->point_indices.resize(point_begin.back());
+  for (int i = 0; i < N; i++) {
+    if (point_voxels[i] < 0) {
+      continue;
+    }
+    const int j = voxel_fill[point_voxels[i]]++;
+    grid->points[j] = target_->points[i].getVector3fMap();
+    grid->point_indices[j] = i;
+  }
+  voxel_hash_ = grid;
+  voxel_hash_updated_ = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    PointSource,
+    PointTarget>::computeTargetCovariancesCached() {
+  const int N = static_cast<int>(target_->size());
+  const Eigen::Matrix4d cache_from_target =
+      target_cache_from_target_.cast<double>();
+  const Eigen::Matrix3d R = cache_from_target.topLeftCorner<3, 3>();
+  const double inverse_resolution = 1. / target_cache_resolution_;
+  MatricesVector& covariances = *target_covariances_;
+  covariances.resize(N);
+
+  // Cache cell of each point, covariance of the points found in the cache
+  std::vector<VoxelKey> keys(N);
+  std::vector<char> cached(N, 0);
+  thread_pool_->parallelFor(N, 256, [&](int begin, int end, int) {
+    for (int i = begin; i < end; i++) {
+      const PointTarget& pt = target_->points[i];
+      if (!std::isfinite(pt.x) || !std::isfinite(pt.y) ||
+          !std::isfinite(pt.z)) {
+        continue;
+      }
+      const Eigen::Vector3d p =
+          R * pt.getVector3fMap().template cast<double>() +
+          cache_from_target.block<3, 1>(0, 3);
+      keys[i] = VoxelKey::fromPoint(p[0], p[1], p[2], inverse_resolution);
+      const int* entry = target_cache_.find(keys[i]);
+      if (entry) {
+        covariances[i] =
+            R.transpose() * target_cache_covariances_[*entry] * R;
+        cached[i] = 1;
+      }
+    }
+  });
+
+  std::vector<int> missing;
+  for (int i = 0; i < N; i++) {
+    if (!cached[i]) {
+      missing.push_back(i);
+    }
+  }
+  if (!missing.empty()) {
+    computeCovariances<PointTarget>(
+        target_, tree_, covariances, recompute_target_cov_, &missing);
+  }
+  stats_.cached_target_covariances = N - static_cast<int>(missing.size());
+
+  // The cache holds exactly the points of the current target
+  FlatVoxelHash<int> cache;
+  MatricesVector cache_covariances;
+  cache.reserve(N);
+  cache_covariances.reserve(N);
+  for (int i = 0; i < N; i++) {
+    const PointTarget& pt = target_->points[i];
+    if (!std::isfinite(pt.x) || !std::isfinite(pt.y) || !std::isfinite(pt.z)) {
+      continue;
+    }
+    if (cache.insert(keys[i], static_cast<int>(cache_covariances.size()))
+            .second) {
+      cache_covariances.push_back(R * covariances[i] * R.transpose());
+    }
+  }
+  std::swap(target_cache_, cache);
+  target_cache_covariances_.swap(cache_covariances);
+  target_cache_pending_ = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+template <typename PointT>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget>::
+    downsample(const pcl::PointCloud<PointT>& cloud,
+               const MatricesVector& covariances,
+               double resolution,
+               pcl::PointCloud<PointT>& downsampled,
+               MatricesVector& downsampled_covariances) const {
+  struct Voxel {
+    Eigen::Vector3d sum;
+    int count;
+    int best;
+    double best_sq_distance;
+  };
+  const double inverse_resolution = 1. / resolution;
+  const int N = static_cast<int>(cloud.size());
+  FlatVoxelHash<int> voxel_hash;
+  std::vector<Voxel> voxels;
+  std::vector<int> point_voxels(N, -1);
+
+  // Centroid of each voxel
+  for (int i = 0; i < N; i++) {
+    const PointT& pt = cloud.points[i];
+    if (!std::isfinite(pt.x) || !std::isfinite(pt.y) || !std::isfinite(pt.z)) {
+      continue;
+    }
+    std::pair<int*, bool> voxel = voxel_hash.insert(
+        VoxelKey::fromPoint(pt.x, pt.y, pt.z, inverse_resolution),
+        static_cast<int>(voxels.size()));
+    if (voxel.second) {
+      voxels.push_back({Eigen::Vector3d::Zero(), 0, -1, 0.});
+    }
+    point_voxels[i] = *voxel.first;
+    voxels[*voxel.first].sum += pt.getVector3fMap().template cast<double>();
+    voxels[*voxel.first].count++;
+  }
+
+  // Point closest to the centroid, the first one in index order on ties
+  for (int i = 0; i < N; i++) {
+    if (point_voxels[i] < 0) {
+      continue;
+    }
+    Voxel& voxel = voxels[point_voxels[i]];
+    const double sq_distance =
+        (cloud.points[i].getVector3fMap().template cast<double>() -
+         voxel.sum / voxel.count)
+            .squaredNorm();
+    if (voxel.best < 0 || sq_distance < voxel.best_sq_distance) {
+      voxel.best = i;
+      voxel.best_sq_distance = sq_distance;
+    }
+  }
+
+  downsampled.clear();
+  downsampled.reserve(voxels.size());
+  downsampled_covariances.clear();
+  downsampled_covariances.reserve(voxels.size());
+  for (const Voxel& voxel : voxels) {
+    downsampled.push_back(cloud.points[voxel.best]);
+    downsampled_covariances.push_back(covariances[voxel.best]);
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget>::
+    configureEngine(MultithreadedGeneralizedIterativeClosestPoint& engine)
+        const {
+  engine.setThreadPool(thread_pool_);
+  engine.setMaxCorrespondenceDistance(corr_dist_threshold_);
+  engine.setMaximumIterations(max_iterations_);
+  engine.setTransformationEpsilon(transformation_epsilon_);
+  engine.setRotationEpsilon(rotation_epsilon_);
+  engine.setEuclideanFitnessEpsilon(euclidean_fitness_epsilon_);
+  engine.setMaximumOptimizerIterations(max_inner_iterations_);
+  engine.setSolver(solver_);
+  engine.setSearchMethod(search_method_);
+  engine.setMahalanobisCacheRotationThreshold(
+      mahalanobis_cache_rotation_threshold_);
+  engine.setInlierRatioEpsilon(inlier_ratio_epsilon_);
+  engine.setCostDecreaseEpsilon(cost_decrease_epsilon_);
+  engine.setSinglePrecision(single_precision_);
+  engine.setRobustKernel(robust_kernel_, robust_kernel_width_);
+  engine.setCorrespondenceRandomness(k_correspondences_);
+  engine.gicp_epsilon_ = gicp_epsilon_;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+bool pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget>::
+    hasSameSettings(const MultithreadedGeneralizedIterativeClosestPoint& engine)
+        const {
+  if (engine.pyramid_levels_.size() != pyramid_levels_.size()) {
+    return (false);
+  }
+  for (size_t l = 0; l < pyramid_levels_.size(); l++) {
+    if (engine.pyramid_levels_[l].resolution != pyramid_levels_[l].resolution ||
+        engine.pyramid_levels_[l].iterations != pyramid_levels_[l].iterations) {
+      return (false);
+    }
+  }
+  return (engine.thread_pool_ == thread_pool_ &&
+          engine.corr_dist_threshold_ == corr_dist_threshold_ &&
+          engine.max_iterations_ == max_iterations_ &&
+          engine.transformation_epsilon_ == transformation_epsilon_ &&
+          engine.rotation_epsilon_ == rotation_epsilon_ &&
+          engine.euclidean_fitness_epsilon_ == euclidean_fitness_epsilon_ &&
+          engine.max_inner_iterations_ == max_inner_iterations_ &&
+          engine.solver_ == solver_ &&
+          engine.search_method_ == search_method_ &&
+          engine.mahalanobis_cache_rotation_threshold_ ==
+              mahalanobis_cache_rotation_threshold_ &&
+          engine.inlier_ratio_epsilon_ == inlier_ratio_epsilon_ &&
+          engine.cost_decrease_epsilon_ == cost_decrease_epsilon_ &&
+          engine.single_precision_ == single_precision_ &&
+          engine.robust_kernel_ == robust_kernel_ &&
+          engine.robust_kernel_width_ == robust_kernel_width_ &&
+          engine.k_correspondences_ == k_correspondences_ &&
+          engine.gicp_epsilon_ == gicp_epsilon_);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+Eigen::Matrix4f
+pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
+    alignPyramid(const Eigen::Matrix4f& guess) {
+  Eigen::Matrix4f transformation = guess;
+  for (PyramidLevel& level : pyramid_levels_) {
+    if (!level.engine) {
+      level.engine.reset(new MultithreadedGeneralizedIterativeClosestPoint);
+    }
+    MultithreadedGeneralizedIterativeClosestPoint& engine = *level.engine;
+    if (pyramid_target_updated_) {
+      level.target.reset(new PointCloudTarget);
+      level.target_covariances.reset(new MatricesVector);
+      downsample<PointTarget>(*target_,
+                              *target_covariances_,
+                              level.resolution,
+                              *level.target,
+                              *level.target_covariances);
+      engine.setInputTargetShared(level.target, level.target_covariances);
+    }
+    if (pyramid_source_updated_) {
+      level.source.reset(new PointCloudSource);
+      level.source_covariances.reset(new MatricesVector);
+      downsample<PointSource>(*input_,
+                              *input_covariances_,
+                              level.resolution,
+                              *level.source,
+                              *level.source_covariances);
+      engine.setInputSourceShared(level.source, level.source_covariances);
+    }
+    if (level.source->size() < size_t(min_number_correspondences_) ||
+        level.target->size() < size_t(min_number_correspondences_)) {
+      continue;
+    }
+
+    configureEngine(engine);
+    engine.setMaxCorrespondenceDistance(
+        std::max(corr_dist_threshold_, 2. * level.resolution));
+    engine.setMaximumIterations(level.iterations);
+
+    PointCloudSource aligned;
+    engine.align(aligned, transformation);
+    const ConvergenceReason reason =
+        engine.getRegistrationStats().convergence_reason;
+    stats_.pyramid_iterations += engine.getRegistrationStats().iterations;
+    // Keep the previous estimate if the level failed
+    if (reason != ConvergenceReason::SEARCH_FAILURE &&
+        reason != ConvergenceReason::SOLVER_FAILURE) {
+      transformation = engine.getFinalTransformation();
+    }
+  }
+  pyramid_target_updated_ = false;
+  pyramid_source_updated_ = false;
+  return transformation;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    PointSource,
+    PointTarget>::rollPyramidLevels() {
+  // The downsampled sources must be those of the source being rolled
+  bool rolled = !pyramid_source_updated_ && !pyramid_levels_.empty();
+  for (PyramidLevel& level : pyramid_levels_) {
+    if (!rolled || !level.engine || !level.engine->rollSourceToTarget()) {
+      rolled = false;
+      break;
+    }
+    level.target = level.source;
+    level.target_covariances = level.source_covariances;
+    level.source.reset();
+    level.source_covariances.reset();
+  }
+  pyramid_target_updated_ = !rolled;
+  pyramid_source_updated_ = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+void pcl::MultithreadedGeneralizedIterativeClosestPoint<
+    PointSource,
+    PointTarget>::computeTargetStructures() {
+  if ((!target_covariances_) || (target_covariances_->empty())) {
+    target_covariances_.reset(new MatricesVector);
+    if (target_cache_pending_) {
+      computeTargetCovariancesCached();
+    } else {
+      computeCovariances<PointTarget>(
+          target_, tree_, *target_covariances_, recompute_target_cov_);
+    }
+  }
+  if (search_method_ != GicpSearchMethod::KDTREE &&
+      (voxel_hash_updated_ || !voxel_hash_ ||
+       voxel_hash_->resolution != corr_dist_threshold_)) {
+    buildVoxelHash();
+  }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+bool pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource,
+                                                        PointTarget>::
+    alignBatch(const std::vector<PointCloudSourceConstPtr>& sources,
+               const RegistrationTransformations& guesses,
+               RegistrationBatchResults& results) {
+  results.clear();
+  const size_t num_items = BatchSize(sources.size(), guesses.size());
+  if (num_items == 0) {
+    PCL_ERROR("[pcl::%s::alignBatch] %lu sources do not match %lu initial "
+              "guesses!\n",
+              getClassName().c_str(),
+              sources.size(),
+              guesses.size());
+    return (false);
+  }
+  if (!target_ || target_->empty()) {
+    PCL_ERROR("[pcl::%s::alignBatch] No input target dataset was given!\n",
+              getClassName().c_str());
+    return (false);
+  }
+  for (const PointCloudSourceConstPtr& source : sources) {
+    if (!source || source->empty()) {
+      PCL_ERROR("[pcl::%s::alignBatch] Invalid or empty source given!\n",
+                getClassName().c_str());
+      return (false);
+    }
+  }
+
+  // Target structures, shared read only by the workers
+  if (target_cloud_updated_) {
+    tree_->setInputCloud(target_);
+    target_cloud_updated_ = false;
+  }
+  computeTargetStructures();
+
+  // Engines are only reconfigured when the settings of this instance change,
+  // and only handed the target structures when those were rebuilt
+  batch_engines_.resize(thread_pool_->numThreads());
+  for (Ptr& engine : batch_engines_) {
+    if (!engine) {
+      engine.reset(new MultithreadedGeneralizedIterativeClosestPoint);
+    }
+    if (!hasSameSettings(*engine)) {
+      std::vector<double> pyramid_resolutions;
+      std::vector<int> pyramid_iterations;
+      for (const PyramidLevel& level : pyramid_levels_) {
+        pyramid_resolutions.push_back(level.resolution);
+        pyramid_iterations.push_back(level.iterations);
+      }
+      configureEngine(*engine);
+      engine->setPyramidLevels(pyramid_resolutions, pyramid_iterations);
+    }
+    if (engine->target_ != target_ ||
+        engine->target_covariances_ != target_covariances_ ||
+        engine->voxel_hash_ != voxel_hash_) {
+      engine->setInputTargetShared(target_, target_covariances_, tree_);
+      engine->voxel_hash_ = voxel_hash_;
+      engine->voxel_hash_updated_ = !voxel_hash_;
+    }
+  }
+
+  // Source structures, computed once per source. Several sources are spread
+  // over the pool, each on the scratch buffers of the engine of its thread,
+  // a single source keeps the whole pool for its covariances
+  std::vector<InputKdTreeReciprocalPtr> source_trees(sources.size());
+  std::vector<MatricesVectorPtr> source_covariances(sources.size());
+  auto build_source =
+      [&](size_t s, MultithreadedGeneralizedIterativeClosestPoint& engine) {
+        source_trees[s].reset(new pcl::search::KdTree<PointSource>);
+        source_trees[s]->setInputCloud(sources[s]);
+        source_covariances[s].reset(new MatricesVector);
+        engine.computeCovariances<PointSource>(sources[s],
+                                               source_trees[s],
+                                               *source_covariances[s],
+                                               recompute_source_cov);
+      };
+  if (sources.size() == 1) {
+    build_source(0, *this);
+  } else {
+    thread_pool_->parallelFor(
+        static_cast<int>(sources.size()),
+        1,
+        [&](int begin, int end, int thread_id) {
+          for (int s = begin; s < end; s++) {
+            build_source(s, *batch_engines_[thread_id]);
+          }
+        });
+  }
+
+  // One item per chunk, the parallel loops of an item run inline on the
+  // thread of the item
+  results.resize(num_items);
+  thread_pool_->parallelFor(
+      static_cast<int>(num_items), 1, [&](int begin, int end, int thread_id) {
+        MultithreadedGeneralizedIterativeClosestPoint& engine =
+            *batch_engines_[thread_id];
+        for (int i = begin; i < end; i++) {
+          const size_t s = sources.size() == 1 ? 0 : i;
+          engine.setInputSourceShared(
+              sources[s], source_covariances[s], source_trees[s]);
+          PointCloudSource aligned;
+          engine.align(aligned, BatchGuess(guesses, i));
+          RegistrationBatchResult& result = results[i];
+          result.transformation = engine.getFinalTransformation();
+          result.fitness_score = engine.getFitnessScore();
+          result.converged = engine.hasConverged();
+          result.stats = engine.getRegistrationStats();
+        }
+      });
+  return (true);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
@@ -406,8 +1185,10 @@ template <typename PointSource, typename PointTarget>
 inline void
 pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
     computeTransformation(PointCloudSource& output,
-                          const Eigen::Matrix4f& guess) {
+                          const Eigen::Matrix4f& initial_guess) {
   auto start_gicp = std::chrono::steady_clock::now();
+  stats_.reset();
+  final_correspondences_.clear();
 
   pcl::IterativeClosestPoint<PointSource, PointTarget>::initComputeReciprocal();
   using namespace std;
@@ -416,14 +1197,16 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
   const size_t N = indices_->size();
   // Set the mahalanobis matrices to identity
   mahalanobis_.resize(N, Eigen::Matrix3d::Identity());
+  // The cached mahalanobis matrices are only valid within one call
+  const bool cache_mahalanobis = mahalanobis_cache_rotation_threshold_ > 0.;
+  if (cache_mahalanobis) {
+    mahalanobis_targets_.assign(N, -1);
+    mahalanobis_buckets_.resize(N);
+  }
 
   // Compute target cloud covariance matrices
   auto start_covariances = std::chrono::steady_clock::now();
-  if ((!target_covariances_) || (target_covariances_->empty())) {
-    target_covariances_.reset(new MatricesVector);
-    computeCovariances<PointTarget>(
-        target_, tree_, *target_covariances_, recompute_target_cov_);
-  }
+  computeTargetStructures();
   // Compute input cloud covariance matrices
   if ((!input_covariances_) || (input_covariances_->empty())) {
     input_covariances_.reset(new MatricesVector);
@@ -431,6 +1214,15 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
         input_, tree_reciprocal_, *input_covariances_, recompute_source_cov);
   }
   auto end_covariances = std::chrono::steady_clock::now();
+  stats_.covariances_us =
+      elapsedMicroseconds(start_covariances, end_covariances);
+  stats_.num_points = static_cast<int>(N);
+
+  // Start the full resolution registration from the result of the pyramid
+  Eigen::Matrix4f guess = initial_guess;
+  if (!pyramid_levels_.empty()) {
+    guess = alignPyramid(initial_guess);
+  }
 
   base_transformation_ = Eigen::Matrix4f::Identity();
   nr_iterations_ = 0;
@@ -440,11 +1232,15 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
   pcl::transformPointCloud(output, output, guess);
 
   double delta = 0.;
+  double cost = std::numeric_limits<double>::quiet_NaN();
+  double previous_cost = cost;
+  double previous_inlier_ratio = 0.;
 
   auto start_iterations = std::chrono::steady_clock::now();
   while (!converged_) {
-    std::vector<int> source_indices(indices_->size(), -1);
-    std::vector<int> target_indices(indices_->size(), -1);
+    source_indices_.assign(N, -1);
+    target_indices_.assign(N, -1);
+    correspondence_distances_.resize(N);
 
     // guess corresponds to base_t and transformation_ to t
     Eigen::Matrix4d transform_R = Eigen::Matrix4d::Zero();
@@ -458,60 +1254,93 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
     }
 
     const Eigen::Matrix3d R = transform_R.topLeftCorner<3, 3>();
-    int failure = 0;
+    // Bucket of the rotation vector of R, a cached matrix is reused only in
+    // the bucket it was computed in
+    VoxelKey rotation_bucket;
+    if (cache_mahalanobis) {
+      const Eigen::AngleAxisd rotation(R);
+      const Eigen::Vector3d v = rotation.angle() * rotation.axis();
+      rotation_bucket = VoxelKey::fromPoint(
+          v[0], v[1], v[2], 1. / mahalanobis_cache_rotation_threshold_);
+    }
+    std::atomic<bool> failure(false);
     auto start_lookups = std::chrono::steady_clock::now();
-    int enable_omp = (1 < k_num_threads_);
-#pragma omp parallel for schedule(dynamic, 1) if (enable_omp)
-    for (size_t i = 0; i < N; i++) {
+    thread_pool_->parallelFor(int(N), 64, [&](int begin, int end, int) {
       std::vector<int> nn_indices(1);
       std::vector<float> nn_dists(1);
-      PointSource query = output[i];
-      query.getVector4fMap() = transformation_ * query.getVector4fMap();
+      for (int i = begin; i < end; i++) {
+        PointSource query = output[i];
+        query.getVector3fMap() =
+            transformation_.topLeftCorner<3, 3>() * query.getVector3fMap() +
+            transformation_.block<3, 1>(0, 3);
 
-      if (!searchForNeighbors(query, nn_indices, nn_dists)) {
-        PCL_ERROR(
-            "[pcl::%s::computeTransformation] Unable to find a nearest "
-            "neighbor in the target dataset for point %d in the source!\n",
-            getClassName().c_str(),
-            (*indices_)[i]);
-        failure = 1;
-        continue;
-      }
+        if (search_method_ != GicpSearchMethod::KDTREE) {
+          // No target point around, the point has no correspondence
+          if (!searchVoxelHash(
+                  query.getVector3fMap(), nn_indices[0], nn_dists[0])) {
+            continue;
+          }
+        } else if (!searchForNeighbors(query, nn_indices, nn_dists)) {
+          PCL_ERROR(
+              "[pcl::%s::computeTransformation] Unable to find a nearest "
+              "neighbor in the target dataset for point %d in the source!\n",
+              getClassName().c_str(),
+              (*indices_)[i]);
+          failure = true;
+          continue;
+        }
+
+        // Check if the distance to the nearest neighbor is smaller than the
+        // user imposed threshold
+        if (nn_dists[0] < dist_threshold) {
+          // Reuse the cached matrix if the nearest neighbour and the
+          // rotation bucket did not change
+          if (!cache_mahalanobis || mahalanobis_targets_[i] != nn_indices[0] ||
+              !(mahalanobis_buckets_[i] == rotation_bucket)) {
+            Eigen::Matrix3d& C1 = (*input_covariances_)[i];
+            Eigen::Matrix3d& C2 = (*target_covariances_)[nn_indices[0]];
+            Eigen::Matrix3d& M = mahalanobis_[i];
+            // M = R*C1
+            M = R * C1;
+            // temp = M*R' + C2 = R*C1*R' + C2
+            Eigen::Matrix3d temp = M * R.transpose();
+            temp += C2;
+            // M = temp^-1
+            M = temp.inverse();
+            if (cache_mahalanobis) {
+              mahalanobis_targets_[i] = nn_indices[0];
+              mahalanobis_buckets_[i] = rotation_bucket;
+            }
+          }
 
-      // Check if the distance to the nearest neighbor is smaller than the user
-      // imposed threshold
-      if (nn_dists[0] < dist_threshold) {
-        Eigen::Matrix3d& C1 = (*input_covariances_)[i];
-        Eigen::Matrix3d& C2 = (*target_covariances_)[nn_indices[0]];
-        Eigen::Matrix3d& M = mahalanobis_[i];
-        // M = R*C1
-        M = R * C1;
-        // temp = M*R' + C2 = R*C1*R' + C2
-        Eigen::Matrix3d temp = M * R.transpose();
-        temp += C2;
-        // M = temp^-1
-        M = temp.inverse();
-
-        source_indices[i] = static_cast<int>(i);
-        target_indices[i] = nn_indices[0];
+          source_indices_[i] = i;
+          target_indices_[i] = nn_indices[0];
+          correspondence_distances_[i] = nn_dists[0];
+        }
       }
-    }
+    });
     auto end_lookups = std::chrono::steady_clock::now();
 
     // There used to be a return statement inside of the loop that was
-    // incompatible with OpenMP Moving the failure and return logic outside of
-    // the loop
+    // incompatible with the parallel loop. Moving the failure and return logic
+    // outside of the loop
     if (failure) {
+      stats_.convergence_reason = ConvergenceReason::SEARCH_FAILURE;
+      stats_.iterations = nr_iterations_;
+      stats_.total_us =
+          elapsedMicroseconds(start_gicp, std::chrono::steady_clock::now());
       return;
     }
 
     // Resize to the actual number of valid correspondences
-    source_indices.erase(
-        std::remove(source_indices.begin(), source_indices.end(), -1),
-        source_indices.end());
-    target_indices.erase(
-        std::remove(target_indices.begin(), target_indices.end(), -1),
-        target_indices.end());
+    source_indices_.erase(
+        std::remove(source_indices_.begin(), source_indices_.end(), -1),
+        source_indices_.end());
+    target_indices_.erase(
+        std::remove(target_indices_.begin(), target_indices_.end(), -1),
+        target_indices_.end());
+    stats_.num_inliers = static_cast<int>(source_indices_.size());
+    stats_.lookups_us += elapsedMicroseconds(start_lookups, end_lookups);
 
     /* optimize transformation using the current assignment and Mahalanobis
      * metrics*/
@@ -521,7 +1350,7 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
     auto start_optimization = std::chrono::steady_clock::now();
     try {
       rigid_transformation_estimation_(
-          output, source_indices, *target_, target_indices, transformation_);
+          output, source_indices_, *target_, target_indices_, transformation_);
       /* compute the delta from this iteration */
       delta = 0.;
       for (int k = 0; k < 4; k++) {
@@ -539,31 +1368,41 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
           }
         }
       }
+      // Only the cost decrease criterion needs the cost of every iteration.
+      // Both costs are taken over the correspondences of this iteration, the
+      // costs of two different correspondence sets are not comparable
+      if (cost_decrease_epsilon_ > 0.) {
+        previous_cost = computeCost(previous_transformation_);
+        cost = computeCost(transformation_);
+      }
     } catch (PCLException& e) {
       PCL_DEBUG("[pcl::%s::computeTransformation] Optimization issue %s\n",
                 getClassName().c_str(),
                 e.what());
+      stats_.convergence_reason = ConvergenceReason::SOLVER_FAILURE;
       break;
     }
     auto end_optimization = std::chrono::steady_clock::now();
-    double lookups_time =
-        static_cast<double>(
-            std::chrono::duration_cast<std::chrono::microseconds>(end_lookups -
-                                                                  start_lookups)
-                .count()) *
-        1.0e-6;
-    double optimization_time =
-        static_cast<double>(
-            std::chrono::duration_cast<std::chrono::microseconds>(
-                end_optimization - start_optimization)
-                .count()) *
-        1.0e-6;
-    // ROS_INFO_STREAM("Lookups: " << lookups_time << " Optimization: " <<
-    // optimization_time);
+    stats_.optimization_us +=
+        elapsedMicroseconds(start_optimization, end_optimization);
 
     nr_iterations_++;
     // Check for convergence
-    if (nr_iterations_ >= max_iterations_ || delta < 1) {
+    const double inlier_ratio = stats_.inlierRatio();
+    if (delta < 1) {
+      stats_.convergence_reason = ConvergenceReason::TRANSFORMATION;
+    } else if (inlier_ratio_epsilon_ > 0. && nr_iterations_ > 1 &&
+               fabs(inlier_ratio - previous_inlier_ratio) <
+                   inlier_ratio_epsilon_) {
+      stats_.convergence_reason = ConvergenceReason::INLIER_RATIO;
+    } else if (cost_decrease_epsilon_ > 0. && nr_iterations_ > 1 &&
+               previous_cost - cost < cost_decrease_epsilon_ * previous_cost) {
+      stats_.convergence_reason = ConvergenceReason::COST_DECREASE;
+    } else if (nr_iterations_ >= max_iterations_) {
+      stats_.convergence_reason = ConvergenceReason::MAX_ITERATIONS;
+    }
+    previous_inlier_ratio = inlier_ratio;
+    if (stats_.convergence_reason != ConvergenceReason::NOT_CONVERGED) {
       converged_ = true;
       previous_transformation_ = transformation_;
       PCL_DEBUG(
@@ -580,39 +1419,43 @@ pcl::MultithreadedGeneralizedIterativeClosestPoint<PointSource, PointTarget>::
   }
   auto end_iterations = std::chrono::steady_clock::now();
 
+  // Final cost, once, if the loop did not evaluate it
+  if (cost_decrease_epsilon_ <= 0. && nr_iterations_ > 0) {
+    cost = computeCost(transformation_);
+  }
+
+  // Keep the correspondences of the last iteration for the caller
+  final_correspondences_.resize(source_indices_.size());
+  for (size_t k = 0; k < source_indices_.size(); k++) {
+    pcl::Correspondence& correspondence = final_correspondences_[k];
+    correspondence.index_query = source_indices_[k];
+    correspondence.index_match = target_indices_[k];
+    correspondence.distance = correspondence_distances_[source_indices_[k]];
+  }
+
   final_transformation_ = previous_transformation_ * guess;
 
   // Transform the point cloud
   pcl::transformPointCloud(*input_, output, final_transformation_);
 
   auto end_gicp = std::chrono::steady_clock::now();
+  stats_.iterations = nr_iterations_;
+  stats_.final_cost = cost;
+  stats_.total_us = elapsedMicroseconds(start_gicp, end_gicp);
   if (k_enable_timing_output_) {
-    double iteration_time =
-        static_cast<double>(
-            std::chrono::duration_cast<std::chrono::microseconds>(
-                end_iterations - start_iterations)
-                .count()) *
-        1.0e-6;
-    double covariance_time =
-        static_cast<double>(
-            std::chrono::duration_cast<std::chrono::microseconds>(
-                end_covariances - start_covariances)
-                .count()) *
-        1.0e-6;
-    double total_time =
-        static_cast<double>(
-            std::chrono::duration_cast<std::chrono::microseconds>(end_gicp -
-                                                                  start_gicp)
-                .count()) *
-        1.0e-6;
-    // TODO(JN) Structured logging? ros topic? add info about the clouds? Remove
-    // ROS logs from GICP?
-    ROS_DEBUG_STREAM("NrThreads: " << k_num_threads_ << " Total: " << total_time
-                                   << " "
-                                   << " Iteration: " << iteration_time
-                                   << " Covariances: " << covariance_time
-                                   << " NrIterations: " << nr_iterations_
-                                   << " Delta " << delta);
+    const double iteration_time =
+        1.0e-6 * elapsedMicroseconds(start_iterations, end_iterations);
+    ROS_DEBUG_STREAM(
+        "NrThreads: " << k_num_threads_
+                      << " Total: " << 1.0e-6 * stats_.total_us << " "
+                      << " Iteration: " << iteration_time
+                      << " Covariances: " << 1.0e-6 * stats_.covariances_us
+                      << " Lookups: " << 1.0e-6 * stats_.lookups_us
+                      << " Optimization: " << 1.0e-6 * stats_.optimization_us
+                      << " NrIterations: " << nr_iterations_ << " Delta "
+                      << delta << " Inliers: " << stats_.num_inliers
+                      << " Cost: " << cost << " Reason: "
+                      << ConvergenceReasonToString(stats_.convergence_reason));
   }
 }
 
@@ -0,0 +1,220 @@
+/*
+ * Single precision GICP cost/gradient kernels, AVX2 with a scalar fallback
+ * selected at runtime.
+ */
+
+#ifndef MULTITHREADED_GICP_SIMD_H_
+#define MULTITHREADED_GICP_SIMD_H_
+
+#include <cstddef>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define MULTITHREADED_GICP_HAVE_AVX2_KERNEL 1
+#endif
+
+namespace pcl
+{
+namespace gicp_simd
+{
+/** \brief Correspondences in single precision structure of arrays: source
+ * points, target points and the upper triangle of the mahalanobis matrix of each
+ * pair.
+ */
+struct CorrespondencesSoAf
+{
+  std::vector<float> src_x, src_y, src_z;
+  std::vector<float> tgt_x, tgt_y, tgt_z;
+  std::vector<float> m_xx, m_xy, m_xz, m_yy, m_yz, m_zz;
+
+  void resize(size_t n)
+  {
+    for (std::vector<float>* v :
+         { &src_x, &src_y, &src_z, &tgt_x, &tgt_y, &tgt_z, &m_xx, &m_xy, &m_xz, &m_yy, &m_yz, &m_zz })
+      v->resize(n);
+  }
+
+  size_t size() const
+  {
+    return src_x.size();
+  }
+};
+
+/** \brief Cost and gradient sums over a range of correspondences. R(a, b) is
+ * stored in R[3 * a + b].
+ */
+struct Sums
+{
+  double f;
+  double g[3];
+  double R[9];
+};
+
+/** \brief Scalar kernel: sum res' * M * res, M * res and p_src * (M * res)' over
+ * the correspondences in [begin, end), with res = A * p_src - p_tgt and A a
+ * row major 3x4 transformation.
+ */
+template <bool with_gradient>
+inline void accumulateScalar(const float* A, const CorrespondencesSoAf& c, int begin, int end, Sums& sums)
+{
+  const float* sx = c.src_x.data();
+  const float* sy = c.src_y.data();
+  const float* sz = c.src_z.data();
+  const float* tx = c.tgt_x.data();
+  const float* ty = c.tgt_y.data();
+  const float* tz = c.tgt_z.data();
+  const float* mxx = c.m_xx.data();
+  const float* mxy = c.m_xy.data();
+  const float* mxz = c.m_xz.data();
+  const float* myy = c.m_yy.data();
+  const float* myz = c.m_yz.data();
+  const float* mzz = c.m_zz.data();
+
+  float f = 0.f, g0 = 0.f, g1 = 0.f, g2 = 0.f;
+  float r00 = 0.f, r01 = 0.f, r02 = 0.f, r10 = 0.f, r11 = 0.f, r12 = 0.f, r20 = 0.f, r21 = 0.f, r22 = 0.f;
+#pragma omp simd reduction(+ : f, g0, g1, g2, r00, r01, r02, r10, r11, r12, r20, r21, r22)
+  for (int i = begin; i < end; ++i)
+  {
+    const float res0 = A[0] * sx[i] + A[1] * sy[i] + A[2] * sz[i] + A[3] - tx[i];
+    const float res1 = A[4] * sx[i] + A[5] * sy[i] + A[6] * sz[i] + A[7] - ty[i];
+    const float res2 = A[8] * sx[i] + A[9] * sy[i] + A[10] * sz[i] + A[11] - tz[i];
+    const float temp0 = mxx[i] * res0 + mxy[i] * res1 + mxz[i] * res2;
+    const float temp1 = mxy[i] * res0 + myy[i] * res1 + myz[i] * res2;
+    const float temp2 = mxz[i] * res0 + myz[i] * res1 + mzz[i] * res2;
+    f += res0 * temp0 + res1 * temp1 + res2 * temp2;
+    if (with_gradient)
+    {
+      g0 += temp0;
+      g1 += temp1;
+      g2 += temp2;
+      r00 += sx[i] * temp0;
+      r01 += sx[i] * temp1;
+      r02 += sx[i] * temp2;
+      r10 += sy[i] * temp0;
+      r11 += sy[i] * temp1;
+      r12 += sy[i] * temp2;
+      r20 += sz[i] * temp0;
+      r21 += sz[i] * temp1;
+      r22 += sz[i] * temp2;
+    }
+  }
+  sums.f = f;
+  sums.g[0] = g0;
+  sums.g[1] = g1;
+  sums.g[2] = g2;
+  const float R[9] = { r00, r01, r02, r10, r11, r12, r20, r21, r22 };
+  for (int k = 0; k < 9; k++)
+    sums.R[k] = R[k];
+}
+
+#ifdef MULTITHREADED_GICP_HAVE_AVX2_KERNEL
+/** \brief Horizontal sum of the 8 lanes of v */
+__attribute__((target("avx2,fma"))) inline double horizontalSum(__m256 v)
+{
+  const __m128 lo = _mm256_castps256_ps128(v);
+  const __m128 hi = _mm256_extractf128_ps(v, 1);
+  const __m256d sum = _mm256_add_pd(_mm256_cvtps_pd(lo), _mm256_cvtps_pd(hi));
+  const __m128d sum2 = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+  return _mm_cvtsd_f64(_mm_add_sd(sum2, _mm_unpackhi_pd(sum2, sum2)));
+}
+
+/** \brief AVX2/FMA version of accumulateScalar, 8 correspondences at a time */
+template <bool with_gradient>
+__attribute__((target("avx2,fma"))) inline void accumulateAvx2(const float* A, const CorrespondencesSoAf& c,
+                                                               int begin, int end, Sums& sums)
+{
+  const __m256 a00 = _mm256_set1_ps(A[0]), a01 = _mm256_set1_ps(A[1]), a02 = _mm256_set1_ps(A[2]),
+               a03 = _mm256_set1_ps(A[3]);
+  const __m256 a10 = _mm256_set1_ps(A[4]), a11 = _mm256_set1_ps(A[5]), a12 = _mm256_set1_ps(A[6]),
+               a13 = _mm256_set1_ps(A[7]);
+  const __m256 a20 = _mm256_set1_ps(A[8]), a21 = _mm256_set1_ps(A[9]), a22 = _mm256_set1_ps(A[10]),
+               a23 = _mm256_set1_ps(A[11]);
+
+  __m256 f = _mm256_setzero_ps();
+  __m256 g[3] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+  __m256 R[9];
+  for (int k = 0; k < 9; k++)
+    R[k] = _mm256_setzero_ps();
+
+  int i = begin;
+  for (; i + 8 <= end; i += 8)
+  {
+    const __m256 sx = _mm256_loadu_ps(&c.src_x[i]);
+    const __m256 sy = _mm256_loadu_ps(&c.src_y[i]);
+    const __m256 sz = _mm256_loadu_ps(&c.src_z[i]);
+    const __m256 res0 = _mm256_sub_ps(
+        _mm256_fmadd_ps(a00, sx, _mm256_fmadd_ps(a01, sy, _mm256_fmadd_ps(a02, sz, a03))),
+        _mm256_loadu_ps(&c.tgt_x[i]));
+    const __m256 res1 = _mm256_sub_ps(
+        _mm256_fmadd_ps(a10, sx, _mm256_fmadd_ps(a11, sy, _mm256_fmadd_ps(a12, sz, a13))),
+        _mm256_loadu_ps(&c.tgt_y[i]));
+    const __m256 res2 = _mm256_sub_ps(
+        _mm256_fmadd_ps(a20, sx, _mm256_fmadd_ps(a21, sy, _mm256_fmadd_ps(a22, sz, a23))),
+        _mm256_loadu_ps(&c.tgt_z[i]));
+    const __m256 mxx = _mm256_loadu_ps(&c.m_xx[i]);
+    const __m256 mxy = _mm256_loadu_ps(&c.m_xy[i]);
+    const __m256 mxz = _mm256_loadu_ps(&c.m_xz[i]);
+    const __m256 myy = _mm256_loadu_ps(&c.m_yy[i]);
+    const __m256 myz = _mm256_loadu_ps(&c.m_yz[i]);
+    const __m256 mzz = _mm256_loadu_ps(&c.m_zz[i]);
+    const __m256 temp0 = _mm256_fmadd_ps(mxx, res0, _mm256_fmadd_ps(mxy, res1, _mm256_mul_ps(mxz, res2)));
+    const __m256 temp1 = _mm256_fmadd_ps(mxy, res0, _mm256_fmadd_ps(myy, res1, _mm256_mul_ps(myz, res2)));
+    const __m256 temp2 = _mm256_fmadd_ps(mxz, res0, _mm256_fmadd_ps(myz, res1, _mm256_mul_ps(mzz, res2)));
+    f = _mm256_fmadd_ps(res0, temp0, _mm256_fmadd_ps(res1, temp1, _mm256_fmadd_ps(res2, temp2, f)));
+    if (with_gradient)
+    {
+      g[0] = _mm256_add_ps(g[0], temp0);
+      g[1] = _mm256_add_ps(g[1], temp1);
+      g[2] = _mm256_add_ps(g[2], temp2);
+      R[0] = _mm256_fmadd_ps(sx, temp0, R[0]);
+      R[1] = _mm256_fmadd_ps(sx, temp1, R[1]);
+      R[2] = _mm256_fmadd_ps(sx, temp2, R[2]);
+      R[3] = _mm256_fmadd_ps(sy, temp0, R[3]);
+      R[4] = _mm256_fmadd_ps(sy, temp1, R[4]);
+      R[5] = _mm256_fmadd_ps(sy, temp2, R[5]);
+      R[6] = _mm256_fmadd_ps(sz, temp0, R[6]);
+      R[7] = _mm256_fmadd_ps(sz, temp1, R[7]);
+      R[8] = _mm256_fmadd_ps(sz, temp2, R[8]);
+    }
+  }
+
+  // Remaining correspondences
+  Sums tail;
+  accumulateScalar<with_gradient>(A, c, i, end, tail);
+  sums.f = horizontalSum(f) + tail.f;
+  for (int k = 0; k < 3; k++)
+    sums.g[k] = with_gradient ? horizontalSum(g[k]) + tail.g[k] : 0.;
+  for (int k = 0; k < 9; k++)
+    sums.R[k] = with_gradient ? horizontalSum(R[k]) + tail.R[k] : 0.;
+}
+#endif
+
+/** \brief True if the AVX2 kernel can run on this CPU */
+inline bool hasAvx2Kernel()
+{
+#ifdef MULTITHREADED_GICP_HAVE_AVX2_KERNEL
+  static const bool has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  return has_avx2;
+#else
+  return false;
+#endif
+}
+
+/** \brief accumulateScalar, dispatched to the AVX2 kernel when available */
+template <bool with_gradient>
+inline void accumulate(const float* A, const CorrespondencesSoAf& c, int begin, int end, Sums& sums)
+{
+#ifdef MULTITHREADED_GICP_HAVE_AVX2_KERNEL
+  if (hasAvx2Kernel())
+  {
+    accumulateAvx2<with_gradient>(A, c, begin, end, sums);
+    return;
+  }
+#endif
+  accumulateScalar<with_gradient>(A, c, begin, end, sums);
+}
+}  // namespace gicp_simd
+}  // namespace pcl
+
+#endif  // MULTITHREADED_GICP_SIMD_H_
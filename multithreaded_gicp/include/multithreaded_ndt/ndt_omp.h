@@ -44,12 +44,36 @@
 #include <multithreaded_ndt/voxel_grid_covariance_omp.h>
 #include <pcl/registration/registration.h>
 #include <pcl/search/impl/search.hpp>
+#include <registration_batch.h>
+#include <registration_settings.h>
+#include <registration_thread_pool.h>
 
+#include <algorithm>
 #include <unsupported/Eigen/NonLinearOptimization>
 
 namespace pclomp {
 enum NeighborSearchMethod { KDTREE, DIRECT26, DIRECT7, DIRECT1 };
 
+using EnumToStringNeighborSearchMethods =
+    std::pair<std::string, NeighborSearchMethod>;
+
+const std::vector<EnumToStringNeighborSearchMethods>
+    EnumToStringNeighborSearchMethodsVector = {
+        EnumToStringNeighborSearchMethods("kdtree", KDTREE),
+        EnumToStringNeighborSearchMethods("direct26", DIRECT26),
+        EnumToStringNeighborSearchMethods("direct7", DIRECT7),
+        EnumToStringNeighborSearchMethods("direct1", DIRECT1)};
+
+inline NeighborSearchMethod
+getNeighborSearchMethodFromString(const std::string& method) {
+  for (const auto& available_method : EnumToStringNeighborSearchMethodsVector) {
+    if (method == available_method.first) {
+      return available_method.second;
+    }
+  }
+  throw std::runtime_error("No such NDT search method!: " + method);
+}
+
 /** \brief A 3D Normal Distribution Transform registration implementation for
  * point cloud data. \note For more information please see <b>Magnusson, M.
  * (2009). The Three-Dimensional Normal-Distributions Transform — an Efﬁcient
@@ -82,9 +106,9 @@ protected:
    */
   typedef pclomp::VoxelGridCovariance<PointTarget> TargetGrid;
   /** \brief Typename of pointer to searchable voxel grid. */
-  typedef TargetGrid* TargetGridPtr;
+  typedef boost::shared_ptr<TargetGrid> TargetGridPtr;
   /** \brief Typename of const pointer to searchable voxel grid. */
-  typedef const TargetGrid* TargetGridConstPtr;
+  typedef boost::shared_ptr<const TargetGrid> TargetGridConstPtr;
   /** \brief Typename of const pointer to searchable voxel grid leaf. */
   typedef typename TargetGrid::LeafConstPtr TargetGridLeafConstPtr;
 
@@ -102,11 +126,32 @@ public:
    */
   NormalDistributionsTransform();
 
+  /** \brief Constructor running on a thread pool provided by the caller,
+   * e.g. shared with other registration instances. Avoids starting the
+   * default pool of the other constructor only to replace it.
+   */
+  explicit NormalDistributionsTransform(
+      const RegistrationThreadPool::Ptr& thread_pool);
+
   /** \brief Empty destructor */
   virtual ~NormalDistributionsTransform() {}
 
+  /** \brief Run on a pool of n threads owned by this instance. */
   void setNumThreads(int n) {
-    num_threads_ = n;
+    if (thread_pool_->numThreads() != n)
+      setThreadPool(std::make_shared<RegistrationThreadPool>(n));
+  }
+
+  /** \brief Run on a thread pool provided by the caller, e.g. shared with
+   * other registration instances or with pinned workers.
+   */
+  void setThreadPool(const RegistrationThreadPool::Ptr& thread_pool) {
+    thread_pool_ = thread_pool;
+    target_cells_->setThreadPool(thread_pool_);
+  }
+
+  inline RegistrationThreadPool::Ptr getThreadPool() const {
+    return thread_pool_;
   }
 
   /** \brief Provide a pointer to the input target (e.g., the point cloud that
@@ -118,6 +163,27 @@ public:
     init();
   }
 
+  /** \brief Update the voxel grid of the current target in place instead of
+   * rebuilding it: the points of added are inserted and the points of removed
+   * (previously inserted) are taken out. Only the touched voxels are
+   * recomputed, emptied voxels are released, and the centroid kdtree is only
+   * rebuilt for the KDTREE search method. getFitnessScore() and a later
+   * setResolution() still use the cloud given to setInputTarget().
+   * \param[in] added points inserted into the target
+   * \param[in] removed points removed from the target
+   * \return false if no target is set
+   */
+  bool updateTarget(const PointCloudTarget& added,
+                    const PointCloudTarget& removed);
+
+  inline bool addTargetPoints(const PointCloudTarget& cloud) {
+    return updateTarget(cloud, PointCloudTarget());
+  }
+
+  inline bool removeTargetPoints(const PointCloudTarget& cloud) {
+    return updateTarget(PointCloudTarget(), cloud);
+  }
+
   /** \brief Set/change the voxel grid resolution.
    * \param[in] resolution side length of voxels
    */
@@ -130,6 +196,50 @@ public:
     }
   }
 
+  /** \brief Set the cascade levels aligned before the full resolution
+   * registration, coarse to fine, each level starting from the result of the
+   * previous one. The voxel grid of a level is built by merging the voxel
+   * statistics of the full resolution grid, without another pass over the
+   * target points.
+   * \param[in] factors ratio of the level resolution to the resolution, at
+   * least 2, coarsest first, empty to disable the cascade
+   * \param[in] iterations maximum number of iterations of each level
+   * \return false if the sizes do not match or a factor is below 2, the
+   * cascade is then disabled
+   */
+  bool setCascadeLevels(const std::vector<int>& factors,
+                        const std::vector<int>& iterations) {
+    cascade_levels_.clear();
+    cascade_target_updated_ = true;
+    if (factors.size() != iterations.size()) {
+      PCL_ERROR("[pcl::%s::setCascadeLevels] %lu factors but %lu iteration "
+                "counts given!\n",
+                getClassName().c_str(),
+                factors.size(),
+                iterations.size());
+      return (false);
+    }
+    for (size_t l = 0; l < factors.size(); l++) {
+      if (factors[l] < 2) {
+        PCL_ERROR("[pcl::%s::setCascadeLevels] Invalid factor %d!\n",
+                  getClassName().c_str(),
+                  factors[l]);
+        cascade_levels_.clear();
+        return (false);
+      }
+      CascadeLevel level;
+      level.factor = factors[l];
+      level.iterations = iterations[l];
+      cascade_levels_.push_back(level);
+    }
+    return (true);
+  }
+
+  /** \brief Get the number of cascade levels, 0 if disabled */
+  size_t getNumCascadeLevels() const {
+    return (cascade_levels_.size());
+  }
+
   /** \brief Get voxel grid resolution.
    * \return side length of voxels
    */
@@ -165,10 +275,33 @@ public:
     outlier_ratio_ = outlier_ratio;
   }
 
+  /** \brief Set the solver and, for Gauss-Newton, the damping added to the
+   * diagonal of the hessian relative to its magnitude. Gauss-Newton steps are
+   * limited to the maximum step length.
+   * \param[in] solver Newton with line search or damped Gauss-Newton
+   * \param[in] gauss_newton_damping relative damping of the hessian diagonal
+   */
+  inline void setSolver(NdtSolver solver, double gauss_newton_damping = 1e-3) {
+    solver_ = solver;
+    gauss_newton_damping_ = gauss_newton_damping;
+  }
+
+  inline NdtSolver getSolver() const {
+    return (solver_);
+  }
+
   inline void setNeighborhoodSearchMethod(NeighborSearchMethod method) {
     search_method = method;
   }
 
+  /** \brief Enable the per point cache of the DIRECT* neighborhoods, on by
+   * default. The cache only skips lookups, the result is the same.
+   * \param[in] enable false to look the neighborhood up at every evaluation
+   */
+  inline void setNeighborhoodCache(bool enable) {
+    neighborhood_cache_ = enable;
+  }
+
   /** \brief Get the registration alignment probability.
    * \return transformation probability
    */
@@ -183,6 +316,75 @@ public:
     return (nr_iterations_);
   }
 
+  /** \brief Get the hessian of the score at the final transformation, the
+   * Gauss-Newton approximation when that solver is used. Parameters are
+   * ordered [x, y, z, roll, pitch, yaw].
+   * \return final hessian
+   */
+  inline const Eigen::Matrix<double, 6, 6>& getFinalHessian() const {
+    return (final_hessian_);
+  }
+
+  /** \brief Get the covariance of the final transformation, the inverse of
+   * the negated final hessian with its eigenvalues bounded from below. It is
+   * relative to the score scale rather than calibrated in meters and radians.
+   * \return covariance ordered as \ref getFinalHessian
+   */
+  inline const Eigen::Matrix<double, 6, 6>& getCovariance() const {
+    return (covariance_);
+  }
+
+  /** \brief Get the covariance of the final transformation in meters and
+   * radians. Near the optimum the negated hessian sums the information
+   * J^T C^-1 J of the points, C the covariance of their voxel, weighted by
+   * at most -d1 d2 (Equation 6.13 [Magnusson 2009]). Removing that weight
+   * leaves the information of points distributed like their voxel.
+   * \return covariance ordered as \ref getFinalHessian
+   */
+  inline Eigen::Matrix<double, 6, 6> getMetricCovariance() const {
+    return (-gauss_d1_ * gauss_d2_ * covariance_);
+  }
+
+  /** \brief Get the eigenvalues of the negated final hessian, increasing.
+   * \return information eigenvalues
+   */
+  inline const Eigen::Matrix<double, 6, 1>& getInformationEigenvalues() const {
+    return (information_eigenvalues_);
+  }
+
+  /** \brief Get the eigenvectors of the negated final hessian, one per column
+   * in the order of \ref getInformationEigenvalues.
+   * \return information eigenvectors
+   */
+  inline const Eigen::Matrix<double, 6, 6>& getInformationEigenvectors() const {
+    return (information_eigenvectors_);
+  }
+
+  /** \brief Set the ratio to the largest information eigenvalue below which a
+   * direction is reported as degenerate.
+   * \param[in] degeneracy_ratio relative eigenvalue threshold
+   */
+  inline void setDegeneracyRatio(double degeneracy_ratio) {
+    degeneracy_ratio_ = degeneracy_ratio;
+  }
+
+  inline double getDegeneracyRatio() const {
+    return (degeneracy_ratio_);
+  }
+
+  /** \brief Get the number of directions of the final alignment constrained
+   * less than the degeneracy ratio allows. Their eigenvectors are the first
+   * columns of \ref getInformationEigenvectors.
+   * \return number of degenerate directions
+   */
+  inline int getNumDegenerateDirections() const {
+    return (num_degenerate_directions_);
+  }
+
+  inline bool isDegenerate() const {
+    return (num_degenerate_directions_ > 0);
+  }
+
   /** \brief Convert 6 element transformation vector to affine transformation.
    * \param[in] x transformation vector of the form [x, y, z, roll, pitch, yaw]
    * \param[out] trans affine transform corresponding to given transfomation
@@ -213,6 +415,21 @@ public:
   // lower is better
   double calculateScore(const PointCloudSource& cloud) const;
 
+  /** \brief Align several sources, or several initial guesses of one source,
+   * against the voxel grid of the current target, which is built once and
+   * shared by all the items. Items run in parallel on the thread pool, one
+   * item per thread, with the settings of this instance; the result of an
+   * item does not depend on the number of threads.
+   * \param[in] sources one source, or one source per item
+   * \param[in] guesses initial guess of each item, empty for identity
+   * \param[out] results transformation and fitness score of each item
+   * \return false if the sizes do not match, a source is empty or no target
+   * is set
+   */
+  bool alignBatch(const std::vector<PointCloudSourceConstPtr>& sources,
+                  const RegistrationTransformations& guesses,
+                  RegistrationBatchResults& results);
+
   // TODO: the functionality it's not yet implemented, it's just for the sake of
   // interface
   void enableTimingOutput(bool enable) {
@@ -225,6 +442,8 @@ protected:
   using pcl::Registration<PointSource, PointTarget>::input_;
   using pcl::Registration<PointSource, PointTarget>::indices_;
   using pcl::Registration<PointSource, PointTarget>::target_;
+  using pcl::Registration<PointSource, PointTarget>::tree_;
+  using pcl::Registration<PointSource, PointTarget>::target_cloud_updated_;
   using pcl::Registration<PointSource, PointTarget>::nr_iterations_;
   using pcl::Registration<PointSource, PointTarget>::max_iterations_;
   using pcl::Registration<PointSource, PointTarget>::previous_transformation_;
@@ -255,12 +474,23 @@ protected:
 
   /** \brief Initiate covariance voxel structure. */
   void inline init() {
-    target_cells_.setLeafSize(resolution_, resolution_, resolution_);
-    target_cells_.setInputCloud(target_);
+    target_cells_->setLeafSize(resolution_, resolution_, resolution_);
+    target_cells_->setInputCloud(target_);
     // Initiate voxel structure.
-    target_cells_.filter(true);
+    target_cells_->filter(true);
+    cascade_target_updated_ = true;
+    batch_target_updated_ = true;
   }
 
+  /** \brief Copy the registration settings of this instance to engine,
+   * without rebuilding its voxel grid. */
+  void configureEngine(NormalDistributionsTransform& engine) const;
+
+  /** \brief Align the cascade levels, coarse to fine, starting from guess.
+   * \return the transformation to start the full resolution registration from
+   */
+  Eigen::Matrix4f alignCascade(const Eigen::Matrix4f& guess);
+
   /** \brief Compute derivatives of probability function w.r.t. the
    * transformation vector. \note Equation 6.10, 6.12 and 6.13 [Magnusson 2009].
    * \param[out] score_gradient the gradient vector of the probability function
@@ -309,16 +539,71 @@ protected:
    * \param[in] compute_hessian flag to calculate hessian, unnessissary for step
    * calculation.
    */
-  void computePointDerivatives(Eigen::Vector3d& x,
-                               Eigen::Matrix<double, 3, 6>& point_gradient_,
-                               Eigen::Matrix<double, 18, 6>& point_hessian_,
-                               bool compute_hessian = true) const;
-
   void computePointDerivatives(Eigen::Vector3d& x,
                                Eigen::Matrix<float, 4, 6>& point_gradient_,
                                Eigen::Matrix<float, 24, 6>& point_hessian_,
                                bool compute_hessian = true) const;
 
+  /** \brief Take a damped Gauss-Newton step of at most step_size_ along
+   * step_dir and update the derivatives at the new transform vector.
+   * \param[in] x current transform vector
+   * \param[in] step_dir normalized step direction
+   * \param[in] step_length unclamped step length
+   * \param[out] score, score_gradient, hessian derivatives at the new x
+   * \param[out] trans_cloud input cloud transformed by the new x
+   * \return the step length taken
+   */
+  double computeStepLengthGN(const Eigen::Matrix<double, 6, 1>& x,
+                             const Eigen::Matrix<double, 6, 1>& step_dir,
+                             double step_length,
+                             double& score,
+                             Eigen::Matrix<double, 6, 1>& score_gradient,
+                             Eigen::Matrix<double, 6, 6>& hessian,
+                             PointCloudSource& trans_cloud);
+
+  /** \brief Store the final hessian and derive the covariance and the
+   * degeneracy of the alignment from its eigen decomposition.
+   * \param[in] hessian hessian of the score at the final transformation
+   */
+  void computeUncertainty(const Eigen::Matrix<double, 6, 6>& hessian);
+
+  /** \brief Neighbor search buffers of one thread, kept for the lifetime of
+   * the instance so that repeated alignments do not allocate. */
+  struct SearchScratch {
+    std::vector<TargetGridLeafConstPtr> neighborhood;
+    std::vector<float> distances;
+    std::vector<int> indices;
+  };
+
+  /** \brief Neighborhood of a point cached by \ref cachedNeighborhood, valid
+   * if its generation is \ref neighborhood_generation_. */
+  struct PointNeighborhood {
+    PointNeighborhood() : generation(0) {}
+
+    VoxelKey key;
+    unsigned int generation;
+    std::vector<TargetGridLeafConstPtr> leaves;
+  };
+
+  /** \brief Neighborhood of point idx of input_, transformed to x_trans_pt.
+   * The DIRECT* neighborhoods only depend on the voxel of the point, so they
+   * are looked up again only when the point changes voxel within one
+   * alignment. Safe to call in parallel for different points.
+   * \return the neighborhood, stored in the cache or in scratch
+   */
+  const std::vector<TargetGridLeafConstPtr>&
+  cachedNeighborhood(int idx,
+                     const PointSource& x_trans_pt,
+                     SearchScratch& scratch);
+
+  /** \brief Find the cells around x_trans_pt with the search method, in
+   * the buffers of scratch.
+   * \return the neighborhood, stored in scratch
+   */
+  const std::vector<TargetGridLeafConstPtr>&
+  findNeighborhood(const PointSource& x_trans_pt,
+                   SearchScratch& scratch) const;
+
   /** \brief Compute hessian of probability function w.r.t. the transformation
    * vector. \note Equation 6.13 [Magnusson 2009]. \param[out] hessian the
    * hessian matrix of the probability function w.r.t. the transformation vector
@@ -329,19 +614,6 @@ protected:
                       PointCloudSource& trans_cloud,
                       Eigen::Matrix<double, 6, 1>& p);
 
-  /** \brief Compute individual point contirbutions to hessian of probability
-   * function w.r.t. the transformation vector. \note Equation 6.13 [Magnusson
-   * 2009]. \param[in,out] hessian the hessian matrix of the probability
-   * function w.r.t. the transformation vector \param[in] x_trans transformed
-   * point minus mean of occupied covariance voxel \param[in] c_inv covariance
-   * of occupied covariance voxel
-   */
-  void updateHessian(Eigen::Matrix<double, 6, 6>& hessian,
-                     const Eigen::Matrix<double, 3, 6>& point_gradient_,
-                     const Eigen::Matrix<double, 18, 6>& point_hessian_,
-                     const Eigen::Vector3d& x_trans,
-                     const Eigen::Matrix3d& c_inv) const;
-
   /** \brief Compute line search step length and update transform and
    * probability derivatives using More-Thuente method. \note Search Algorithm
    * [More, Thuente 1994] \param[in] x initial transformation vector, \f$ x \f$
@@ -467,8 +739,8 @@ protected:
   }
 
   /** \brief The voxel grid generated from target cloud containing point means
-   * and covariances. */
-  TargetGrid target_cells_;
+   * and covariances. Shared read only with the engines of alignBatch. */
+  TargetGridPtr target_cells_;
 
   // double fitness_epsilon_;
 
@@ -478,6 +750,28 @@ protected:
   /** \brief The maximum step length. */
   double step_size_;
 
+  /** \brief Solver of the registration. */
+  NdtSolver solver_;
+
+  /** \brief Damping of the Gauss-Newton hessian diagonal, relative. */
+  double gauss_newton_damping_;
+
+  /** \brief Hessian of the score at the final transformation. */
+  Eigen::Matrix<double, 6, 6> final_hessian_;
+
+  /** \brief Covariance of the final transformation. */
+  Eigen::Matrix<double, 6, 6> covariance_;
+
+  /** \brief Eigen decomposition of the negated final hessian. */
+  Eigen::Matrix<double, 6, 1> information_eigenvalues_;
+  Eigen::Matrix<double, 6, 6> information_eigenvectors_;
+
+  /** \brief Relative eigenvalue below which a direction is degenerate. */
+  double degeneracy_ratio_;
+
+  /** \brief Number of degenerate directions of the final alignment. */
+  int num_degenerate_directions_;
+
   /** \brief The ratio of outliers of points w.r.t. a normal distribution,
    * Equation 6.7 [Magnusson 2009]. */
   double outlier_ratio_;
@@ -490,14 +784,15 @@ protected:
    * Equation 6.9 and 6.10 [Magnusson 2009]. */
   double trans_probability_;
 
+  /** \brief The probability score of the initial guess, to tell whether the
+   * registration improved on it. */
+  double initial_trans_probability_;
+
   /** \brief Precomputed Angular Gradient
    *
    * The precomputed angular derivatives for the jacobian of a transformation
    * vector, Equation 6.19 [Magnusson 2009].
    */
-  Eigen::Vector3d j_ang_a_, j_ang_b_, j_ang_c_, j_ang_d_, j_ang_e_, j_ang_f_,
-      j_ang_g_, j_ang_h_;
-
   Eigen::Matrix<float, 8, 4> j_ang;
 
   /** \brief Precomputed Angular Hessian
@@ -505,10 +800,6 @@ protected:
    * The precomputed angular derivatives for the hessian of a transformation
    * vector, Equation 6.19 [Magnusson 2009].
    */
-  Eigen::Vector3d h_ang_a2_, h_ang_a3_, h_ang_b2_, h_ang_b3_, h_ang_c2_,
-      h_ang_c3_, h_ang_d1_, h_ang_d2_, h_ang_d3_, h_ang_e1_, h_ang_e2_,
-      h_ang_e3_, h_ang_f1_, h_ang_f2_, h_ang_f3_;
-
   Eigen::Matrix<float, 16, 4> h_ang;
 
   /** \brief The first order derivative of the transformation of a point w.r.t.
@@ -519,11 +810,72 @@ protected:
    * the transform vector, \f$ H_E \f$ in Equation 6.20 [Magnusson 2009]. */
   //      Eigen::Matrix<double, 18, 6> point_hessian_;
 
-  int num_threads_;
+  /** \brief Workers running the parallel loops. */
+  RegistrationThreadPool::Ptr thread_pool_;
+
+  /** \brief Search buffers indexed by thread id. Mutable for the const
+   * calculateScore, which makes concurrent calls on one instance unsafe. */
+  mutable std::vector<SearchScratch> search_scratch_;
+
+  /** \brief Cached neighborhood of each point of input_. */
+  std::vector<PointNeighborhood> point_neighborhoods_;
+
+  /** \brief Incremented by each alignment, invalidates the cache. */
+  unsigned int neighborhood_generation_;
+
+  /** \brief False to bypass the neighborhood cache. */
+  bool neighborhood_cache_;
+
+  /** \brief Score, gradient and hessian sums over one chunk of points. */
+  struct DerivativeSums {
+    double score;
+    Eigen::Matrix<double, 6, 1> gradient;
+    Eigen::Matrix<double, 6, 6> hessian;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  /** \brief Number of points summed per chunk. Chunks do not depend on the
+   * number of threads and are reduced in order, so the derivatives are the
+   * same for any number of threads. */
+  static const int k_point_chunk_size_ = 256;
+
+  /** \brief Per chunk partial sums, reused across evaluations. */
+  std::vector<DerivativeSums, Eigen::aligned_allocator<DerivativeSums>>
+      partial_sums_;
 
   /** \brief Enables log print statements with GICP timing information. */
   bool k_enable_timing_output_;
 
+  /** \brief A cascade level and the engine aligning it, whose voxel grid is
+   * merged from \ref target_cells_. */
+  struct CascadeLevel {
+    int factor;
+    int iterations;
+    Ptr engine;
+    // Output of the level alignment, reused across calls
+    PointCloudSource aligned;
+  };
+
+  /** \brief Cascade levels, coarsest first, empty if disabled. */
+  std::vector<CascadeLevel> cascade_levels_;
+
+  /** \brief True if the grids of the levels must be rebuilt. */
+  bool cascade_target_updated_;
+
+  /** \brief A registration of alignBatch and its output, reused across
+   * calls. */
+  struct BatchEngine {
+    Ptr engine;
+    PointCloudSource aligned;
+  };
+
+  /** \brief Registrations of alignBatch, one per thread, sharing the voxel
+   * grid of this instance. */
+  std::vector<BatchEngine> batch_engines_;
+
+  /** \brief True if the batch engines must be handed the target again. */
+  bool batch_target_updated_;
+
 public:
   NeighborSearchMethod search_method;
 
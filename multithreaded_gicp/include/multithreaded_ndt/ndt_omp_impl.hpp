@@ -46,37 +46,24 @@
 template <typename PointSource, typename PointTarget>
 pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
     NormalDistributionsTransform()
-  : target_cells_(),
+  : NormalDistributionsTransform(std::make_shared<RegistrationThreadPool>(
+        std::max(1u, std::thread::hardware_concurrency()))) {}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
+    NormalDistributionsTransform(const RegistrationThreadPool::Ptr& thread_pool)
+  : target_cells_(new TargetGrid),
     resolution_(1.0f),
     step_size_(0.1),
+    solver_(NdtSolver::NEWTON_LINE_SEARCH),
+    gauss_newton_damping_(1e-3),
     outlier_ratio_(0.55),
     gauss_d1_(),
     gauss_d2_(),
     gauss_d3_(),
     trans_probability_(),
-    j_ang_a_(),
-    j_ang_b_(),
-    j_ang_c_(),
-    j_ang_d_(),
-    j_ang_e_(),
-    j_ang_f_(),
-    j_ang_g_(),
-    j_ang_h_(),
-    h_ang_a2_(),
-    h_ang_a3_(),
-    h_ang_b2_(),
-    h_ang_b3_(),
-    h_ang_c2_(),
-    h_ang_c3_(),
-    h_ang_d1_(),
-    h_ang_d2_(),
-    h_ang_d3_(),
-    h_ang_e1_(),
-    h_ang_e2_(),
-    h_ang_e3_(),
-    h_ang_f1_(),
-    h_ang_f2_(),
-    h_ang_f3_() {
+    initial_trans_probability_() {
   reg_name_ = "NormalDistributionsTransform";
 
   double gauss_c1, gauss_c2;
@@ -93,7 +80,17 @@ pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
   max_iterations_ = 35;
 
   search_method = KDTREE;
-  num_threads_ = omp_get_max_threads();
+  cascade_target_updated_ = true;
+  batch_target_updated_ = true;
+  neighborhood_generation_ = 0;
+  neighborhood_cache_ = true;
+  final_hessian_.setZero();
+  covariance_.setZero();
+  information_eigenvalues_.setZero();
+  information_eigenvectors_.setIdentity();
+  degeneracy_ratio_ = 1e-3;
+  num_degenerate_directions_ = 0;
+  setThreadPool(thread_pool);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -114,11 +111,22 @@ void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
   gauss_d2_ =
       -2 * log((-log(gauss_c1 * exp(-0.5) + gauss_c2) - gauss_d3_) / gauss_d1_);
 
-  if (guess != Eigen::Matrix4f::Identity()) {
+  // The target grid or the source may have changed since the last alignment
+  if (search_method == KDTREE)
+    target_cells_->updateCentroids();
+  neighborhood_generation_++;
+  point_neighborhoods_.resize(input_->points.size());
+
+  // Coarse to fine levels move the initial guess into the basin of the full
+  // resolution grid
+  const Eigen::Matrix4f cascade_guess =
+      cascade_levels_.empty() ? guess : alignCascade(guess);
+
+  if (cascade_guess != Eigen::Matrix4f::Identity()) {
     // Initialise final transformation to the guessed one
-    final_transformation_ = guess;
+    final_transformation_ = cascade_guess;
     // Apply guessed transformation prior to search for neighbours
-    transformPointCloud(output, output, guess);
+    transformPointCloud(output, output, cascade_guess);
   }
 
   Eigen::Transform<float, 3, Eigen::Affine, Eigen::ColMajor> eig_transformation;
@@ -140,17 +148,27 @@ void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
   // Calculate derivates of initial transform vector, subsequent derivative
   // calculations are done in the step length determination.
   score = computeDerivatives(score_gradient, hessian, output, p);
+  initial_trans_probability_ =
+      score / static_cast<double>(input_->points.size());
 
   while (!converged_) {
     // Store previous transformation
     previous_transformation_ = transformation_;
 
-    // Solve for decent direction using newton method, line 23 in Algorithm 2
-    // [Magnusson 2009]
-    Eigen::JacobiSVD<Eigen::Matrix<double, 6, 6>> sv(
-        hessian, Eigen::ComputeFullU | Eigen::ComputeFullV);
-    // Negative for maximization as opposed to minimization
-    delta_p = sv.solve(-score_gradient);
+    if (solver_ == NdtSolver::GAUSS_NEWTON) {
+      // The Gauss-Newton hessian is negative semi-definite, damping its
+      // diagonal keeps it definite and shortens the step
+      Eigen::Matrix<double, 6, 6> damped_hessian = hessian;
+      damped_hessian.diagonal() *= 1 + gauss_newton_damping_;
+      delta_p = damped_hessian.ldlt().solve(-score_gradient);
+    } else {
+      // Solve for decent direction using newton method, line 23 in Algorithm 2
+      // [Magnusson 2009]
+      Eigen::JacobiSVD<Eigen::Matrix<double, 6, 6>> sv(
+          hessian, Eigen::ComputeFullU | Eigen::ComputeFullV);
+      // Negative for maximization as opposed to minimization
+      delta_p = sv.solve(-score_gradient);
+    }
 
     // Calculate step length with guarnteed sufficient decrease [More, Thuente
     // 1994]
@@ -159,19 +177,30 @@ void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
     if (delta_p_norm == 0 || delta_p_norm != delta_p_norm) {
       trans_probability_ = score / static_cast<double>(input_->points.size());
       converged_ = delta_p_norm == delta_p_norm;
+      computeUncertainty(hessian);
       return;
     }
 
     delta_p.normalize();
-    delta_p_norm = computeStepLengthMT(p,
-                                       delta_p,
-                                       delta_p_norm,
-                                       step_size_,
-                                       transformation_epsilon_ / 2,
-                                       score,
-                                       score_gradient,
-                                       hessian,
-                                       output);
+    if (solver_ == NdtSolver::GAUSS_NEWTON) {
+      delta_p_norm = computeStepLengthGN(p,
+                                         delta_p,
+                                         delta_p_norm,
+                                         score,
+                                         score_gradient,
+                                         hessian,
+                                         output);
+    } else {
+      delta_p_norm = computeStepLengthMT(p,
+                                         delta_p,
+                                         delta_p_norm,
+                                         step_size_,
+                                         transformation_epsilon_ / 2,
+                                         score,
+                                         score_gradient,
+                                         hessian,
+                                         output);
+    }
     delta_p *= delta_p_norm;
 
     transformation_ =
@@ -206,16 +235,51 @@ void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
   // scan registration are accurate but the normalization constants need to be
   // modified for it to be globally accurate
   trans_probability_ = score / static_cast<double>(input_->points.size());
-}
 
-#ifndef _OPENMP
-int omp_get_max_threads() {
-  return 1;
+  computeUncertainty(hessian);
 }
-int omp_get_thread_num() {
-  return 0;
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
+    computeUncertainty(const Eigen::Matrix<double, 6, 6>& hessian) {
+  final_hessian_ = hessian;
+
+  // The score is maximized, its negated hessian is the information matrix
+  Eigen::Matrix<double, 6, 6> information = -hessian;
+  information = 0.5 * (information + information.transpose()).eval();
+
+  Eigen::SelfAdjointEigenSolver<Eigen::Matrix<double, 6, 6>> eigen_solver(
+      information);
+  if (eigen_solver.info() != Eigen::Success) {
+    information_eigenvalues_.setZero();
+    information_eigenvectors_.setIdentity();
+    covariance_.setZero();
+    num_degenerate_directions_ = 6;
+    return;
+  }
+  information_eigenvalues_ = eigen_solver.eigenvalues();
+  information_eigenvectors_ = eigen_solver.eigenvectors();
+
+  // Eigenvalues are increasing. Directions below the threshold, including
+  // those the Newton hessian leaves indefinite, are reported degenerate and
+  // get the threshold as their information
+  const double max_eigenvalue = information_eigenvalues_(5);
+  const double min_eigenvalue =
+      std::max(degeneracy_ratio_ * max_eigenvalue,
+               std::numeric_limits<double>::epsilon());
+  num_degenerate_directions_ = 0;
+  Eigen::Matrix<double, 6, 1> inverse_eigenvalues;
+  for (int i = 0; i < 6; i++) {
+    if (!(information_eigenvalues_(i) >= min_eigenvalue)) {
+      num_degenerate_directions_++;
+    }
+    inverse_eigenvalues(i) =
+        1.0 / std::max(information_eigenvalues_(i), min_eigenvalue);
+  }
+  covariance_ = information_eigenvectors_ * inverse_eigenvalues.asDiagonal() *
+                information_eigenvectors_.transpose();
 }
-#endif
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 template <typename PointSource, typename PointTarget>
@@ -225,121 +289,79 @@ double pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
                        PointCloudSource& trans_cloud,
                        Eigen::Matrix<double, 6, 1>& p,
                        bool compute_hessian) {
-  score_gradient.setZero();
-  hessian.setZero();
-  double score = 0;
-
-  std::vector<double> scores(input_->points.size());
-  std::vector<Eigen::Matrix<double, 6, 1>,
-              Eigen::aligned_allocator<Eigen::Matrix<double, 6, 1>>>
-      score_gradients(input_->points.size());
-  std::vector<Eigen::Matrix<double, 6, 6>,
-              Eigen::aligned_allocator<Eigen::Matrix<double, 6, 6>>>
-      hessians(input_->points.size());
-  for (int i = 0; i < input_->points.size(); i++) {
-    scores[i] = 0;
-    score_gradients[i].setZero();
-    hessians[i].setZero();
-  }
-
   // Precompute Angular Derivatives (eq. 6.19 and 6.21)[Magnusson 2009]
   computeAngleDerivatives(p);
 
-  std::vector<std::vector<TargetGridLeafConstPtr>> neighborhoods(num_threads_);
-  std::vector<std::vector<float>> distancess(num_threads_);
+  // Grows only when the number of threads does
+  search_scratch_.resize(thread_pool_->numThreads());
+
+  const int num_points = static_cast<int>(input_->points.size());
+  const int num_chunks =
+      (num_points + k_point_chunk_size_ - 1) / k_point_chunk_size_;
+  partial_sums_.resize(num_chunks);
 
   // Update gradient and hessian for each point, line 17 in Algorithm 2
   // [Magnusson 2009]
-#pragma omp parallel for num_threads(num_threads_) schedule(guided, 8)
-  for (int idx = 0; idx < input_->points.size(); idx++) {
-    int thread_n = omp_get_thread_num();
-
-    // Original Point and Transformed Point
-    PointSource x_pt, x_trans_pt;
-    // Original Point and Transformed Point (for math)
-    Eigen::Vector3d x, x_trans;
-    // Occupied Voxel
-    TargetGridLeafConstPtr cell;
-    // Inverse Covariance of Occupied Voxel
-    Eigen::Matrix3d c_inv;
-
-    // Initialize Point Gradient and Hessian
-    Eigen::Matrix<float, 4, 6> point_gradient_;
-    Eigen::Matrix<float, 24, 6> point_hessian_;
-    point_gradient_.setZero();
-    point_gradient_.block<3, 3>(0, 0).setIdentity();
-    point_hessian_.setZero();
-
-    x_trans_pt = trans_cloud.points[idx];
-
-    auto& neighborhood = neighborhoods[thread_n];
-    auto& distances = distancess[thread_n];
-
-    // Find nieghbors (Radius search has been experimentally faster than direct
-    // neighbor checking.
-    switch (search_method) {
-    case KDTREE:
-      target_cells_.radiusSearch(
-          x_trans_pt, resolution_, neighborhood, distances);
-      break;
-    case DIRECT26:
-      target_cells_.getNeighborhoodAtPoint(x_trans_pt, neighborhood);
-      break;
-    default:
-    case DIRECT7:
-      target_cells_.getNeighborhoodAtPoint7(x_trans_pt, neighborhood);
-      break;
-    case DIRECT1:
-      target_cells_.getNeighborhoodAtPoint1(x_trans_pt, neighborhood);
-      break;
-    }
-
-    double score_pt = 0;
-    Eigen::Matrix<double, 6, 1> score_gradient_pt =
-        Eigen::Matrix<double, 6, 1>::Zero();
-    Eigen::Matrix<double, 6, 6> hessian_pt =
-        Eigen::Matrix<double, 6, 6>::Zero();
-
-    for (typename std::vector<TargetGridLeafConstPtr>::iterator
-             neighborhood_it = neighborhood.begin();
-         neighborhood_it != neighborhood.end();
-         neighborhood_it++) {
-      cell = *neighborhood_it;
-      x_pt = input_->points[idx];
-      x = Eigen::Vector3d(x_pt.x, x_pt.y, x_pt.z);
-
-      x_trans = Eigen::Vector3d(x_trans_pt.x, x_trans_pt.y, x_trans_pt.z);
-
-      // Denorm point, x_k' in Equations 6.12 and 6.13 [Magnusson 2009]
-      x_trans -= cell->getMean();
-      // Uses precomputed covariance for speed.
-      c_inv = cell->getInverseCov();
-
-      // Compute derivative of transform function w.r.t. transform vector, J_E
-      // and H_E in Equations 6.18 and 6.20 [Magnusson 2009]
-      computePointDerivatives(x, point_gradient_, point_hessian_);
-      // Update score, gradient and hessian, lines 19-21 in Algorithm 2,
-      // according to Equations 6.10, 6.12 and 6.13, respectively [Magnusson
-      // 2009]
-      score_pt += updateDerivatives(score_gradient_pt,
-                                    hessian_pt,
-                                    point_gradient_,
-                                    point_hessian_,
-                                    x_trans,
-                                    c_inv,
-                                    compute_hessian);
-    }
-
-    scores[idx] = score_pt;
-    score_gradients[idx].noalias() = score_gradient_pt;
-    hessians[idx].noalias() = hessian_pt;
-  }
-
-  // Ensure that the result is invariant against the summing up order
-  for (int i = 0; i < input_->points.size(); i++) {
-    score += scores[i];
-    score_gradient += score_gradients[i];
-    hessian += hessians[i];
+  thread_pool_->parallelFor(
+      num_points,
+      k_point_chunk_size_,
+      [&](int begin, int end, int thread_n) {
+        DerivativeSums& sums = partial_sums_[begin / k_point_chunk_size_];
+        sums.score = 0.;
+        sums.gradient.setZero();
+        sums.hessian.setZero();
+        // Point Gradient and Hessian, only their non constant entries are
+        // rewritten by computePointDerivatives
+        Eigen::Matrix<float, 4, 6> point_gradient_;
+        Eigen::Matrix<float, 24, 6> point_hessian_;
+        point_gradient_.setZero();
+        point_gradient_.block<3, 3>(0, 0).setIdentity();
+        point_hessian_.setZero();
+        const bool compute_point_hessian =
+            compute_hessian && solver_ != NdtSolver::GAUSS_NEWTON;
+
+        for (int idx = begin; idx < end; idx++) {
+          const PointSource& x_trans_pt = trans_cloud.points[idx];
+          const std::vector<TargetGridLeafConstPtr>& neighborhood =
+              cachedNeighborhood(idx, x_trans_pt, search_scratch_[thread_n]);
+          if (neighborhood.empty())
+            continue;
+
+          // Compute derivative of transform function w.r.t. transform vector,
+          // J_E and H_E in Equations 6.18 and 6.20 [Magnusson 2009]. They do
+          // not depend on the cell, so once per point
+          const PointSource& x_pt = input_->points[idx];
+          Eigen::Vector3d x(x_pt.x, x_pt.y, x_pt.z);
+          computePointDerivatives(
+              x, point_gradient_, point_hessian_, compute_point_hessian);
+
+          const Eigen::Vector3d x_trans_pt3(
+              x_trans_pt.x, x_trans_pt.y, x_trans_pt.z);
+          for (const TargetGridLeafConstPtr& cell : neighborhood) {
+            // Denorm point, x_k' in Equations 6.12 and 6.13 [Magnusson 2009]
+            const Eigen::Vector3d x_trans = x_trans_pt3 - cell->getMean();
+            // Update score, gradient and hessian, lines 19-21 in Algorithm 2,
+            // according to Equations 6.10, 6.12 and 6.13, respectively
+            // [Magnusson 2009]. Uses precomputed covariance for speed.
+            sums.score += updateDerivatives(sums.gradient,
+                                            sums.hessian,
+                                            point_gradient_,
+                                            point_hessian_,
+                                            x_trans,
+                                            cell->getInverseCov(),
+                                            compute_hessian);
+          }
+        }
+      });
+
+  // Reduce in chunk order so that the result does not depend on the threads
+  double score = 0;
+  score_gradient.setZero();
+  hessian.setZero();
+  for (int k = 0; k < num_chunks; k++) {
+    score += partial_sums_[k].score;
+    score_gradient += partial_sums_[k].gradient;
+    hessian += partial_sums_[k].hessian;
   }
 
   return (score);
@@ -380,15 +402,6 @@ void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
 
   // Precomputed angular gradiant components. Letters correspond to
   // Equation 6.19 [Magnusson 2009]
-  j_ang_a_ << (-sx * sz + cx * sy * cz), (-sx * cz - cx * sy * sz), (-cx * cy);
-  j_ang_b_ << (cx * sz + sx * sy * cz), (cx * cz - sx * sy * sz), (-sx * cy);
-  j_ang_c_ << (-sy * cz), sy * sz, cy;
-  j_ang_d_ << sx * cy * cz, (-sx * cy * sz), sx * sy;
-  j_ang_e_ << (-cx * cy * cz), cx * cy * sz, (-cx * sy);
-  j_ang_f_ << (-cy * sz), (-cy * cz), 0;
-  j_ang_g_ << (cx * cz - sx * sy * sz), (-cx * sz - sx * sy * cz), 0;
-  j_ang_h_ << (sx * cz + cx * sy * sz), (cx * sy * cz - sx * sz), 0;
-
   j_ang.setZero();
   j_ang.row(0).noalias() = Eigen::Vector4f(
       (-sx * sz + cx * sy * cz), (-sx * cz - cx * sy * sz), (-cx * cy), 0.0f);
@@ -408,28 +421,6 @@ void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
   if (compute_hessian) {
     // Precomputed angular hessian components. Letters correspond to
     // Equation 6.21 and numbers correspond to row index [Magnusson 2009]
-    h_ang_a2_ << (-cx * sz - sx * sy * cz), (-cx * cz + sx * sy * sz), sx * cy;
-    h_ang_a3_ << (-sx * sz + cx * sy * cz), (-cx * sy * sz - sx * cz),
-        (-cx * cy);
-
-    h_ang_b2_ << (cx * cy * cz), (-cx * cy * sz), (cx * sy);
-    h_ang_b3_ << (sx * cy * cz), (-sx * cy * sz), (sx * sy);
-
-    h_ang_c2_ << (-sx * cz - cx * sy * sz), (sx * sz - cx * sy * cz), 0;
-    h_ang_c3_ << (cx * cz - sx * sy * sz), (-sx * sy * cz - cx * sz), 0;
-
-    h_ang_d1_ << (-cy * cz), (cy * sz), (sy);
-    h_ang_d2_ << (-sx * sy * cz), (sx * sy * sz), (sx * cy);
-    h_ang_d3_ << (cx * sy * cz), (-cx * sy * sz), (-cx * cy);
-
-    h_ang_e1_ << (sy * sz), (sy * cz), 0;
-    h_ang_e2_ << (-sx * cy * sz), (-sx * cy * cz), 0;
-    h_ang_e3_ << (cx * cy * sz), (cx * cy * cz), 0;
-
-    h_ang_f1_ << (-cy * cz), (cy * sz), 0;
-    h_ang_f2_ << (-cx * sz - sx * sy * cz), (-cx * cz + sx * sy * sz), 0;
-    h_ang_f3_ << (-sx * sz + cx * sy * cz), (-cx * sy * sz - sx * cz), 0;
-
     h_ang.setZero();
     h_ang.row(0).noalias() = Eigen::Vector4f((-cx * sz - sx * sy * cz),
                                              (-cx * cz + sx * sy * sz),
@@ -523,52 +514,6 @@ void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
   }
 }
 
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-template <typename PointSource, typename PointTarget>
-void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
-    computePointDerivatives(Eigen::Vector3d& x,
-                            Eigen::Matrix<double, 3, 6>& point_gradient_,
-                            Eigen::Matrix<double, 18, 6>& point_hessian_,
-                            bool compute_hessian) const {
-  // Calculate first derivative of Transformation Equation 6.17 w.r.t. transform
-  // vector p. Derivative w.r.t. ith element of transform vector corresponds to
-  // column i, Equation 6.18 and 6.19 [Magnusson 2009]
-  point_gradient_(1, 3) = x.dot(j_ang_a_);
-  point_gradient_(2, 3) = x.dot(j_ang_b_);
-  point_gradient_(0, 4) = x.dot(j_ang_c_);
-  point_gradient_(1, 4) = x.dot(j_ang_d_);
-  point_gradient_(2, 4) = x.dot(j_ang_e_);
-  point_gradient_(0, 5) = x.dot(j_ang_f_);
-  point_gradient_(1, 5) = x.dot(j_ang_g_);
-  point_gradient_(2, 5) = x.dot(j_ang_h_);
-
-  if (compute_hessian) {
-    // Vectors from Equation 6.21 [Magnusson 2009]
-    Eigen::Vector3d a, b, c, d, e, f;
-
-    a << 0, x.dot(h_ang_a2_), x.dot(h_ang_a3_);
-    b << 0, x.dot(h_ang_b2_), x.dot(h_ang_b3_);
-    c << 0, x.dot(h_ang_c2_), x.dot(h_ang_c3_);
-    d << x.dot(h_ang_d1_), x.dot(h_ang_d2_), x.dot(h_ang_d3_);
-    e << x.dot(h_ang_e1_), x.dot(h_ang_e2_), x.dot(h_ang_e3_);
-    f << x.dot(h_ang_f1_), x.dot(h_ang_f2_), x.dot(h_ang_f3_);
-
-    // Calculate second derivative of Transformation Equation 6.17 w.r.t.
-    // transform vector p. Derivative w.r.t. ith and jth elements of transform
-    // vector corresponds to the 3x1 block matrix starting at (3i,j),
-    // Equation 6.20 and 6.21 [Magnusson 2009]
-    point_hessian_.block<3, 1>(9, 3) = a;
-    point_hessian_.block<3, 1>(12, 3) = b;
-    point_hessian_.block<3, 1>(15, 3) = c;
-    point_hessian_.block<3, 1>(9, 4) = b;
-    point_hessian_.block<3, 1>(12, 4) = d;
-    point_hessian_.block<3, 1>(15, 4) = e;
-    point_hessian_.block<3, 1>(9, 5) = c;
-    point_hessian_.block<3, 1>(12, 5) = e;
-    point_hessian_.block<3, 1>(15, 5) = f;
-  }
-}
-
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 template <typename PointSource, typename PointTarget>
 double pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
@@ -585,9 +530,12 @@ double pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
 
   float gauss_d2 = gauss_d2_;
 
+  // (x_k - mu_k)^T Sigma_k^-1, the covariance is symmetric
+  const Eigen::Matrix<float, 1, 4> x_trans4_x_c_inv4 = x_trans4 * c_inv4;
+
   // e^(-d_2/2 * (x_k - mu_k)^T Sigma_k^-1 (x_k - mu_k)) Equation 6.9 [Magnusson
   // 2009]
-  float e_x_cov_x = exp(-gauss_d2 * x_trans4.dot(x_trans4 * c_inv4) * 0.5f);
+  float e_x_cov_x = exp(-gauss_d2 * x_trans4_x_c_inv4.dot(x_trans4) * 0.5f);
   // Calculate probability of transtormed points existance, Equation 6.9
   // [Magnusson 2009]
   float score_inc = -gauss_d1_ * e_x_cov_x;
@@ -601,36 +549,35 @@ double pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
   // Reusable portion of Equation 6.12 and 6.13 [Magnusson 2009]
   e_x_cov_x *= gauss_d1_;
 
-  Eigen::Matrix<float, 4, 6> c_inv4_x_point_gradient4 =
-      c_inv4 * point_gradient4;
-  Eigen::Matrix<float, 6, 1> x_trans4_dot_c_inv4_x_point_gradient4 =
-      x_trans4 * c_inv4_x_point_gradient4;
+  // (x_k - mu_k)^T Sigma_k^-1 J_E, Equation 6.12 [Magnusson 2009]
+  const Eigen::Matrix<float, 1, 6> x_trans4_dot_c_inv4_x_point_gradient4 =
+      x_trans4_x_c_inv4 * point_gradient4;
 
   score_gradient.noalias() +=
-      (e_x_cov_x * x_trans4_dot_c_inv4_x_point_gradient4).cast<double>();
+      (e_x_cov_x * x_trans4_dot_c_inv4_x_point_gradient4.transpose())
+          .cast<double>();
 
   if (compute_hessian) {
-    Eigen::Matrix<float, 1, 4> x_trans4_x_c_inv4 = x_trans4 * c_inv4;
-    Eigen::Matrix<float, 6, 6>
-        point_gradient4_colj_dot_c_inv4_x_point_gradient4_col_i =
-            point_gradient4.transpose() * c_inv4_x_point_gradient4;
-    Eigen::Matrix<float, 6, 1> x_trans4_dot_c_inv4_x_ext_point_hessian_4ij;
-
-    for (int i = 0; i < 6; i++) {
-      // Sigma_k^-1 d(T(x,p))/dpi, Reusable portion of Equation 6.12 and 6.13
-      // [Magnusson 2009] Update gradient, Equation 6.12 [Magnusson 2009]
-      x_trans4_dot_c_inv4_x_ext_point_hessian_4ij.noalias() =
-          x_trans4_x_c_inv4 * point_hessian_.block<4, 6>(i * 4, 0);
-
-      for (int j = 0; j < hessian.cols(); j++) {
-        // Update hessian, Equation 6.13 [Magnusson 2009]
-        hessian(i, j) += e_x_cov_x *
-            (-gauss_d2 * x_trans4_dot_c_inv4_x_point_gradient4(i) *
-                 x_trans4_dot_c_inv4_x_point_gradient4(j) +
-             x_trans4_dot_c_inv4_x_ext_point_hessian_4ij(j) +
-             point_gradient4_colj_dot_c_inv4_x_point_gradient4_col_i(j, i));
+    // J_E^T Sigma_k^-1 J_E, the first order term of Equation 6.13 [Magnusson
+    // 2009], kept alone by Gauss-Newton
+    Eigen::Matrix<float, 6, 6> point_hessian_sum =
+        point_gradient4.transpose() * (c_inv4 * point_gradient4);
+
+    if (solver_ != NdtSolver::GAUSS_NEWTON) {
+      point_hessian_sum.noalias() -= gauss_d2 *
+          x_trans4_dot_c_inv4_x_point_gradient4.transpose() *
+          x_trans4_dot_c_inv4_x_point_gradient4;
+
+      // H_E only has second derivatives w.r.t. two rotation angles (Equation
+      // 6.20 [Magnusson 2009]), so only the rotation block gets this term
+      for (int i = 3; i < 6; i++) {
+        point_hessian_sum.block<1, 3>(i, 3).noalias() +=
+            x_trans4_x_c_inv4 * point_hessian_.block<4, 3>(i * 4, 3);
       }
     }
+
+    // Update hessian, Equation 6.13 [Magnusson 2009]
+    hessian.noalias() += (e_x_cov_x * point_hessian_sum).cast<double>();
   }
 
   return (score_inc);
@@ -641,116 +588,11 @@ template <typename PointSource, typename PointTarget>
 void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
     computeHessian(Eigen::Matrix<double, 6, 6>& hessian,
                    PointCloudSource& trans_cloud,
-                   Eigen::Matrix<double, 6, 1>&) {
-  // Original Point and Transformed Point
-  PointSource x_pt, x_trans_pt;
-  // Original Point and Transformed Point (for math)
-  Eigen::Vector3d x, x_trans;
-  // Occupied Voxel
-  TargetGridLeafConstPtr cell;
-  // Inverse Covariance of Occupied Voxel
-  Eigen::Matrix3d c_inv;
-
-  // Initialize Point Gradient and Hessian
-  Eigen::Matrix<double, 3, 6> point_gradient_;
-  Eigen::Matrix<double, 18, 6> point_hessian_;
-  point_gradient_.setZero();
-  point_gradient_.block<3, 3>(0, 0).setIdentity();
-  point_hessian_.setZero();
-
-  hessian.setZero();
-
-  // Precompute Angular Derivatives unessisary because only used after regular
-  // derivative calculation
-
-  // Update hessian for each point, line 17 in Algorithm 2 [Magnusson 2009]
-  for (size_t idx = 0; idx < input_->points.size(); idx++) {
-    x_trans_pt = trans_cloud.points[idx];
-
-    // Find nieghbors (Radius search has been experimentally faster than direct
-    // neighbor checking.
-    std::vector<TargetGridLeafConstPtr> neighborhood;
-    std::vector<float> distances;
-    switch (search_method) {
-    case KDTREE:
-      target_cells_.radiusSearch(
-          x_trans_pt, resolution_, neighborhood, distances);
-      break;
-    case DIRECT26:
-      target_cells_.getNeighborhoodAtPoint(x_trans_pt, neighborhood);
-      break;
-    default:
-    case DIRECT7:
-      target_cells_.getNeighborhoodAtPoint7(x_trans_pt, neighborhood);
-      break;
-    case DIRECT1:
-      target_cells_.getNeighborhoodAtPoint1(x_trans_pt, neighborhood);
-      break;
-    }
-
-    for (typename std::vector<TargetGridLeafConstPtr>::iterator
-             neighborhood_it = neighborhood.begin();
-         neighborhood_it != neighborhood.end();
-         neighborhood_it++) {
-      cell = *neighborhood_it;
-
-      {
-        x_pt = input_->points[idx];
-        x = Eigen::Vector3d(x_pt.x, x_pt.y, x_pt.z);
-
-        x_trans = Eigen::Vector3d(x_trans_pt.x, x_trans_pt.y, x_trans_pt.z);
-
-        // Denorm point, x_k' in Equations 6.12 and 6.13 [Magnusson 2009]
-        x_trans -= cell->getMean();
-        // Uses precomputed covariance for speed.
-        c_inv = cell->getInverseCov();
-
-        // Compute derivative of transform function w.r.t. transform vector, J_E
-        // and H_E in Equations 6.18 and 6.20 [Magnusson 2009]
-        computePointDerivatives(x, point_gradient_, point_hessian_);
-        // Update hessian, lines 21 in Algorithm 2, according to
-        // Equations 6.10, 6.12 and 6.13, respectively [Magnusson 2009]
-        updateHessian(hessian, point_gradient_, point_hessian_, x_trans, c_inv);
-      }
-    }
-  }
-}
-
-//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-template <typename PointSource, typename PointTarget>
-void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
-    updateHessian(Eigen::Matrix<double, 6, 6>& hessian,
-                  const Eigen::Matrix<double, 3, 6>& point_gradient_,
-                  const Eigen::Matrix<double, 18, 6>& point_hessian_,
-                  const Eigen::Vector3d& x_trans,
-                  const Eigen::Matrix3d& c_inv) const {
-  Eigen::Vector3d cov_dxd_pi;
-  // e^(-d_2/2 * (x_k - mu_k)^T Sigma_k^-1 (x_k - mu_k)) Equation 6.9 [Magnusson
-  // 2009]
-  double e_x_cov_x =
-      gauss_d2_ * exp(-gauss_d2_ * x_trans.dot(c_inv * x_trans) / 2);
-
-  // Error checking for invalid values.
-  if (e_x_cov_x > 1 || e_x_cov_x < 0 || e_x_cov_x != e_x_cov_x)
-    return;
-
-  // Reusable portion of Equation 6.12 and 6.13 [Magnusson 2009]
-  e_x_cov_x *= gauss_d1_;
-
-  for (int i = 0; i < 6; i++) {
-    // Sigma_k^-1 d(T(x,p))/dpi, Reusable portion of Equation 6.12 and 6.13
-    // [Magnusson 2009]
-    cov_dxd_pi = c_inv * point_gradient_.col(i);
-
-    for (int j = 0; j < hessian.cols(); j++) {
-      // Update hessian, Equation 6.13 [Magnusson 2009]
-      hessian(i, j) += e_x_cov_x *
-          (-gauss_d2_ * x_trans.dot(cov_dxd_pi) *
-               x_trans.dot(c_inv * point_gradient_.col(j)) +
-           x_trans.dot(c_inv * point_hessian_.block<3, 1>(3 * i, j)) +
-           point_gradient_.col(j).dot(cov_dxd_pi));
-    }
-  }
+                   Eigen::Matrix<double, 6, 1>& p) {
+  // Same sparse single precision update as the score and gradient. Those are
+  // cheap next to the hessian and are recomputed along with it
+  Eigen::Matrix<double, 6, 1> score_gradient;
+  computeDerivatives(score_gradient, hessian, trans_cloud, p, true);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -882,6 +724,33 @@ double pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
   }
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+double pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
+    computeStepLengthGN(const Eigen::Matrix<double, 6, 1>& x,
+                        const Eigen::Matrix<double, 6, 1>& step_dir,
+                        double step_length,
+                        double& score,
+                        Eigen::Matrix<double, 6, 1>& score_gradient,
+                        Eigen::Matrix<double, 6, 6>& hessian,
+                        PointCloudSource& trans_cloud) {
+  // Fixed step, the damping replaces the line search
+  const double a_t = std::min(step_length, step_size_);
+  Eigen::Matrix<double, 6, 1> x_t = x + step_dir * a_t;
+
+  Eigen::Affine3f trans;
+  convertTransform(x_t, trans);
+  final_transformation_ = trans.matrix();
+
+  // New transformed point cloud
+  transformPointCloud(*input_, trans_cloud, final_transformation_);
+
+  // Single derivative evaluation per iteration, reused by the next step
+  score = computeDerivatives(score_gradient, hessian, trans_cloud, x_t, true);
+
+  return (a_t);
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 template <typename PointSource, typename PointTarget>
 double pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
@@ -1061,35 +930,76 @@ double pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
   return (a_t);
 }
 
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+const std::vector<typename pclomp::NormalDistributionsTransform<
+    PointSource,
+    PointTarget>::TargetGridLeafConstPtr>&
+pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
+    cachedNeighborhood(int idx,
+                       const PointSource& x_trans_pt,
+                       SearchScratch& scratch) {
+  // Radius search results depend on the exact position of the point
+  if (search_method == KDTREE || !neighborhood_cache_)
+    return (findNeighborhood(x_trans_pt, scratch));
+
+  const VoxelKey key =
+      target_cells_->getVoxelKey(x_trans_pt.x, x_trans_pt.y, x_trans_pt.z);
+  PointNeighborhood& cached = point_neighborhoods_[idx];
+  if (cached.generation != neighborhood_generation_ || !(cached.key == key)) {
+    // Copy into the capacity kept from previous alignments
+    cached.leaves = findNeighborhood(x_trans_pt, scratch);
+    cached.key = key;
+    cached.generation = neighborhood_generation_;
+  }
+  return (cached.leaves);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+const std::vector<typename pclomp::NormalDistributionsTransform<
+    PointSource,
+    PointTarget>::TargetGridLeafConstPtr>&
+pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
+    findNeighborhood(const PointSource& x_trans_pt,
+                     SearchScratch& scratch) const {
+  // Find nieghbors (Radius search has been experimentally faster than direct
+  // neighbor checking.
+  switch (search_method) {
+  case KDTREE:
+    target_cells_->radiusSearch(x_trans_pt,
+                                resolution_,
+                                scratch.neighborhood,
+                                scratch.distances,
+                                scratch.indices);
+    break;
+  case DIRECT26:
+    target_cells_->getNeighborhoodAtPoint(x_trans_pt, scratch.neighborhood);
+    break;
+  default:
+  case DIRECT7:
+    target_cells_->getNeighborhoodAtPoint7(x_trans_pt, scratch.neighborhood);
+    break;
+  case DIRECT1:
+    target_cells_->getNeighborhoodAtPoint1(x_trans_pt, scratch.neighborhood);
+    break;
+  }
+  return (scratch.neighborhood);
+}
+
 template <typename PointSource, typename PointTarget>
 double
 pclomp::NormalDistributionsTransform<PointSource, PointTarget>::calculateScore(
     const PointCloudSource& trans_cloud) const {
   double score = 0;
+  if (search_scratch_.empty())
+    search_scratch_.resize(1);
 
   for (int idx = 0; idx < trans_cloud.points.size(); idx++) {
     PointSource x_trans_pt = trans_cloud.points[idx];
 
-    // Find nieghbors (Radius search has been experimentally faster than direct
-    // neighbor checking.
-    std::vector<TargetGridLeafConstPtr> neighborhood;
-    std::vector<float> distances;
-    switch (search_method) {
-    case KDTREE:
-      target_cells_.radiusSearch(
-          x_trans_pt, resolution_, neighborhood, distances);
-      break;
-    case DIRECT26:
-      target_cells_.getNeighborhoodAtPoint(x_trans_pt, neighborhood);
-      break;
-    default:
-    case DIRECT7:
-      target_cells_.getNeighborhoodAtPoint7(x_trans_pt, neighborhood);
-      break;
-    case DIRECT1:
-      target_cells_.getNeighborhoodAtPoint1(x_trans_pt, neighborhood);
-      break;
-    }
+    const std::vector<TargetGridLeafConstPtr>& neighborhood =
+        findNeighborhood(x_trans_pt, search_scratch_[0]);
 
     for (typename std::vector<TargetGridLeafConstPtr>::iterator
              neighborhood_it = neighborhood.begin();
@@ -1118,4 +1028,177 @@ pclomp::NormalDistributionsTransform<PointSource, PointTarget>::calculateScore(
   return (score) / static_cast<double>(trans_cloud.size());
 }
 
+template <typename PointSource, typename PointTarget>
+bool pclomp::NormalDistributionsTransform<PointSource, PointTarget>::alignBatch(
+    const std::vector<PointCloudSourceConstPtr>& sources,
+    const RegistrationTransformations& guesses,
+    RegistrationBatchResults& results) {
+  results.clear();
+  const size_t num_items = BatchSize(sources.size(), guesses.size());
+  if (num_items == 0) {
+    PCL_ERROR("[pcl::%s::alignBatch] %lu sources do not match %lu initial "
+              "guesses!\n",
+              getClassName().c_str(),
+              sources.size(),
+              guesses.size());
+    return (false);
+  }
+  if (!target_ || target_->empty()) {
+    PCL_ERROR("[pcl::%s::alignBatch] No input target dataset was given!\n",
+              getClassName().c_str());
+    return (false);
+  }
+  for (const PointCloudSourceConstPtr& source : sources) {
+    if (!source || source->empty()) {
+      PCL_ERROR("[pcl::%s::alignBatch] Invalid or empty source given!\n",
+                getClassName().c_str());
+      return (false);
+    }
+  }
+
+  // The voxel grid was built by setInputTarget and is shared read only by
+  // the workers, as is the target tree of the fitness score
+  if (search_method == KDTREE)
+    target_cells_->updateCentroids();
+  if (target_cloud_updated_) {
+    tree_->setInputCloud(target_);
+    target_cloud_updated_ = false;
+  }
+  batch_engines_.resize(thread_pool_->numThreads());
+  for (BatchEngine& batch_engine : batch_engines_) {
+    if (!batch_engine.engine) {
+      batch_engine.engine.reset(new NormalDistributionsTransform(thread_pool_));
+    }
+    NormalDistributionsTransform& engine = *batch_engine.engine;
+    engine.setThreadPool(thread_pool_);
+    configureEngine(engine);
+    if (engine.cascade_levels_.size() != cascade_levels_.size() ||
+        !std::equal(cascade_levels_.begin(),
+                    cascade_levels_.end(),
+                    engine.cascade_levels_.begin(),
+                    [](const CascadeLevel& a, const CascadeLevel& b) {
+                      return a.factor == b.factor &&
+                             a.iterations == b.iterations;
+                    })) {
+      std::vector<int> factors, iterations;
+      for (const CascadeLevel& level : cascade_levels_) {
+        factors.push_back(level.factor);
+        iterations.push_back(level.iterations);
+      }
+      engine.setCascadeLevels(factors, iterations);
+    }
+    if (batch_target_updated_ || engine.target_ != target_) {
+      engine.pcl::Registration<PointSource, PointTarget>::setInputTarget(
+          target_);
+      engine.setSearchMethodTarget(tree_, true);
+      engine.target_cells_ = target_cells_;
+      engine.cascade_target_updated_ = true;
+    }
+  }
+  batch_target_updated_ = false;
+
+  // One item per chunk, the parallel loops of an item run inline on the
+  // thread of the item
+  results.resize(num_items);
+  thread_pool_->parallelFor(
+      static_cast<int>(num_items), 1, [&](int begin, int end, int thread_id) {
+        BatchEngine& batch_engine = batch_engines_[thread_id];
+        NormalDistributionsTransform& engine = *batch_engine.engine;
+        for (int i = begin; i < end; i++) {
+          const PointCloudSourceConstPtr& source =
+              sources.size() == 1 ? sources[0] : sources[i];
+          if (source != engine.input_)
+            engine.setInputSource(source);
+          engine.align(batch_engine.aligned, BatchGuess(guesses, i));
+          RegistrationBatchResult& result = results[i];
+          result.transformation = engine.final_transformation_;
+          result.fitness_score = engine.getFitnessScore();
+          result.converged = engine.converged_;
+          result.stats = RegistrationStats();
+          result.stats.iterations = engine.nr_iterations_;
+          result.stats.num_points = static_cast<int>(source->size());
+        }
+      });
+  return (true);
+}
+
+template <typename PointSource, typename PointTarget>
+bool pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
+    updateTarget(const PointCloudTarget& added,
+                 const PointCloudTarget& removed) {
+  if (!target_) {
+    PCL_ERROR("[pcl::%s::updateTarget] No input target dataset was given!\n",
+              getClassName().c_str());
+    return (false);
+  }
+
+  target_cells_->addPoints(added);
+  target_cells_->removePoints(removed);
+  target_cells_->updateDirtyLeaves();
+  // Only the kdtree search uses the centroids
+  if (search_method == KDTREE)
+    target_cells_->updateCentroids();
+  cascade_target_updated_ = true;
+  batch_target_updated_ = true;
+  return (true);
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+void pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
+    configureEngine(NormalDistributionsTransform& engine) const {
+  // Assigned directly, setResolution would rebuild the voxel grid
+  engine.resolution_ = resolution_;
+  engine.step_size_ = step_size_;
+  engine.outlier_ratio_ = outlier_ratio_;
+  engine.solver_ = solver_;
+  engine.gauss_newton_damping_ = gauss_newton_damping_;
+  engine.degeneracy_ratio_ = degeneracy_ratio_;
+  engine.search_method = search_method;
+  engine.neighborhood_cache_ = neighborhood_cache_;
+  engine.transformation_epsilon_ = transformation_epsilon_;
+  engine.max_iterations_ = max_iterations_;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+template <typename PointSource, typename PointTarget>
+Eigen::Matrix4f pclomp::NormalDistributionsTransform<PointSource, PointTarget>::
+    alignCascade(const Eigen::Matrix4f& guess) {
+  Eigen::Matrix4f transformation = guess;
+  for (CascadeLevel& level : cascade_levels_) {
+    if (!level.engine) {
+      level.engine.reset(new NormalDistributionsTransform(thread_pool_));
+    }
+    NormalDistributionsTransform& engine = *level.engine;
+    engine.setThreadPool(thread_pool_);
+    if (cascade_target_updated_) {
+      engine.target_cells_->buildFromFinerGrid(*target_cells_, level.factor);
+      // Only used by the checks of align, the grid is already built
+      engine.pcl::Registration<PointSource, PointTarget>::setInputTarget(
+          engine.target_cells_->getCentroids());
+    }
+    if (engine.target_cells_->getCentroids()->empty()) {
+      continue;
+    }
+
+    configureEngine(engine);
+    engine.resolution_ = resolution_ * level.factor;
+    engine.max_iterations_ = level.iterations;
+    engine.setInputSource(input_);
+
+    engine.align(level.aligned, transformation);
+    // Keep the previous estimate if the level failed. The level also stops
+    // as converged at its iteration limit, so it only counts as successful if
+    // it improved the score of its initial guess
+    const Eigen::Matrix4f& level_transformation =
+        engine.getFinalTransformation();
+    if (level_transformation.allFinite() &&
+        engine.trans_probability_ > engine.initial_trans_probability_) {
+      transformation = level_transformation;
+    }
+  }
+  cascade_target_updated_ = false;
+  return transformation;
+}
+
 #endif // PCL_REGISTRATION_NDT_IMPL_H_
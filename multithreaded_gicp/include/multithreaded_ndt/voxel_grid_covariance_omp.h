@@ -38,12 +38,13 @@
 #ifndef PCL_VOXEL_GRID_COVARIANCE_OMP_H_
 #define PCL_VOXEL_GRID_COVARIANCE_OMP_H_
 
-#include <map>
+#include <Eigen/Eigenvalues>
+#include <flat_voxel_hash.h>
 #include <pcl/filters/boost.h>
 #include <pcl/filters/voxel_grid.h>
 #include <pcl/kdtree/kdtree_flann.h>
 #include <pcl/point_types.h>
-#include <unordered_map>
+#include <registration_thread_pool.h>
 
 namespace pclomp {
 /** \brief A searchable voxel strucure containing the mean and covariance of the
@@ -99,7 +100,10 @@ public:
         cov_(Eigen::Matrix3d::Identity()),
         icov_(Eigen::Matrix3d::Zero()),
         evecs_(Eigen::Matrix3d::Identity()),
-        evals_(Eigen::Vector3d::Zero()) {}
+        evals_(Eigen::Vector3d::Zero()),
+        point_sum_(Eigen::Vector3d::Zero()),
+        point_sq_sum_(Eigen::Matrix3d::Identity()),
+        total_points_(0) {}
 
     /** \brief Get the voxel covariance.
      * \return covariance matrix
@@ -167,6 +171,15 @@ public:
 
     /** \brief Eigen values of voxel covariance matrix */
     Eigen::Vector3d evals_;
+
+    /** \brief Running sums of the points and of their outer products, kept
+     * across incremental updates. Start from the same values as \ref mean_
+     * and \ref cov_ so both paths give identical statistics. */
+    Eigen::Vector3d point_sum_;
+    Eigen::Matrix3d point_sq_sum_;
+
+    /** \brief Number of points in the running sums */
+    int total_points_;
   };
 
   /** \brief Pointer to VoxelGridCovariance leaf structure */
@@ -175,7 +188,8 @@ public:
   /** \brief Const pointer to VoxelGridCovariance leaf structure */
   typedef const Leaf* LeafConstPtr;
 
-  typedef std::map<size_t, Leaf> Map;
+  /** \brief Leaves stored contiguously, indexed through a voxel hash */
+  typedef std::vector<Leaf> Map;
 
 public:
   /** \brief Constructor.
@@ -188,7 +202,9 @@ public:
       leaves_(),
       voxel_centroids_(),
       voxel_centroids_leaf_indices_(),
-      kdtree_() {
+      kdtree_(),
+      thread_pool_(std::make_shared<RegistrationThreadPool>(1)),
+      centroids_stale_(false) {
     downsample_all_data_ = false;
     save_leaf_layout_ = false;
     leaf_size_.setZero();
@@ -197,6 +213,13 @@ public:
     filter_name_ = "VoxelGridCovariance";
   }
 
+  /** \brief Build the voxel structure on a thread pool provided by the
+   * caller. The result does not depend on the number of threads.
+   */
+  inline void setThreadPool(const RegistrationThreadPool::Ptr& thread_pool) {
+    thread_pool_ = thread_pool;
+  }
+
   /** \brief Set the minimum number of points required for a cell to be used
    * (must be 3 or greater for covariance calculation). \param[in]
    * min_points_per_voxel the minimum number of points for required for a voxel
@@ -270,17 +293,66 @@ public:
     }
   }
 
-  /** \brief Get the voxel containing point p.
-   * \param[in] index the index of the leaf structure node
+  /** \brief Add the points of cloud to the running sums of their voxels,
+   * creating the missing ones. The statistics used for matching are only
+   * refreshed by \ref updateDirtyLeaves.
+   * \param[in] cloud points to insert, with the leaf size of the last filter
+   */
+  inline void addPoints(const PointCloud& cloud) {
+    updatePoints(cloud, 1);
+  }
+
+  /** \brief Remove the points of cloud from the running sums of their voxels.
+   * Points are expected to have been added before, points of empty voxels are
+   * ignored. A voxel left empty is dropped and its leaf is reused by the next
+   * new voxel, so a sliding window keeps a bounded number of leaves. The
+   * statistics used for matching are only refreshed by \ref
+   * updateDirtyLeaves.
+   * \param[in] cloud points to remove
+   */
+  inline void removePoints(const PointCloud& cloud) {
+    updatePoints(cloud, -1);
+  }
+
+  /** \brief Recompute the statistics of the voxels touched by \ref addPoints
+   * and \ref removePoints since the last update. The centroid cloud and its
+   * kdtree are only rebuilt by \ref updateCentroids, the leaf layout is not
+   * updated.
+   */
+  void updateDirtyLeaves();
+
+  /** \brief Rebuild the centroid cloud and, if searchable, its kdtree if the
+   * leaves changed since they were built. Only the xyz fields of the
+   * centroids are maintained. Needed by radiusSearch and nearestKSearch, the
+   * DIRECT neighborhoods only use the leaves.
+   */
+  void updateCentroids();
+
+  /** \brief Build this grid from the running sums of a finer grid instead of
+   * the points: each voxel merges the factor^3 voxels of finer it covers, so
+   * its statistics are those of the points of these voxels. The centroid cloud
+   * and kdtree are built as by filter(finer's searchable flag).
+   * \param[in] finer grid built by filter or updated incrementally
+   * \param[in] factor ratio of the leaf sizes, at least 1
+   */
+  void buildFromFinerGrid(const VoxelGridCovariance& finer, int factor);
+
+  /** \brief Integer coordinates of the voxel containing (x, y, z). The
+   * DIRECT neighborhoods of two points with the same key are the same. */
+  inline VoxelKey getVoxelKey(float x, float y, float z) const {
+    return VoxelKey(static_cast<int>(floor(x * inverse_leaf_size_[0])),
+                    static_cast<int>(floor(y * inverse_leaf_size_[1])),
+                    static_cast<int>(floor(z * inverse_leaf_size_[2])));
+  }
+
+  /** \brief Get a leaf by its position in the leaves.
+   * \param[in] index the index of the leaf structure node in getLeaves()
    * \return const pointer to leaf structure
    */
   inline LeafConstPtr getLeaf(int index) {
-    auto leaf_iter = leaves_.find(index);
-    if (leaf_iter != leaves_.end()) {
-      LeafConstPtr ret(&(leaf_iter->second));
-      return ret;
-    } else
+    if (index < 0 || index >= static_cast<int>(leaves_.size()))
       return NULL;
+    return &leaves_[index];
   }
 
   /** \brief Get the voxel containing point p.
@@ -288,22 +360,7 @@ public:
    * \return const pointer to leaf structure
    */
   inline LeafConstPtr getLeaf(PointT& p) {
-    // Generate index associated with p
-    int ijk0 = static_cast<int>(floor(p.x * inverse_leaf_size_[0]) - min_b_[0]);
-    int ijk1 = static_cast<int>(floor(p.y * inverse_leaf_size_[1]) - min_b_[1]);
-    int ijk2 = static_cast<int>(floor(p.z * inverse_leaf_size_[2]) - min_b_[2]);
-
-    // Compute the centroid leaf index
-    int idx = ijk0 * divb_mul_[0] + ijk1 * divb_mul_[1] + ijk2 * divb_mul_[2];
-
-    // Find leaf associated with index
-    auto leaf_iter = leaves_.find(idx);
-    if (leaf_iter != leaves_.end()) {
-      // If such a leaf exists return the pointer to the leaf structure
-      LeafConstPtr ret(&(leaf_iter->second));
-      return ret;
-    } else
-      return NULL;
+    return findLeaf(getVoxelKey(p.x, p.y, p.z));
   }
 
   /** \brief Get the voxel containing point p.
@@ -311,25 +368,7 @@ public:
    * \return const pointer to leaf structure
    */
   inline LeafConstPtr getLeaf(Eigen::Vector3f& p) {
-    // Generate index associated with p
-    int ijk0 =
-        static_cast<int>(floor(p[0] * inverse_leaf_size_[0]) - min_b_[0]);
-    int ijk1 =
-        static_cast<int>(floor(p[1] * inverse_leaf_size_[1]) - min_b_[1]);
-    int ijk2 =
-        static_cast<int>(floor(p[2] * inverse_leaf_size_[2]) - min_b_[2]);
-
-    // Compute the centroid leaf index
-    int idx = ijk0 * divb_mul_[0] + ijk1 * divb_mul_[1] + ijk2 * divb_mul_[2];
-
-    // Find leaf associated with index
-    auto leaf_iter = leaves_.find(idx);
-    if (leaf_iter != leaves_.end()) {
-      // If such a leaf exists return the pointer to the leaf structure
-      LeafConstPtr ret(&(leaf_iter->second));
-      return ret;
-    } else
-      return NULL;
+    return findLeaf(getVoxelKey(p[0], p[1], p[2]));
   }
 
   /** \brief Get the voxels surrounding point p, not including the voxel
@@ -348,8 +387,8 @@ public:
   int getNeighborhoodAtPoint1(const PointT& reference_point,
                               std::vector<LeafConstPtr>& neighbors) const;
 
-  /** \brief Get the leaf structure map
-   * \return a map contataining all leaves
+  /** \brief Get the leaf structures
+   * \return a vector containing all leaves, in no particular order
    */
   inline const Map& getLeaves() {
     return leaves_;
@@ -360,6 +399,7 @@ public:
    * \return a map contataining all leaves
    */
   inline PointCloudPtr getCentroids() {
+    updateCentroids();
     return voxel_centroids_;
   }
 
@@ -435,6 +475,22 @@ public:
                    std::vector<LeafConstPtr>& k_leaves,
                    std::vector<float>& k_sqr_distances,
                    unsigned int max_nn = 0) const {
+    std::vector<int> k_indices;
+    return (radiusSearch(
+        point, radius, k_leaves, k_sqr_distances, k_indices, max_nn));
+  }
+
+  /** \brief Search for all the nearest occupied voxels of the query point in a
+   * given radius, with a caller provided buffer for the indices of the
+   * centroids so that repeated searches do not allocate.
+   * \param[out] k_indices indices of the neighboring centroids
+   */
+  int radiusSearch(const PointT& point,
+                   double radius,
+                   std::vector<LeafConstPtr>& k_leaves,
+                   std::vector<float>& k_sqr_distances,
+                   std::vector<int>& k_indices,
+                   unsigned int max_nn = 0) const {
     k_leaves.clear();
 
     // Check if kdtree has been built
@@ -444,7 +500,6 @@ public:
     }
 
     // Find neighbors within radius in the occupied voxel centroid cloud
-    std::vector<int> k_indices;
     int k =
         kdtree_.radiusSearch(point, radius, k_indices, k_sqr_distances, max_nn);
 
@@ -453,14 +508,7 @@ public:
     for (std::vector<int>::iterator iter = k_indices.begin();
          iter != k_indices.end();
          iter++) {
-      auto leaf = leaves_.find(voxel_centroids_leaf_indices_[*iter]);
-      if (leaf == leaves_.end()) {
-        std::cerr
-            << "error : could not find the leaf corresponding to the voxel"
-            << std::endl;
-        std::cin.ignore(1);
-      }
-      k_leaves.push_back(&(leaf->second));
+      k_leaves.push_back(&leaves_[voxel_centroids_leaf_indices_[*iter]]);
     }
     return k;
   }
@@ -494,6 +542,29 @@ protected:
    */
   void applyFilter(PointCloud& output);
 
+  /** \brief Finalize the statistics of a leaf from its accumulated sums.
+   * \return whether the leaf has sufficient points to be output
+   */
+  bool computeLeafStatistics(
+      Leaf& leaf,
+      Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d>& eigensolver) const;
+
+  /** \brief Add (sign 1) or remove (sign -1) the points of cloud. */
+  void updatePoints(const PointCloud& cloud, int sign);
+
+  /** \brief Leaf of voxel key, NULL if the voxel is empty. */
+  inline LeafConstPtr findLeaf(const VoxelKey& key) const {
+    const int* index = leaf_indices_.find(key);
+    return index ? &leaves_[*index] : NULL;
+  }
+
+  /** \brief Get the voxels at the offsets from the voxel containing
+   * reference_point that contain a sufficient number of points. */
+  int getNeighborhood(const VoxelKey* offsets,
+                      int num_offsets,
+                      const PointT& reference_point,
+                      std::vector<LeafConstPtr>& neighbors) const;
+
   /** \brief Flag to determine if voxel structure is searchable. */
   bool searchable_;
 
@@ -509,17 +580,49 @@ protected:
    * less than a sufficient number of points). */
   Map leaves_;
 
+  /** \brief Voxel coordinates of each leaf. */
+  std::vector<VoxelKey> leaf_keys_;
+
+  /** \brief Index in \ref leaves_ of the leaf of each occupied voxel. An open
+   * addressing hash keyed by the voxel coordinates, so a neighborhood lookup
+   * touches one or two cache lines per voxel. */
+  FlatVoxelHash<int> leaf_indices_;
+
   /** \brief Point cloud containing centroids of voxels containing atleast
    * minimum number of points. */
   PointCloudPtr voxel_centroids_;
 
-  /** \brief Indices of leaf structurs associated with each point in \ref
-   * voxel_centroids_ (used for searching). */
+  /** \brief Indices in \ref leaves_ of the leaf structurs associated with
+   * each point in \ref voxel_centroids_ (used for searching). */
   std::vector<int> voxel_centroids_leaf_indices_;
 
   /** \brief KdTree generated using \ref voxel_centroids_ (used for searching).
    */
   pcl::KdTreeFLANN<PointT> kdtree_;
+
+  /** \brief Workers building the voxel structure. */
+  RegistrationThreadPool::Ptr thread_pool_;
+
+  /** \brief Buffers of applyFilter, reused across calls: voxel and leaf of
+   * each input point (-1 if skipped), points of leaf li in
+   * leaf_points_[leaf_point_begin_[li], leaf_point_begin_[li + 1]) and
+   * whether each leaf has sufficient points to be output. */
+  std::vector<VoxelKey> point_keys_;
+  std::vector<int> point_leaves_;
+  std::vector<int> leaf_point_begin_;
+  std::vector<int> leaf_points_;
+  std::vector<char> leaf_in_output_;
+
+  /** \brief Leaves changed since the last \ref updateDirtyLeaves, and a flag
+   * per leaf to list each of them once. */
+  std::vector<int> dirty_leaves_;
+  std::vector<char> leaf_dirty_;
+
+  /** \brief Leaves of voxels emptied by \ref removePoints, reused first. */
+  std::vector<int> free_leaves_;
+
+  /** \brief True if the leaves changed since the centroid cloud was built. */
+  bool centroids_stale_;
 };
 } // namespace pclomp
 
@@ -71,12 +71,13 @@ pclomp::VoxelGridCovariance<PointT>::applyFilter (PointCloud &output)
   else
 	  pcl::getMinMax3D<PointT> (*input_, min_p, max_p);
 
-  // Check that the leaf size is not too small, given the size of the data
+  // Check that the leaf size is not too small, given the size of the data. Leaves
+  // are hashed by voxel coordinates, only the dense leaf layout is indexed linearly
   int64_t dx = static_cast<int64_t>((max_p[0] - min_p[0]) * inverse_leaf_size_[0])+1;
   int64_t dy = static_cast<int64_t>((max_p[1] - min_p[1]) * inverse_leaf_size_[1])+1;
   int64_t dz = static_cast<int64_t>((max_p[2] - min_p[2]) * inverse_leaf_size_[2])+1;
 
-  if((dx*dy*dz) > std::numeric_limits<int32_t>::max())
+  if(save_leaf_layout_ && (dx*dy*dz) > std::numeric_limits<int32_t>::max())
   {
     PCL_WARN("[pcl::%s::applyFilter] Leaf size is too small for the input dataset. Integer indices would overflow.", getClassName().c_str());
     output.clear();
@@ -97,7 +98,11 @@ pclomp::VoxelGridCovariance<PointT>::applyFilter (PointCloud &output)
 
   // Clear the leaves
   leaves_.clear ();
-//  leaves_.reserve(8192);
+  leaf_keys_.clear ();
+  leaf_indices_.clear ();
+  free_leaves_.clear ();
+  // The callers of applyFilter build the centroids from its output
+  centroids_stale_ = false;
 
   // Set up the division multiplier
   divb_mul_ = Eigen::Vector4i (1, div_b_[0], div_b_[0] * div_b_[1], 0);
@@ -120,6 +125,7 @@ pclomp::VoxelGridCovariance<PointT>::applyFilter (PointCloud &output)
   }
 
   // If we don't want to process the entire cloud, but rather filter points far away from the viewpoint first...
+  int distance_offset = -1;
   if (!filter_field_name_.empty ())
   {
     // Get the distance field index
@@ -127,143 +133,140 @@ pclomp::VoxelGridCovariance<PointT>::applyFilter (PointCloud &output)
     int distance_idx = pcl::getFieldIndex (*input_, filter_field_name_, fields);
     if (distance_idx == -1)
       PCL_WARN ("[pcl::%s::applyFilter] Invalid filter field name. Index is %d.\n", getClassName ().c_str (), distance_idx);
+    else
+      distance_offset = fields[distance_idx].offset;
+  }
 
-    // First pass: go over all points and insert them into the right leaf
-    for (size_t cp = 0; cp < input_->points.size (); ++cp)
+  // First pass, in parallel: voxel of each point, skipping invalid and filtered out points
+  const int num_points = static_cast<int> (input_->points.size ());
+  point_keys_.resize (num_points);
+  point_leaves_.resize (num_points);
+  thread_pool_->parallelFor (num_points, 1024, [&] (int begin, int end, int)
+  {
+    for (int cp = begin; cp < end; ++cp)
     {
+      const PointT& point = input_->points[cp];
+      point_leaves_[cp] = -1;
       if (!input_->is_dense)
         // Check if the point is invalid
-        if (!pcl_isfinite (input_->points[cp].x) ||
-            !pcl_isfinite (input_->points[cp].y) ||
-            !pcl_isfinite (input_->points[cp].z))
+        if (!pcl_isfinite (point.x) || !pcl_isfinite (point.y) || !pcl_isfinite (point.z))
           continue;
 
-      // Get the distance value
-      const uint8_t* pt_data = reinterpret_cast<const uint8_t*> (&input_->points[cp]);
-      float distance_value = 0;
-      memcpy (&distance_value, pt_data + fields[distance_idx].offset, sizeof (float));
-
-      if (filter_limit_negative_)
-      {
-        // Use a threshold for cutting out points which inside the interval
-        if ((distance_value < filter_limit_max_) && (distance_value > filter_limit_min_))
-          continue;
-      }
-      else
+      if (distance_offset >= 0)
       {
-        // Use a threshold for cutting out points which are too close/far away
-        if ((distance_value > filter_limit_max_) || (distance_value < filter_limit_min_))
-          continue;
-      }
-
-      int ijk0 = static_cast<int> (floor (input_->points[cp].x * inverse_leaf_size_[0]) - static_cast<float> (min_b_[0]));
-      int ijk1 = static_cast<int> (floor (input_->points[cp].y * inverse_leaf_size_[1]) - static_cast<float> (min_b_[1]));
-      int ijk2 = static_cast<int> (floor (input_->points[cp].z * inverse_leaf_size_[2]) - static_cast<float> (min_b_[2]));
-
-      // Compute the centroid leaf index
-      int idx = ijk0 * divb_mul_[0] + ijk1 * divb_mul_[1] + ijk2 * divb_mul_[2];
+        // Get the distance value
+        const uint8_t* pt_data = reinterpret_cast<const uint8_t*> (&point);
+        float distance_value = 0;
+        memcpy (&distance_value, pt_data + distance_offset, sizeof (float));
 
-      Leaf& leaf = leaves_[idx];
-      if (leaf.nr_points == 0)
-      {
-        leaf.centroid.resize (centroid_size);
-        leaf.centroid.setZero ();
-      }
-
-      Eigen::Vector3d pt3d (input_->points[cp].x, input_->points[cp].y, input_->points[cp].z);
-      // Accumulate point sum for centroid calculation
-      leaf.mean_ += pt3d;
-      // Accumulate x*xT for single pass covariance calculation
-      leaf.cov_ += pt3d * pt3d.transpose ();
-
-      // Do we need to process all the fields?
-      if (!downsample_all_data_)
-      {
-        Eigen::Vector4f pt (input_->points[cp].x, input_->points[cp].y, input_->points[cp].z, 0);
-        leaf.centroid.template head<4> () += pt;
-      }
-      else
-      {
-        // Copy all the fields
-        Eigen::VectorXf centroid = Eigen::VectorXf::Zero (centroid_size);
-        // ---[ RGB special case
-        if (rgba_index >= 0)
+        if (filter_limit_negative_)
+        {
+          // Use a threshold for cutting out points which inside the interval
+          if ((distance_value < filter_limit_max_) && (distance_value > filter_limit_min_))
+            continue;
+        }
+        else
         {
-          // fill r/g/b data
-          int rgb;
-          memcpy (&rgb, reinterpret_cast<const char*> (&input_->points[cp]) + rgba_index, sizeof (int));
-          centroid[centroid_size - 3] = static_cast<float> ((rgb >> 16) & 0x0000ff);
-          centroid[centroid_size - 2] = static_cast<float> ((rgb >> 8) & 0x0000ff);
-          centroid[centroid_size - 1] = static_cast<float> ((rgb) & 0x0000ff);
+          // Use a threshold for cutting out points which are too close/far away
+          if ((distance_value > filter_limit_max_) || (distance_value < filter_limit_min_))
+            continue;
         }
-        pcl::for_each_type<FieldList> (pcl::NdCopyPointEigenFunctor<PointT> (input_->points[cp], centroid));
-        leaf.centroid += centroid;
       }
-      ++leaf.nr_points;
+
+      point_keys_[cp] = getVoxelKey (point.x, point.y, point.z);
+      point_leaves_[cp] = 0;
     }
-  }
-  // No distance filtering, process all data
-  else
+  });
+
+  // Create the leaves in order of their first point and bucket the points by leaf (counting sort), so
+  // that each leaf accumulates its points in index order whatever the number of threads
+  for (int cp = 0; cp < num_points; ++cp)
   {
-    // First pass: go over all points and insert them into the right leaf
-    for (size_t cp = 0; cp < input_->points.size (); ++cp)
+    if (point_leaves_[cp] < 0)
+      continue;
+    std::pair<int*, bool> leaf_index = leaf_indices_.insert (point_keys_[cp], static_cast<int> (leaves_.size ()));
+    if (leaf_index.second)
     {
-      if (!input_->is_dense)
-        // Check if the point is invalid
-        if (!pcl_isfinite (input_->points[cp].x) ||
-            !pcl_isfinite (input_->points[cp].y) ||
-            !pcl_isfinite (input_->points[cp].z))
-          continue;
-
-      int ijk0 = static_cast<int> (floor (input_->points[cp].x * inverse_leaf_size_[0]) - static_cast<float> (min_b_[0]));
-      int ijk1 = static_cast<int> (floor (input_->points[cp].y * inverse_leaf_size_[1]) - static_cast<float> (min_b_[1]));
-      int ijk2 = static_cast<int> (floor (input_->points[cp].z * inverse_leaf_size_[2]) - static_cast<float> (min_b_[2]));
-
-      // Compute the centroid leaf index
-      int idx = ijk0 * divb_mul_[0] + ijk1 * divb_mul_[1] + ijk2 * divb_mul_[2];
+      leaves_.push_back (Leaf ());
+      leaf_keys_.push_back (point_keys_[cp]);
+    }
+    point_leaves_[cp] = *leaf_index.first;
+  }
+  const int num_leaves = static_cast<int> (leaves_.size ());
+  leaf_point_begin_.assign (num_leaves + 1, 0);
+  for (int cp = 0; cp < num_points; ++cp)
+    if (point_leaves_[cp] >= 0)
+      ++leaf_point_begin_[point_leaves_[cp] + 1];
+  for (int li = 0; li < num_leaves; ++li)
+    leaf_point_begin_[li + 1] += leaf_point_begin_[li];
+  leaf_points_.resize (leaf_point_begin_[num_leaves]);
+  {
+    std::vector<int> leaf_fill (leaf_point_begin_.begin (), leaf_point_begin_.end () - 1);
+    for (int cp = 0; cp < num_points; ++cp)
+      if (point_leaves_[cp] >= 0)
+        leaf_points_[leaf_fill[point_leaves_[cp]]++] = cp;
+  }
 
-      //int idx = (((input_->points[cp].getArray4fmap () * inverse_leaf_size_).template cast<int> ()).matrix () - min_b_).dot (divb_mul_);
-      Leaf& leaf = leaves_[idx];
-      if (leaf.nr_points == 0)
-      {
-        leaf.centroid.resize (centroid_size);
-        leaf.centroid.setZero ();
-      }
+  // Second pass, in parallel: go over all leaves and compute centroids and covariance matrices
+  leaf_in_output_.assign (num_leaves, 0);
+  leaf_dirty_.assign (num_leaves, 0);
+  dirty_leaves_.clear ();
+  thread_pool_->parallelFor (num_leaves, 64, [&] (int begin, int end, int)
+  {
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigensolver;
+    Eigen::VectorXf centroid (centroid_size);
 
-      Eigen::Vector3d pt3d (input_->points[cp].x, input_->points[cp].y, input_->points[cp].z);
-      // Accumulate point sum for centroid calculation
-      leaf.mean_ += pt3d;
-      // Accumulate x*xT for single pass covariance calculation
-      leaf.cov_ += pt3d * pt3d.transpose ();
+    for (int li = begin; li < end; ++li)
+    {
+      Leaf& leaf = leaves_[li];
+      leaf.centroid.resize (centroid_size);
+      leaf.centroid.setZero ();
 
-      // Do we need to process all the fields?
-      if (!downsample_all_data_)
+      for (int j = leaf_point_begin_[li]; j < leaf_point_begin_[li + 1]; ++j)
       {
-        Eigen::Vector4f pt (input_->points[cp].x, input_->points[cp].y, input_->points[cp].z, 0);
-        leaf.centroid.template head<4> () += pt;
-      }
-      else
-      {
-        // Copy all the fields
-        Eigen::VectorXf centroid = Eigen::VectorXf::Zero (centroid_size);
-        // ---[ RGB special case
-        if (rgba_index >= 0)
+        const PointT& point = input_->points[leaf_points_[j]];
+        Eigen::Vector3d pt3d (point.x, point.y, point.z);
+        // Accumulate point sum for centroid calculation
+        leaf.mean_ += pt3d;
+        // Accumulate x*xT for single pass covariance calculation
+        leaf.cov_ += pt3d * pt3d.transpose ();
+
+        // Do we need to process all the fields?
+        if (!downsample_all_data_)
+        {
+          Eigen::Vector4f pt (point.x, point.y, point.z, 0);
+          leaf.centroid.template head<4> () += pt;
+        }
+        else
         {
-          // Fill r/g/b data, assuming that the order is BGRA
-          int rgb;
-          memcpy (&rgb, reinterpret_cast<const char*> (&input_->points[cp]) + rgba_index, sizeof (int));
-          centroid[centroid_size - 3] = static_cast<float> ((rgb >> 16) & 0x0000ff);
-          centroid[centroid_size - 2] = static_cast<float> ((rgb >> 8) & 0x0000ff);
-          centroid[centroid_size - 1] = static_cast<float> ((rgb) & 0x0000ff);
+          // Copy all the fields
+          centroid.setZero ();
+          // ---[ RGB special case
+          if (rgba_index >= 0)
+          {
+            // Fill r/g/b data, assuming that the order is BGRA
+            int rgb;
+            memcpy (&rgb, reinterpret_cast<const char*> (&point) + rgba_index, sizeof (int));
+            centroid[centroid_size - 3] = static_cast<float> ((rgb >> 16) & 0x0000ff);
+            centroid[centroid_size - 2] = static_cast<float> ((rgb >> 8) & 0x0000ff);
+            centroid[centroid_size - 1] = static_cast<float> ((rgb) & 0x0000ff);
+          }
+          pcl::for_each_type<FieldList> (pcl::NdCopyPointEigenFunctor<PointT> (point, centroid));
+          leaf.centroid += centroid;
         }
-        pcl::for_each_type<FieldList> (pcl::NdCopyPointEigenFunctor<PointT> (input_->points[cp], centroid));
-        leaf.centroid += centroid;
+        ++leaf.nr_points;
       }
-      ++leaf.nr_points;
+
+      // Keep the running sums for incremental updates
+      leaf.point_sum_ = leaf.mean_;
+      leaf.point_sq_sum_ = leaf.cov_;
+      leaf.total_points_ = leaf.nr_points;
+
+      leaf_in_output_[li] = computeLeafStatistics (leaf, eigensolver);
     }
-  }
+  });
 
-  // Second pass: go over all leaves and compute centroids and covariance matrices
+  // Third pass: output the centroids of the leaves with sufficient points, in leaf order
   output.points.reserve (leaves_.size ());
   if (searchable_)
     voxel_centroids_leaf_indices_.reserve (leaves_.size ());
@@ -271,133 +274,290 @@ pclomp::VoxelGridCovariance<PointT>::applyFilter (PointCloud &output)
   if (save_leaf_layout_)
     leaf_layout_.resize (div_b_[0] * div_b_[1] * div_b_[2], -1);
 
-  // Eigen values and vectors calculated to prevent near singluar matrices
-  Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigensolver;
-  Eigen::Matrix3d eigen_val;
-  Eigen::Vector3d pt_sum;
+  for (int li = 0; li < num_leaves; ++li)
+  {
+    if (!leaf_in_output_[li])
+      continue;
+    const Leaf& leaf = leaves_[li];
 
-  // Eigen values less than a threshold of max eigen value are inflated to a set fraction of the max eigen value.
-  double min_covar_eigvalue;
+    if (save_leaf_layout_)
+    {
+      const VoxelKey& key = leaf_keys_[li];
+      leaf_layout_[(Eigen::Vector4i (key.x, key.y, key.z, 0) - min_b_).dot (divb_mul_)] = cp++;
+    }
 
-  for (auto it = leaves_.begin (); it != leaves_.end (); ++it)
-  {
+    output.push_back (PointT ());
+
+    // Do we need to process all the fields?
+    if (!downsample_all_data_)
+    {
+      output.points.back ().x = leaf.centroid[0];
+      output.points.back ().y = leaf.centroid[1];
+      output.points.back ().z = leaf.centroid[2];
+    }
+    else
+    {
+      pcl::for_each_type<FieldList> (pcl::NdCopyEigenPointFunctor<PointT> (leaf.centroid, output.back ()));
+      // ---[ RGB special case
+      if (rgba_index >= 0)
+      {
+        // pack r/g/b into rgb
+        float r = leaf.centroid[centroid_size - 3], g = leaf.centroid[centroid_size - 2], b = leaf.centroid[centroid_size - 1];
+        int rgb = (static_cast<int> (r)) << 16 | (static_cast<int> (g)) << 8 | (static_cast<int> (b));
+        memcpy (reinterpret_cast<char*> (&output.points.back ()) + rgba_index, &rgb, sizeof (float));
+      }
+    }
 
-    // Normalize the centroid
-    Leaf& leaf = it->second;
+    // Stores the voxel indice for fast access searching
+    if (searchable_)
+      voxel_centroids_leaf_indices_.push_back (li);
+  }
 
-    // Normalize the centroid
-    leaf.centroid /= static_cast<float> (leaf.nr_points);
-    // Point sum used for single pass covariance calculation
-    pt_sum = leaf.mean_;
-    // Normalize mean
-    leaf.mean_ /= leaf.nr_points;
+  output.width = static_cast<uint32_t> (output.points.size ());
+}
 
-    // If the voxel contains sufficient points, its covariance is calculated and is added to the voxel centroids and output clouds.
-    // Points with less than the minimum points will have a can not be accuratly approximated using a normal distribution.
-    if (leaf.nr_points >= min_points_per_voxel_)
+//////////////////////////////////////////////////////////////////////////////////////////
+template<typename PointT> void
+pclomp::VoxelGridCovariance<PointT>::buildFromFinerGrid (const VoxelGridCovariance& finer, int factor)
+{
+  factor = std::max (1, factor);
+  setLeafSize (finer.leaf_size_[0] * factor, finer.leaf_size_[1] * factor, finer.leaf_size_[2] * factor);
+  searchable_ = finer.searchable_;
+  min_points_per_voxel_ = finer.min_points_per_voxel_;
+  min_covar_eigvalue_mult_ = finer.min_covar_eigvalue_mult_;
+
+  leaves_.clear ();
+  leaf_keys_.clear ();
+  leaf_indices_.clear ();
+  leaf_indices_.reserve (finer.leaves_.size ());
+  free_leaves_.clear ();
+  leaf_in_output_.clear ();
+  leaf_dirty_.clear ();
+  dirty_leaves_.clear ();
+
+  // Sums are merged in the order of the fine leaves, so the result is deterministic
+  for (size_t fine_li = 0; fine_li < finer.leaves_.size (); ++fine_li)
+  {
+    const Leaf& fine_leaf = finer.leaves_[fine_li];
+    if (fine_leaf.total_points_ <= 0)
+      continue;
+
+    const VoxelKey key = finer.leaf_keys_[fine_li].coarsen (factor);
+    std::pair<int*, bool> leaf_index = leaf_indices_.insert (key, static_cast<int> (leaves_.size ()));
+    if (leaf_index.second)
     {
-      if (save_leaf_layout_)
-        leaf_layout_[it->first] = cp++;
+      leaves_.push_back (Leaf ());
+      leaf_keys_.push_back (key);
+      leaf_in_output_.push_back (0);
+      leaf_dirty_.push_back (1);
+      dirty_leaves_.push_back (*leaf_index.first);
+    }
 
-      output.push_back (PointT ());
+    // Both sums of squares start from the identity, add it only once
+    Leaf& leaf = leaves_[*leaf_index.first];
+    leaf.point_sum_ += fine_leaf.point_sum_;
+    leaf.point_sq_sum_ += fine_leaf.point_sq_sum_ - Eigen::Matrix3d::Identity ();
+    leaf.total_points_ += fine_leaf.total_points_;
+  }
 
-      // Do we need to process all the fields?
-      if (!downsample_all_data_)
-      {
-        output.points.back ().x = leaf.centroid[0];
-        output.points.back ().y = leaf.centroid[1];
-        output.points.back ().z = leaf.centroid[2];
-      }
-      else
-      {
-        pcl::for_each_type<FieldList> (pcl::NdCopyEigenPointFunctor<PointT> (leaf.centroid, output.back ()));
-        // ---[ RGB special case
-        if (rgba_index >= 0)
-        {
-          // pack r/g/b into rgb
-          float r = leaf.centroid[centroid_size - 3], g = leaf.centroid[centroid_size - 2], b = leaf.centroid[centroid_size - 1];
-          int rgb = (static_cast<int> (r)) << 16 | (static_cast<int> (g)) << 8 | (static_cast<int> (b));
-          memcpy (reinterpret_cast<char*> (&output.points.back ()) + rgba_index, &rgb, sizeof (float));
-        }
-      }
+  centroids_stale_ = true;
+  updateDirtyLeaves ();
+  updateCentroids ();
+}
 
-      // Stores the voxel indice for fast access searching
-      if (searchable_)
-        voxel_centroids_leaf_indices_.push_back (static_cast<int> (it->first));
+//////////////////////////////////////////////////////////////////////////////////////////
+template<typename PointT> bool
+pclomp::VoxelGridCovariance<PointT>::computeLeafStatistics (Leaf& leaf, Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d>& eigensolver) const
+{
+  if (leaf.nr_points <= 0)
+    return (false);
+
+  // Normalize the centroid
+  leaf.centroid /= static_cast<float> (leaf.nr_points);
+  // Point sum used for single pass covariance calculation
+  const Eigen::Vector3d pt_sum = leaf.mean_;
+  // Normalize mean
+  leaf.mean_ /= leaf.nr_points;
+
+  // If the voxel contains sufficient points, its covariance is calculated and is added to the voxel centroids and output clouds.
+  // Points with less than the minimum points will have a can not be accuratly approximated using a normal distribution.
+  if (leaf.nr_points < min_points_per_voxel_)
+    return (false);
+
+  // Single pass covariance calculation
+  leaf.cov_ = (leaf.cov_ - 2 * (pt_sum * leaf.mean_.transpose ())) / leaf.nr_points + leaf.mean_ * leaf.mean_.transpose ();
+  leaf.cov_ *= (leaf.nr_points - 1.0) / leaf.nr_points;
+
+  //Normalize Eigen Val such that max no more than 100x min.
+  eigensolver.compute (leaf.cov_);
+  Eigen::Matrix3d eigen_val = eigensolver.eigenvalues ().asDiagonal ();
+  leaf.evecs_ = eigensolver.eigenvectors ();
+
+  if (eigen_val (0, 0) < 0 || eigen_val (1, 1) < 0 || eigen_val (2, 2) <= 0)
+  {
+    leaf.nr_points = -1;
+    return (true);
+  }
 
-      // Single pass covariance calculation
-      leaf.cov_ = (leaf.cov_ - 2 * (pt_sum * leaf.mean_.transpose ())) / leaf.nr_points + leaf.mean_ * leaf.mean_.transpose ();
-      leaf.cov_ *= (leaf.nr_points - 1.0) / leaf.nr_points;
+  // Avoids matrices near singularities (eq 6.11)[Magnusson 2009]
+  // Eigen values less than a threshold of max eigen value are inflated to a set fraction of the max eigen value.
+  const double min_covar_eigvalue = min_covar_eigvalue_mult_ * eigen_val (2, 2);
+  if (eigen_val (0, 0) < min_covar_eigvalue)
+  {
+    eigen_val (0, 0) = min_covar_eigvalue;
 
-      //Normalize Eigen Val such that max no more than 100x min.
-      eigensolver.compute (leaf.cov_);
-      eigen_val = eigensolver.eigenvalues ().asDiagonal ();
-      leaf.evecs_ = eigensolver.eigenvectors ();
+    if (eigen_val (1, 1) < min_covar_eigvalue)
+    {
+      eigen_val (1, 1) = min_covar_eigvalue;
+    }
 
-      if (eigen_val (0, 0) < 0 || eigen_val (1, 1) < 0 || eigen_val (2, 2) <= 0)
-      {
-        leaf.nr_points = -1;
-        continue;
-      }
+    leaf.cov_ = leaf.evecs_ * eigen_val * leaf.evecs_.inverse ();
+  }
+  leaf.evals_ = eigen_val.diagonal ();
 
-      // Avoids matrices near singularities (eq 6.11)[Magnusson 2009]
+  leaf.icov_ = leaf.cov_.inverse ();
+  if (leaf.icov_.maxCoeff () == std::numeric_limits<float>::infinity ( )
+      || leaf.icov_.minCoeff () == -std::numeric_limits<float>::infinity ( ) )
+  {
+    leaf.nr_points = -1;
+  }
+  return (true);
+}
 
-      min_covar_eigvalue = min_covar_eigvalue_mult_ * eigen_val (2, 2);
-      if (eigen_val (0, 0) < min_covar_eigvalue)
-      {
-        eigen_val (0, 0) = min_covar_eigvalue;
+//////////////////////////////////////////////////////////////////////////////////////////
+template<typename PointT> void
+pclomp::VoxelGridCovariance<PointT>::updatePoints (const PointCloud& cloud, int sign)
+{
+  for (size_t cp = 0; cp < cloud.points.size (); ++cp)
+  {
+    const PointT& point = cloud.points[cp];
+    if (!pcl_isfinite (point.x) || !pcl_isfinite (point.y) || !pcl_isfinite (point.z))
+      continue;
 
-        if (eigen_val (1, 1) < min_covar_eigvalue)
+    const VoxelKey key = getVoxelKey (point.x, point.y, point.z);
+    int li;
+    if (sign > 0)
+    {
+      const int new_li = free_leaves_.empty () ? static_cast<int> (leaves_.size ()) : free_leaves_.back ();
+      std::pair<int*, bool> leaf_index = leaf_indices_.insert (key, new_li);
+      if (leaf_index.second)
+      {
+        if (free_leaves_.empty ())
         {
-          eigen_val (1, 1) = min_covar_eigvalue;
+          leaves_.push_back (Leaf ());
+          leaf_keys_.push_back (key);
+          leaf_in_output_.push_back (0);
+          leaf_dirty_.push_back (0);
+        }
+        else
+        {
+          free_leaves_.pop_back ();
+          leaves_[new_li] = Leaf ();
+          leaf_keys_[new_li] = key;
         }
-
-        leaf.cov_ = leaf.evecs_ * eigen_val * leaf.evecs_.inverse ();
       }
-      leaf.evals_ = eigen_val.diagonal ();
+      li = *leaf_index.first;
+    }
+    else
+    {
+      const int* leaf_index = leaf_indices_.find (key);
+      if (!leaf_index || leaves_[*leaf_index].total_points_ == 0)
+        continue;
+      li = *leaf_index;
+    }
 
-      leaf.icov_ = leaf.cov_.inverse ();
-      if (leaf.icov_.maxCoeff () == std::numeric_limits<float>::infinity ( )
-          || leaf.icov_.minCoeff () == -std::numeric_limits<float>::infinity ( ) )
-      {
-        leaf.nr_points = -1;
-      }
+    Leaf& leaf = leaves_[li];
+    const Eigen::Vector3d pt3d (point.x, point.y, point.z);
+    leaf.point_sum_ += sign * pt3d;
+    leaf.point_sq_sum_ += sign * (pt3d * pt3d.transpose ());
+    leaf.total_points_ += sign;
+    if (leaf.total_points_ == 0)
+    {
+      // Drop the rounding left over by the removals and release the voxel,
+      // its statistics are cleared by the next update
+      leaf.point_sum_.setZero ();
+      leaf.point_sq_sum_.setIdentity ();
+      leaf_indices_.erase (key);
+      free_leaves_.push_back (li);
+    }
 
+    if (!leaf_dirty_[li])
+    {
+      leaf_dirty_[li] = 1;
+      dirty_leaves_.push_back (li);
     }
   }
+}
 
-  output.width = static_cast<uint32_t> (output.points.size ());
+//////////////////////////////////////////////////////////////////////////////////////////
+template<typename PointT> void
+pclomp::VoxelGridCovariance<PointT>::updateDirtyLeaves ()
+{
+  if (dirty_leaves_.empty ())
+    return;
+
+  thread_pool_->parallelFor (static_cast<int> (dirty_leaves_.size ()), 64, [&] (int begin, int end, int)
+  {
+    Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> eigensolver;
+    for (int k = begin; k < end; ++k)
+    {
+      const int li = dirty_leaves_[k];
+      Leaf& leaf = leaves_[li];
+      leaf.nr_points = leaf.total_points_;
+      leaf.mean_ = leaf.point_sum_;
+      leaf.cov_ = leaf.point_sq_sum_;
+      leaf.centroid = Eigen::Vector4f (static_cast<float> (leaf.point_sum_[0]), static_cast<float> (leaf.point_sum_[1]),
+                                       static_cast<float> (leaf.point_sum_[2]), 0.f);
+      leaf_in_output_[li] = computeLeafStatistics (leaf, eigensolver);
+      leaf_dirty_[li] = 0;
+    }
+  });
+  dirty_leaves_.clear ();
+  centroids_stale_ = true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+template<typename PointT> void
+pclomp::VoxelGridCovariance<PointT>::updateCentroids ()
+{
+  if (!centroids_stale_)
+    return;
+  centroids_stale_ = false;
+
+  // Centroids of the leaves with sufficient points, in leaf order
+  voxel_centroids_ = PointCloudPtr (new PointCloud);
+  voxel_centroids_->reserve (leaves_.size ());
+  voxel_centroids_leaf_indices_.clear ();
+  for (int li = 0; li < static_cast<int> (leaves_.size ()); ++li)
+  {
+    if (!leaf_in_output_[li])
+      continue;
+    PointT centroid;
+    centroid.x = leaves_[li].centroid[0];
+    centroid.y = leaves_[li].centroid[1];
+    centroid.z = leaves_[li].centroid[2];
+    voxel_centroids_->push_back (centroid);
+    if (searchable_)
+      voxel_centroids_leaf_indices_.push_back (li);
+  }
+
+  if (searchable_ && voxel_centroids_->size () > 0)
+    kdtree_.setInputCloud (voxel_centroids_);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 template<typename PointT> int
-pclomp::VoxelGridCovariance<PointT>::getNeighborhoodAtPoint(const Eigen::MatrixXi& relative_coordinates, const PointT& reference_point, std::vector<LeafConstPtr> &neighbors) const
+pclomp::VoxelGridCovariance<PointT>::getNeighborhood(const VoxelKey* offsets, int num_offsets, const PointT& reference_point, std::vector<LeafConstPtr> &neighbors) const
 {
 	neighbors.clear();
 
-	// Find displacement coordinates
-	Eigen::Vector4i ijk(static_cast<int> (floor(reference_point.x / leaf_size_[0])),
-		static_cast<int> (floor(reference_point.y / leaf_size_[1])),
-		static_cast<int> (floor(reference_point.z / leaf_size_[2])), 0);
-	Eigen::Array4i diff2min = min_b_ - ijk;
-	Eigen::Array4i diff2max = max_b_ - ijk;
-	neighbors.reserve(relative_coordinates.cols());
-
 	// Check each neighbor to see if it is occupied and contains sufficient points
-	// Slower than radius search because needs to check 26 indices
-	for (int ni = 0; ni < relative_coordinates.cols(); ni++)
+	const VoxelKey key = getVoxelKey(reference_point.x, reference_point.y, reference_point.z);
+	for (int ni = 0; ni < num_offsets; ni++)
 	{
-		Eigen::Vector4i displacement = (Eigen::Vector4i() << relative_coordinates.col(ni), 0).finished();
-		// Checking if the specified cell is in the grid
-		if ((diff2min <= displacement.array()).all() && (diff2max >= displacement.array()).all())
-		{
-			auto leaf_iter = leaves_.find(((ijk + displacement - min_b_).dot(divb_mul_)));
-			if (leaf_iter != leaves_.end() && leaf_iter->second.nr_points >= min_points_per_voxel_)
-			{
-				LeafConstPtr leaf = &(leaf_iter->second);
-				neighbors.push_back(leaf);
-			}
-		}
+		LeafConstPtr leaf = findLeaf(VoxelKey(key.x + offsets[ni].x, key.y + offsets[ni].y, key.z + offsets[ni].z));
+		if (leaf && leaf->nr_points >= min_points_per_voxel_)
+			neighbors.push_back(leaf);
 	}
 
 	return (static_cast<int> (neighbors.size()));
@@ -405,31 +565,27 @@ pclomp::VoxelGridCovariance<PointT>::getNeighborhoodAtPoint(const Eigen::MatrixX
 
 //////////////////////////////////////////////////////////////////////////////////////////
 template<typename PointT> int
-pclomp::VoxelGridCovariance<PointT>::getNeighborhoodAtPoint(const PointT& reference_point, std::vector<LeafConstPtr> &neighbors) const
+pclomp::VoxelGridCovariance<PointT>::getNeighborhoodAtPoint(const Eigen::MatrixXi& relative_coordinates, const PointT& reference_point, std::vector<LeafConstPtr> &neighbors) const
 {
-	neighbors.clear();
+	std::vector<VoxelKey> offsets(relative_coordinates.cols());
+	for (int ni = 0; ni < relative_coordinates.cols(); ni++)
+		offsets[ni] = VoxelKey(relative_coordinates(0, ni), relative_coordinates(1, ni), relative_coordinates(2, ni));
+	return getNeighborhood(offsets.data(), static_cast<int>(offsets.size()), reference_point, neighbors);
+}
 
-	// Find displacement coordinates
-	Eigen::MatrixXi relative_coordinates = pcl::getAllNeighborCellIndices();
-	return getNeighborhoodAtPoint(relative_coordinates, reference_point, neighbors);
+//////////////////////////////////////////////////////////////////////////////////////////
+template<typename PointT> int
+pclomp::VoxelGridCovariance<PointT>::getNeighborhoodAtPoint(const PointT& reference_point, std::vector<LeafConstPtr> &neighbors) const
+{
+	// The 26 neighbors, not including the voxel containing the point
+	return getNeighborhood(VoxelNeighbors27().data() + 1, 26, reference_point, neighbors);
 }
 
 //////////////////////////////////////////////////////////////////////////////////////////
 template<typename PointT> int
 pclomp::VoxelGridCovariance<PointT>::getNeighborhoodAtPoint7(const PointT& reference_point, std::vector<LeafConstPtr> &neighbors) const
 {
-	neighbors.clear();
-
-	Eigen::MatrixXi relative_coordinates(3, 7);
-	relative_coordinates.setZero();
-	relative_coordinates(0, 1) = 1;
-	relative_coordinates(0, 2) = -1;
-	relative_coordinates(1, 3) = 1;
-	relative_coordinates(1, 4) = -1;
-	relative_coordinates(2, 5) = 1;
-	relative_coordinates(2, 6) = -1;
-
-	return getNeighborhoodAtPoint(relative_coordinates, reference_point, neighbors);
+	return getNeighborhood(kVoxelNeighbors7, 7, reference_point, neighbors);
 }
 
 
@@ -437,8 +593,7 @@ pclomp::VoxelGridCovariance<PointT>::getNeighborhoodAtPoint7(const PointT& refer
 template<typename PointT> int
 pclomp::VoxelGridCovariance<PointT>::getNeighborhoodAtPoint1(const PointT& reference_point, std::vector<LeafConstPtr> &neighbors) const
 {
-	neighbors.clear();
-	return getNeighborhoodAtPoint(Eigen::MatrixXi::Zero(3,1), reference_point, neighbors);
+	return getNeighborhood(kVoxelNeighbors7, 1, reference_point, neighbors);
 }
 
 
@@ -461,9 +616,9 @@ pclomp::VoxelGridCovariance<PointT>::getDisplayCloud (pcl::PointCloud<pcl::Point
   Eigen::Vector3d dist_point;
 
   // Generate points for each occupied voxel with sufficient points.
-  for (auto it = leaves_.begin (); it != leaves_.end (); ++it)
+  for (size_t li = 0; li < leaves_.size (); ++li)
   {
-    Leaf& leaf = it->second;
+    Leaf& leaf = leaves_[li];
 
     if (leaf.nr_points >= min_points_per_voxel_)
     {
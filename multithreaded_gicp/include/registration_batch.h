@@ -0,0 +1,45 @@
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <registration_stats.h>
+#include <vector>
+
+// Result of one item of a batch registration
+struct RegistrationBatchResult {
+  Eigen::Matrix4f transformation;
+  // Registration::getFitnessScore() at transformation
+  double fitness_score;
+  bool converged;
+  // Default constructed if the engine does not collect statistics
+  RegistrationStats stats;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+typedef std::vector<RegistrationBatchResult,
+                    Eigen::aligned_allocator<RegistrationBatchResult>>
+    RegistrationBatchResults;
+
+typedef std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>>
+    RegistrationTransformations;
+
+// Number of items of a batch of num_sources sources and num_guesses initial
+// guesses: one source with many guesses, many sources without guesses
+// (identity), or as many sources as guesses. Returns 0 if the sizes do not
+// match any of these
+inline size_t BatchSize(size_t num_sources, size_t num_guesses) {
+  if (num_sources == 0)
+    return 0;
+  if (num_guesses == 0)
+    return num_sources;
+  if (num_sources == 1 || num_sources == num_guesses)
+    return num_guesses;
+  return 0;
+}
+
+// Initial guess of item i of a batch of BatchSize() items
+inline Eigen::Matrix4f BatchGuess(const RegistrationTransformations& guesses,
+                                  size_t i) {
+  return guesses.empty() ? Eigen::Matrix4f::Identity() : guesses[i];
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <stdexcept>
+#include <string>
+#include <vector>
+
 enum class RegistrationMethod { GICP, NDT };
 
 using EnumToStringRegistrationMethods =
@@ -10,7 +14,7 @@ const std::vector<EnumToStringRegistrationMethods>
         EnumToStringRegistrationMethods("gicp", RegistrationMethod::GICP),
         EnumToStringRegistrationMethods("ndt", RegistrationMethod::NDT)};
 // TODO: maybe somehow varialbe template, but it's available from cpp17 i think
-RegistrationMethod getRegistrationMethodFromString(const std::string& mode) {
+inline RegistrationMethod getRegistrationMethodFromString(const std::string& mode) {
   for (const auto& available_vlo : EnumToStringRegistrationMethodsVector) {
     if (mode == available_vlo.first) {
       return available_vlo.second;
@@ -18,3 +22,93 @@ RegistrationMethod getRegistrationMethodFromString(const std::string& mode) {
   }
   throw std::runtime_error("No such Registration mode!: " + mode);
 }
+
+// Solver used by GICP to estimate the transformation for a fixed set of
+// correspondences
+enum class GicpSolver { BFGS, GAUSS_NEWTON, LEVENBERG_MARQUARDT };
+
+using EnumToStringGicpSolvers = std::pair<std::string, GicpSolver>;
+
+const std::vector<EnumToStringGicpSolvers> EnumToStringGicpSolversVector = {
+    EnumToStringGicpSolvers("bfgs", GicpSolver::BFGS),
+    EnumToStringGicpSolvers("gauss_newton", GicpSolver::GAUSS_NEWTON),
+    EnumToStringGicpSolvers("levenberg_marquardt",
+                            GicpSolver::LEVENBERG_MARQUARDT)};
+
+inline GicpSolver getGicpSolverFromString(const std::string& solver) {
+  for (const auto& available_solver : EnumToStringGicpSolversVector) {
+    if (solver == available_solver.first) {
+      return available_solver.second;
+    }
+  }
+  throw std::runtime_error("No such GICP solver!: " + solver);
+}
+
+// Solver used by NDT: Newton steps on the full hessian with a More-Thuente line
+// search, or damped Gauss-Newton steps on the hessian without its second order
+// terms, which evaluates the derivatives once per iteration
+enum class NdtSolver { NEWTON_LINE_SEARCH, GAUSS_NEWTON };
+
+using EnumToStringNdtSolvers = std::pair<std::string, NdtSolver>;
+
+const std::vector<EnumToStringNdtSolvers> EnumToStringNdtSolversVector = {
+    EnumToStringNdtSolvers("newton_line_search",
+                           NdtSolver::NEWTON_LINE_SEARCH),
+    EnumToStringNdtSolvers("gauss_newton", NdtSolver::GAUSS_NEWTON)};
+
+inline NdtSolver getNdtSolverFromString(const std::string& solver) {
+  for (const auto& available_solver : EnumToStringNdtSolversVector) {
+    if (solver == available_solver.first) {
+      return available_solver.second;
+    }
+  }
+  throw std::runtime_error("No such NDT solver!: " + solver);
+}
+
+// Correspondence search used by GICP. VOXEL_HASH* look for the nearest target
+// point in the 1, 7 or 27 voxels of a hash grid with the correspondence
+// distance as resolution around the query point
+enum class GicpSearchMethod { KDTREE, VOXEL_HASH1, VOXEL_HASH7, VOXEL_HASH27 };
+
+using EnumToStringGicpSearchMethods = std::pair<std::string, GicpSearchMethod>;
+
+const std::vector<EnumToStringGicpSearchMethods>
+    EnumToStringGicpSearchMethodsVector = {
+        EnumToStringGicpSearchMethods("kdtree", GicpSearchMethod::KDTREE),
+        EnumToStringGicpSearchMethods("voxel_hash1",
+                                      GicpSearchMethod::VOXEL_HASH1),
+        EnumToStringGicpSearchMethods("voxel_hash7",
+                                      GicpSearchMethod::VOXEL_HASH7),
+        EnumToStringGicpSearchMethods("voxel_hash27",
+                                      GicpSearchMethod::VOXEL_HASH27)};
+
+inline GicpSearchMethod
+getGicpSearchMethodFromString(const std::string& method) {
+  for (const auto& available_method : EnumToStringGicpSearchMethodsVector) {
+    if (method == available_method.first) {
+      return available_method.second;
+    }
+  }
+  throw std::runtime_error("No such GICP search method!: " + method);
+}
+
+// Robust kernel down weighting GICP correspondences with a large mahalanobis
+// distance, applied as iteratively reweighted least squares
+enum class RobustKernel { NONE, HUBER, CAUCHY, GEMAN_MCCLURE };
+
+using EnumToStringRobustKernels = std::pair<std::string, RobustKernel>;
+
+const std::vector<EnumToStringRobustKernels> EnumToStringRobustKernelsVector =
+    {EnumToStringRobustKernels("none", RobustKernel::NONE),
+     EnumToStringRobustKernels("huber", RobustKernel::HUBER),
+     EnumToStringRobustKernels("cauchy", RobustKernel::CAUCHY),
+     EnumToStringRobustKernels("geman_mcclure", RobustKernel::GEMAN_MCCLURE)};
+
+inline RobustKernel getRobustKernelFromString(const std::string& kernel) {
+  for (const auto& available_kernel : EnumToStringRobustKernelsVector) {
+    if (kernel == available_kernel.first) {
+      return available_kernel.second;
+    }
+  }
+  throw std::runtime_error("No such robust kernel!: " + kernel);
+}
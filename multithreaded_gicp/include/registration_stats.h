@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <string>
+
+// Why a registration stopped iterating
+enum class ConvergenceReason {
+  NOT_CONVERGED,
+  // The transformation changed less than the transformation/rotation epsilons
+  TRANSFORMATION,
+  // The inlier ratio changed less than the inlier ratio epsilon
+  INLIER_RATIO,
+  // The cost decreased less than the cost decrease epsilon
+  COST_DECREASE,
+  // The maximum number of iterations was reached
+  MAX_ITERATIONS,
+  // The correspondence search failed
+  SEARCH_FAILURE,
+  // The solver failed, e.g. not enough correspondences
+  SOLVER_FAILURE
+};
+
+inline std::string ConvergenceReasonToString(ConvergenceReason reason) {
+  switch (reason) {
+  case ConvergenceReason::TRANSFORMATION:
+    return "transformation";
+  case ConvergenceReason::INLIER_RATIO:
+    return "inlier_ratio";
+  case ConvergenceReason::COST_DECREASE:
+    return "cost_decrease";
+  case ConvergenceReason::MAX_ITERATIONS:
+    return "max_iterations";
+  case ConvergenceReason::SEARCH_FAILURE:
+    return "search_failure";
+  case ConvergenceReason::SOLVER_FAILURE:
+    return "solver_failure";
+  default:
+    return "not_converged";
+  }
+}
+
+// Statistics of the last call to align()
+struct RegistrationStats {
+  // Number of outer iterations
+  int iterations;
+  // Number of outer iterations of the coarse pyramid levels, if any
+  int pyramid_iterations;
+  // Time spent per phase in microseconds, summed over the iterations
+  int64_t covariances_us;
+  int64_t lookups_us;
+  int64_t optimization_us;
+  int64_t total_us;
+  // Number of source points and of correspondences (inliers) in the last
+  // iteration
+  int num_points;
+  int num_inliers;
+  // Number of target covariances taken from the target covariance cache
+  int cached_target_covariances;
+  // Mean cost over the inliers at the final transformation, NaN if unknown
+  double final_cost;
+  ConvergenceReason convergence_reason;
+
+  RegistrationStats() {
+    reset();
+  }
+
+  void reset() {
+    iterations = 0;
+    pyramid_iterations = 0;
+    covariances_us = 0;
+    lookups_us = 0;
+    optimization_us = 0;
+    total_us = 0;
+    num_points = 0;
+    num_inliers = 0;
+    cached_target_covariances = 0;
+    final_cost = std::numeric_limits<double>::quiet_NaN();
+    convergence_reason = ConvergenceReason::NOT_CONVERGED;
+  }
+
+  double inlierRatio() const {
+    return num_points > 0 ? static_cast<double>(num_inliers) / num_points : 0.;
+  }
+};
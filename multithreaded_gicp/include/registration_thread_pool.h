@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Persistent pool of worker threads owned by a registration engine, or shared
+// explicitly between engines. Unlike omp_set_num_threads, the number of
+// threads of a pool does not leak into any other component of the process.
+//
+// parallelFor splits [0, n) into chunks of chunk_size items and runs
+// f(begin, end, thread_id) on the calling thread (thread_id 0) and the workers
+// (thread_id 1 to numThreads() - 1). Chunks always have the same bounds for a
+// given n and chunk_size, so per chunk results reduced in chunk order do not
+// depend on the number of threads. thread_id can index per thread scratch
+// buffers sized to numThreads().
+//
+// Calls from different threads are serialized. A parallelFor called from
+// inside a job of the same pool runs sequentially on the calling thread.
+// Dispatching a job does not allocate.
+class RegistrationThreadPool {
+public:
+  typedef std::shared_ptr<RegistrationThreadPool> Ptr;
+
+  // cpu_affinity optionally pins worker i to cpu_affinity[i % size]. The
+  // calling thread, which also runs chunks, is never pinned
+  explicit RegistrationThreadPool(
+      int num_threads, const std::vector<int>& cpu_affinity = std::vector<int>())
+    : num_threads_(std::max(1, num_threads)),
+      generation_(0),
+      busy_workers_(0),
+      stop_(false),
+      job_(nullptr),
+      job_function_(nullptr),
+      n_(0),
+      chunk_size_(1),
+      next_chunk_(0) {
+    for (int i = 1; i < num_threads_; i++) {
+      workers_.emplace_back(&RegistrationThreadPool::workerLoop, this, i);
+#ifdef __linux__
+      if (!cpu_affinity.empty()) {
+        cpu_set_t cpu_set;
+        CPU_ZERO(&cpu_set);
+        CPU_SET(cpu_affinity[(i - 1) % cpu_affinity.size()], &cpu_set);
+        pthread_setaffinity_np(
+            workers_.back().native_handle(), sizeof(cpu_set_t), &cpu_set);
+      }
+#endif
+    }
+  }
+
+  ~RegistrationThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    start_condition_.notify_all();
+    for (std::thread& worker : workers_)
+      worker.join();
+  }
+
+  RegistrationThreadPool(const RegistrationThreadPool&) = delete;
+  RegistrationThreadPool& operator=(const RegistrationThreadPool&) = delete;
+
+  int numThreads() const {
+    return num_threads_;
+  }
+
+  // Run f(begin, end, thread_id) over the chunks of [0, n), returns when all
+  // of them are done
+  template <typename Function>
+  void parallelFor(int n, int chunk_size, Function f) {
+    if (n <= 0)
+      return;
+    chunk_size = std::max(1, chunk_size);
+    if (num_threads_ == 1 || n <= chunk_size || currentPool() == this) {
+      for (int begin = 0; begin < n; begin += chunk_size)
+        f(begin, std::min(n, begin + chunk_size), 0);
+      return;
+    }
+
+    std::lock_guard<std::mutex> dispatch_lock(dispatch_mutex_);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      // f outlives the job, the call returns only once all chunks are done
+      job_ = &runJob<Function>;
+      job_function_ = &f;
+      n_ = n;
+      chunk_size_ = chunk_size;
+      next_chunk_ = 0;
+      busy_workers_ = num_threads_ - 1;
+      generation_++;
+    }
+    start_condition_.notify_all();
+
+    runChunks(0);
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    done_condition_.wait(lock, [this] { return busy_workers_ == 0; });
+    job_ = nullptr;
+    job_function_ = nullptr;
+  }
+
+private:
+  // Type erased call of the function of the current job, unlike std::function
+  // it needs no heap storage for the function
+  typedef void (*Job)(void* function, int begin, int end, int thread_id);
+
+  template <typename Function>
+  static void runJob(void* function, int begin, int end, int thread_id) {
+    (*static_cast<Function*>(function))(begin, end, thread_id);
+  }
+
+  // Pool whose job the current thread is running, nullptr if none
+  static RegistrationThreadPool*& currentPool() {
+    static thread_local RegistrationThreadPool* pool = nullptr;
+    return pool;
+  }
+
+  void runChunks(int thread_id) {
+    RegistrationThreadPool* previous_pool = currentPool();
+    currentPool() = this;
+    const int num_chunks = (n_ + chunk_size_ - 1) / chunk_size_;
+    for (int chunk = next_chunk_++; chunk < num_chunks; chunk = next_chunk_++) {
+      const int begin = chunk * chunk_size_;
+      job_(job_function_, begin, std::min(n_, begin + chunk_size_), thread_id);
+    }
+    currentPool() = previous_pool;
+  }
+
+  void workerLoop(int thread_id) {
+    unsigned long seen_generation = 0;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        start_condition_.wait(lock, [this, seen_generation] {
+          return stop_ || generation_ != seen_generation;
+        });
+        if (stop_)
+          return;
+        seen_generation = generation_;
+      }
+      runChunks(thread_id);
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        busy_workers_--;
+      }
+      done_condition_.notify_one();
+    }
+  }
+
+  const int num_threads_;
+  std::vector<std::thread> workers_;
+
+  // Serializes parallelFor calls from different threads
+  std::mutex dispatch_mutex_;
+  // Protects the job description and the worker state below
+  std::mutex mutex_;
+  std::condition_variable start_condition_;
+  std::condition_variable done_condition_;
+  unsigned long generation_;
+  int busy_workers_;
+  bool stop_;
+
+  // Current job
+  Job job_;
+  void* job_function_;
+  int n_;
+  int chunk_size_;
+  std::atomic<int> next_chunk_;
+};
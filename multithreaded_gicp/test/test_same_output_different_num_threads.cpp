@@ -1,10 +1,34 @@
 #include <frontend_utils/CommonStructs.h>
 #include <multithreaded_gicp/gicp.h>
+#include <multithreaded_gicp/gicp_simd.h>
+#include <multithreaded_ndt/ndt_omp.h>
 #include <pcl/io/pcd_io.h>
+#include <pcl/kdtree/kdtree_flann.h>
 #include <pcl/point_types.h>
 #include <pcl/registration/gicp.h>
 #include <ros/package.h>
 
+#include <random>
+
+// Settings shared by the GICP checks, for the original and the multithreaded
+// GICP
+template <typename Gicp>
+void setUpGicp(Gicp& icp) {
+  icp.setTransformationEpsilon(0.0000000001);
+  icp.setMaxCorrespondenceDistance(0.2);
+  icp.setMaximumIterations(20);
+  icp.setRANSACIterations(0);
+  icp.setMaximumOptimizerIterations(50);
+}
+
+// Settings shared by the NDT checks
+void setUpNdt(pclomp::NormalDistributionsTransform<PointF, PointF>& ndt,
+              int max_iterations = 20) {
+  ndt.setTransformationEpsilon(0.0000000001);
+  ndt.setMaximumIterations(max_iterations);
+  ndt.setResolution(1.0);
+}
+
 // TODO(JN) refactor this into a gtest
 int main(int argc, char** argv) {
   // Read in point clouds
@@ -29,11 +53,7 @@ int main(int argc, char** argv) {
   {
     std::cout << "Original GICP" << std::endl;
     pcl::GeneralizedIterativeClosestPoint<PointF, PointF> icp;
-    icp.setTransformationEpsilon(0.0000000001);
-    icp.setMaxCorrespondenceDistance(0.2);
-    icp.setMaximumIterations(20);
-    icp.setRANSACIterations(0);
-    icp.setMaximumOptimizerIterations(50);
+    setUpGicp(icp);
     icp.setInputSource(query);
     icp.setInputTarget(reference);
     PointCloudF aligned_points;
@@ -46,15 +66,18 @@ int main(int argc, char** argv) {
   }
 
   bool success = true;
+  // The multithreaded cost function sums the correspondences in a different
+  // order than the original GICP, the results only match up to rounding
+  const double transform_tolerance = 1e-3;
+  const double fitness_tolerance = 1e-2 * original_gicp_fitness_score;
+
+  Eigen::Matrix4f single_thread_transform;
+  double single_thread_fitness_score;
 
   // Test gicp with num threads = 1 to 8
   for (int i = 1; i < 9; i++) {
     pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
-    icp.setTransformationEpsilon(0.0000000001);
-    icp.setMaxCorrespondenceDistance(0.2);
-    icp.setMaximumIterations(20);
-    icp.setRANSACIterations(0);
-    icp.setMaximumOptimizerIterations(50);
+    setUpGicp(icp);
     icp.setNumThreads(i);
     icp.enableTimingOutput(true);
     icp.setInputSource(query);
@@ -65,7 +88,13 @@ int main(int argc, char** argv) {
     std::cout << T << std::endl;
     double fitness_score = icp.getFitnessScore();
     std::cout << "Fitness score: " << fitness_score << std::endl;
-    if (T == original_gicp_transform) {
+    if (i == 1) {
+      single_thread_transform = T;
+      single_thread_fitness_score = fitness_score;
+    }
+
+    if ((T - original_gicp_transform).cwiseAbs().maxCoeff() <
+        transform_tolerance) {
       std::cout << "SUCCESS: Transform matches original GICP transform"
                 << std::endl;
     } else {
@@ -74,7 +103,8 @@ int main(int argc, char** argv) {
       success = false;
     }
 
-    if (fitness_score == original_gicp_fitness_score) {
+    if (std::fabs(fitness_score - original_gicp_fitness_score) <
+        fitness_tolerance) {
       std::cout << "SUCCESS: Fitness score matches original GICP fitness score"
                 << std::endl;
     } else {
@@ -83,12 +113,805 @@ int main(int argc, char** argv) {
           << std::endl;
       success = false;
     }
+
+    // The result must not depend on the number of threads at all
+    if (T == single_thread_transform &&
+        fitness_score == single_thread_fitness_score) {
+      std::cout << "SUCCESS: Result matches single thread result" << std::endl;
+    } else {
+      std::cerr << "FAILURE: Result does not match single thread result"
+                << std::endl;
+      success = false;
+    }
     std::cout << std::endl;
   }
 
+  // Covariances recomputed from the k nearest neighbours are those of the
+  // original GICP, whatever the number of threads
+  {
+    const int num_threads[2] = {1, 4};
+    Eigen::Matrix4f transforms[2];
+    for (int k = 0; k < 2; k++) {
+      pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+      setUpGicp(icp);
+      icp.setNumThreads(num_threads[k]);
+      icp.RecomputeSourceCovariance(true);
+      icp.RecomputeTargetCovariance(true);
+      icp.setInputSource(query);
+      icp.setInputTarget(reference);
+      PointCloudF aligned_points;
+      icp.align(aligned_points);
+      transforms[k] = icp.getFinalTransformation();
+    }
+    if ((transforms[0] - original_gicp_transform).cwiseAbs().maxCoeff() <
+            transform_tolerance &&
+        transforms[1] == transforms[0]) {
+      std::cout << "SUCCESS: Recomputed covariances match original GICP"
+                << std::endl;
+    } else {
+      std::cerr << "FAILURE: Recomputed covariances do not match original "
+                   "GICP or depend on the number of threads"
+                << std::endl;
+      success = false;
+    }
+  }
+
+  // Mahalanobis matrices cached within a small rotation bucket give the
+  // uncached result. From a rotated guess the rotation leaves the bucket of
+  // the first iterations, whose matrices must not be reused
+  {
+    Eigen::Matrix4f rotated_guess = Eigen::Matrix4f::Identity();
+    rotated_guess.topLeftCorner<3, 3>() =
+        Eigen::AngleAxisf(0.1f, Eigen::Vector3f::UnitZ()).toRotationMatrix();
+    const Eigen::Matrix4f guesses[2] = {Eigen::Matrix4f::Identity(),
+                                        rotated_guess};
+    for (int k = 0; k < 2; k++) {
+      Eigen::Matrix4f transforms[2];
+      for (int cached = 0; cached < 2; cached++) {
+        pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+        setUpGicp(icp);
+        icp.setMahalanobisCacheRotationThreshold(cached ? 0.001 : 0.);
+        icp.setInputSource(query);
+        icp.setInputTarget(reference);
+        PointCloudF aligned_points;
+        icp.align(aligned_points, guesses[k]);
+        transforms[cached] = icp.getFinalTransformation();
+      }
+      if ((transforms[1] - transforms[0]).cwiseAbs().maxCoeff() <
+          transform_tolerance) {
+        std::cout << "SUCCESS: Mahalanobis cache matches uncached result from "
+                  << "guess " << k << std::endl;
+      } else {
+        std::cerr << "FAILURE: Mahalanobis cache does not match uncached "
+                  << "result from guess " << k << std::endl;
+        success = false;
+      }
+    }
+  }
+
+  // The Gauss-Newton and Levenberg-Marquardt solvers reach the BFGS minimum
+  {
+    const GicpSolver solvers[2] = {GicpSolver::GAUSS_NEWTON,
+                                   GicpSolver::LEVENBERG_MARQUARDT};
+    for (int k = 0; k < 2; k++) {
+      pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+      setUpGicp(icp);
+      icp.setSolver(solvers[k]);
+      icp.setInputSource(query);
+      icp.setInputTarget(reference);
+      PointCloudF aligned_points;
+      icp.align(aligned_points);
+      if ((icp.getFinalTransformation() - single_thread_transform)
+              .cwiseAbs()
+              .maxCoeff() < transform_tolerance) {
+        std::cout << "SUCCESS: Solver " << k << " matches BFGS" << std::endl;
+      } else {
+        std::cerr << "FAILURE: Solver " << k << " does not match BFGS"
+                  << std::endl;
+        success = false;
+      }
+    }
+  }
+
+  // Without a robust kernel the result is exactly the plain least squares
+  // one, Huber and Cauchy only down weight the few far correspondences of a
+  // well aligned pair and converge close to it
+  {
+    const RobustKernel kernels[3] = {RobustKernel::NONE, RobustKernel::HUBER,
+                                     RobustKernel::CAUCHY};
+    const double robust_tolerance = 1e-2;
+    for (int k = 0; k < 3; k++) {
+      pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+      setUpGicp(icp);
+      icp.setRobustKernel(kernels[k], 1.0);
+      icp.setInputSource(query);
+      icp.setInputTarget(reference);
+      PointCloudF aligned_points;
+      icp.align(aligned_points);
+      const Eigen::Matrix4f T = icp.getFinalTransformation();
+      const bool matches =
+          kernels[k] == RobustKernel::NONE
+              ? T == single_thread_transform &&
+                    icp.getFitnessScore() == single_thread_fitness_score
+              : icp.hasConverged() &&
+                    (T - single_thread_transform).cwiseAbs().maxCoeff() <
+                        robust_tolerance;
+      if (matches) {
+        std::cout << "SUCCESS: Robust kernel " << k
+                  << " matches the least squares result" << std::endl;
+      } else {
+        std::cerr << "FAILURE: Robust kernel " << k
+                  << " does not match the least squares result" << std::endl;
+        success = false;
+      }
+    }
+  }
+
+  // The 27 voxel neighbourhood holds every target point within the
+  // correspondence distance, so it finds the same matches as the kdtree
+  {
+    const GicpSearchMethod methods[2] = {GicpSearchMethod::KDTREE,
+                                         GicpSearchMethod::VOXEL_HASH27};
+    int num_inliers[2];
+    Eigen::Matrix4f transforms[2];
+    for (int k = 0; k < 2; k++) {
+      pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+      setUpGicp(icp);
+      icp.setSearchMethod(methods[k]);
+      icp.setInputSource(query);
+      icp.setInputTarget(reference);
+      PointCloudF aligned_points;
+      icp.align(aligned_points);
+      num_inliers[k] = icp.getRegistrationStats().num_inliers;
+      transforms[k] = icp.getFinalTransformation();
+    }
+    if (num_inliers[1] == num_inliers[0] &&
+        (transforms[1] - transforms[0]).cwiseAbs().maxCoeff() <
+            transform_tolerance) {
+      std::cout << "SUCCESS: Voxel hash search matches kdtree search"
+                << std::endl;
+    } else {
+      std::cerr << "FAILURE: Voxel hash search finds " << num_inliers[1]
+                << " inliers, kdtree search " << num_inliers[0] << std::endl;
+      success = false;
+    }
+  }
+
+  // The AVX2 kernel sums the same terms as the scalar kernel, 8 lanes at a
+  // time, and hands the last correspondences of a range to the scalar kernel
+#ifdef MULTITHREADED_GICP_HAVE_AVX2_KERNEL
+  if (pcl::gicp_simd::hasAvx2Kernel()) {
+    std::mt19937 generator(42);
+    std::uniform_real_distribution<float> distribution(-1.f, 1.f);
+    pcl::gicp_simd::CorrespondencesSoAf correspondences;
+    correspondences.resize(8 * 37 + 5);
+    for (std::vector<float>* v :
+         {&correspondences.src_x, &correspondences.src_y,
+          &correspondences.src_z, &correspondences.tgt_x,
+          &correspondences.tgt_y, &correspondences.tgt_z,
+          &correspondences.m_xx, &correspondences.m_xy, &correspondences.m_xz,
+          &correspondences.m_yy, &correspondences.m_yz, &correspondences.m_zz})
+      for (float& x : *v)
+        x = distribution(generator);
+    float A[12];
+    for (float& a : A)
+      a = distribution(generator);
+
+    // Ranges with and without a tail, starting on and off a lane boundary
+    const int ranges[3][2] = {{0, 8 * 37}, {0, 8 * 37 + 5}, {3, 8 * 37 + 2}};
+    for (int k = 0; k < 3; k++) {
+      pcl::gicp_simd::Sums scalar, avx2;
+      pcl::gicp_simd::accumulateScalar<true>(A, correspondences, ranges[k][0],
+                                             ranges[k][1], scalar);
+      pcl::gicp_simd::accumulateAvx2<true>(A, correspondences, ranges[k][0],
+                                           ranges[k][1], avx2);
+      // Float sums of a few hundred terms of order one, added in another order
+      const double tolerance = 1e-3;
+      double max_error = std::fabs(avx2.f - scalar.f);
+      for (int j = 0; j < 3; j++)
+        max_error = std::max(max_error, std::fabs(avx2.g[j] - scalar.g[j]));
+      for (int j = 0; j < 9; j++)
+        max_error = std::max(max_error, std::fabs(avx2.R[j] - scalar.R[j]));
+      if (max_error < tolerance) {
+        std::cout << "SUCCESS: AVX2 kernel matches scalar kernel on ["
+                  << ranges[k][0] << ", " << ranges[k][1] << ")" << std::endl;
+      } else {
+        std::cerr << "FAILURE: AVX2 kernel differs from scalar kernel by "
+                  << max_error << " on [" << ranges[k][0] << ", "
+                  << ranges[k][1] << ")" << std::endl;
+        success = false;
+      }
+    }
+  } else {
+    std::cout << "AVX2 not supported, skipping the AVX2 kernel check"
+              << std::endl;
+  }
+#endif
+
+  // Each early exit stops at the second iteration when it always holds, the
+  // final cost is reported whether or not the loop evaluates it
+  {
+    const ConvergenceReason reasons[3] = {ConvergenceReason::INLIER_RATIO,
+                                          ConvergenceReason::COST_DECREASE,
+                                          ConvergenceReason::NOT_CONVERGED};
+    for (int k = 0; k < 3; k++) {
+      pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+      setUpGicp(icp);
+      if (k == 0)
+        icp.setInlierRatioEpsilon(1.0);
+      if (k == 1)
+        icp.setCostDecreaseEpsilon(1.0);
+      icp.setInputSource(query);
+      icp.setInputTarget(reference);
+      PointCloudF aligned_points;
+      icp.align(aligned_points);
+      const RegistrationStats& stats = icp.getRegistrationStats();
+      const bool exited = reasons[k] == ConvergenceReason::NOT_CONVERGED ||
+          (stats.convergence_reason == reasons[k] && stats.iterations == 2);
+      if (exited && std::isfinite(stats.final_cost)) {
+        std::cout << "SUCCESS: GICP stopped with reason "
+                  << ConvergenceReasonToString(stats.convergence_reason)
+                  << " and final cost " << stats.final_cost << std::endl;
+      } else {
+        std::cerr << "FAILURE: GICP stopped with reason "
+                  << ConvergenceReasonToString(stats.convergence_reason)
+                  << " after " << stats.iterations << " iterations, final cost "
+                  << stats.final_cost << std::endl;
+        success = false;
+      }
+    }
+  }
+
+  // Two instances sharing one explicitly owned pool, pinned to the first CPUs
+  {
+    RegistrationThreadPool::Ptr thread_pool =
+        std::make_shared<RegistrationThreadPool>(4, std::vector<int>{0, 1});
+    for (int k = 0; k < 2; k++) {
+      pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+      setUpGicp(icp);
+      icp.setThreadPool(thread_pool);
+      icp.setInputSource(query);
+      icp.setInputTarget(reference);
+      PointCloudF aligned_points;
+      icp.align(aligned_points);
+      if (icp.getFinalTransformation() == single_thread_transform &&
+          icp.getFitnessScore() == single_thread_fitness_score) {
+        std::cout << "SUCCESS: Shared pool result matches single thread result"
+                  << std::endl;
+      } else {
+        std::cerr
+            << "FAILURE: Shared pool result does not match single thread result"
+            << std::endl;
+        success = false;
+      }
+    }
+  }
+
+  // Coarse to fine pyramid ends up at the same minimum
+  {
+    pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+    setUpGicp(icp);
+    icp.setPyramidLevels({1.0, 0.5}, {10, 10});
+    icp.setInputSource(query);
+    icp.setInputTarget(reference);
+    PointCloudF aligned_points;
+    icp.align(aligned_points);
+    if ((icp.getFinalTransformation() - original_gicp_transform)
+            .cwiseAbs()
+            .maxCoeff() < transform_tolerance) {
+      std::cout << "SUCCESS: Pyramid transform matches original GICP transform"
+                << std::endl;
+    } else {
+      std::cerr
+          << "FAILURE: Pyramid transform does not match original GICP transform"
+          << std::endl;
+      success = false;
+    }
+  }
+
+  // A target already in the covariance cache gets all its covariances from it
+  {
+    pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+    setUpGicp(icp);
+    Eigen::Matrix4f T[2];
+    int cached[2];
+    for (int k = 0; k < 2; k++) {
+      icp.setInputSource(query);
+      icp.setInputTargetCached(reference, Eigen::Matrix4f::Identity());
+      PointCloudF aligned_points;
+      icp.align(aligned_points);
+      T[k] = icp.getFinalTransformation();
+      cached[k] = icp.getRegistrationStats().cached_target_covariances;
+    }
+    if (cached[0] == 0 && cached[1] == static_cast<int>(reference->size()) &&
+        T[1] == T[0]) {
+      std::cout << "SUCCESS: Cached target covariances reused" << std::endl;
+    } else {
+      std::cerr << "FAILURE: Cached target covariances not reused, "
+                << cached[1] << " of " << reference->size() << std::endl;
+      success = false;
+    }
+  }
+
+  // The cached covariances are rotated into the frame of a moved target
+  {
+    Eigen::Matrix4f cache_from_reference = Eigen::Matrix4f::Identity();
+    cache_from_reference.topLeftCorner<3, 3>() =
+        Eigen::AngleAxisf(0.5f, Eigen::Vector3f::UnitZ()).toRotationMatrix();
+    cache_from_reference(0, 3) = 5.f;
+    Eigen::Matrix4f motion = Eigen::Matrix4f::Identity();
+    motion.topLeftCorner<3, 3>() =
+        Eigen::AngleAxisf(0.3f, Eigen::Vector3f(1.f, 1.f, 1.f).normalized())
+            .toRotationMatrix();
+    motion.block<3, 1>(0, 3) = Eigen::Vector3f(1.f, 2.f, 0.5f);
+    PointCloudF::Ptr moved_query(new PointCloudF);
+    PointCloudF::Ptr moved_reference(new PointCloudF);
+    pcl::transformPointCloud(*query, *moved_query, motion);
+    pcl::transformPointCloud(*reference, *moved_reference, motion);
+
+    Eigen::Matrix4f T[2];
+    int cached = 0;
+    for (int k = 0; k < 2; k++) {
+      pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+      setUpGicp(icp);
+      PointCloudF aligned_points;
+      if (k == 1) {
+        // Fill the cache with the reference at its original pose
+        icp.setInputSource(query);
+        icp.setInputTargetCached(reference, cache_from_reference);
+        icp.align(aligned_points);
+      }
+      icp.setInputSource(moved_query);
+      if (k == 0) {
+        icp.setInputTarget(moved_reference);
+      } else {
+        icp.setInputTargetCached(moved_reference,
+                                 cache_from_reference * motion.inverse());
+      }
+      icp.align(aligned_points);
+      T[k] = icp.getFinalTransformation();
+      cached = icp.getRegistrationStats().cached_target_covariances;
+    }
+    // Rounding may move a few points to another cache cell
+    if (cached >= 0.98 * reference->size() &&
+        (T[1] - T[0]).cwiseAbs().maxCoeff() < transform_tolerance) {
+      std::cout << "SUCCESS: Cached covariances of a moved target match"
+                << std::endl;
+    } else {
+      std::cerr << "FAILURE: Cached covariances of a moved target differ, "
+                << cached << " of " << reference->size() << " cached"
+                << std::endl;
+      success = false;
+    }
+  }
+
+  // Batch items running in parallel match a single registration, for one
+  // source with several guesses and for one source per item, the second batch
+  // reusing the engines of the first
+  {
+    pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+    setUpGicp(icp);
+    icp.setNumThreads(4);
+    icp.setInputTarget(reference);
+    const std::vector<PointCloudF::ConstPtr> batch_sources[2] = {
+        {query}, {query, query, query}};
+    for (const std::vector<PointCloudF::ConstPtr>& sources : batch_sources) {
+      RegistrationBatchResults results;
+      RegistrationTransformations guesses(3, Eigen::Matrix4f::Identity());
+      if (!icp.alignBatch(sources, guesses, results) || results.size() != 3) {
+        std::cerr << "FAILURE: Batch registration failed" << std::endl;
+        success = false;
+      }
+      for (const RegistrationBatchResult& result : results) {
+        if (result.transformation == single_thread_transform &&
+            result.fitness_score == single_thread_fitness_score) {
+          std::cout << "SUCCESS: Batch result matches single thread result"
+                    << std::endl;
+        } else {
+          std::cerr
+              << "FAILURE: Batch result does not match single thread result"
+              << std::endl;
+          success = false;
+        }
+      }
+    }
+  }
+
+  // NDT derivatives are reduced in a fixed order for any number of threads
+  {
+    Eigen::Matrix4f ndt_transform[2];
+    const int ndt_num_threads[2] = {1, 4};
+    for (int k = 0; k < 2; k++) {
+      pclomp::NormalDistributionsTransform<PointF, PointF> ndt;
+      setUpNdt(ndt);
+      ndt.setNumThreads(ndt_num_threads[k]);
+      ndt.setInputSource(query);
+      ndt.setInputTarget(reference);
+      PointCloudF aligned_points;
+      ndt.align(aligned_points);
+      ndt_transform[k] = ndt.getFinalTransformation();
+    }
+    if (ndt_transform[1] == ndt_transform[0]) {
+      std::cout << "SUCCESS: NDT result matches single thread result"
+                << std::endl;
+    } else {
+      std::cerr << "FAILURE: NDT result does not match single thread result"
+                << std::endl;
+      success = false;
+    }
+  }
+
+  // Direct voxel neighbourhoods give the same result for any number of
+  // threads, close to the result of the kdtree neighbourhood. DIRECT1 only
+  // scores the voxel of each point and is allowed to drift further
+  {
+    pclomp::NormalDistributionsTransform<PointF, PointF> kdtree_ndt;
+    setUpNdt(kdtree_ndt);
+    kdtree_ndt.setInputSource(query);
+    kdtree_ndt.setInputTarget(reference);
+    PointCloudF aligned_points;
+    kdtree_ndt.align(aligned_points);
+    const Eigen::Matrix4f kdtree_transform =
+        kdtree_ndt.getFinalTransformation();
+
+    const pclomp::NeighborSearchMethod direct_methods[3] = {
+        pclomp::DIRECT26, pclomp::DIRECT7, pclomp::DIRECT1};
+    const char* direct_method_names[3] = {"DIRECT26", "DIRECT7", "DIRECT1"};
+    const double kdtree_tolerances[3] = {1e-2, 1e-2, 5e-2};
+    const int ndt_num_threads[2] = {1, 4};
+    for (int m = 0; m < 3; m++) {
+      Eigen::Matrix4f ndt_transform[2];
+      for (int k = 0; k < 2; k++) {
+        pclomp::NormalDistributionsTransform<PointF, PointF> ndt;
+        setUpNdt(ndt);
+        ndt.setNeighborhoodSearchMethod(direct_methods[m]);
+        ndt.setNumThreads(ndt_num_threads[k]);
+        ndt.setInputSource(query);
+        ndt.setInputTarget(reference);
+        ndt.align(aligned_points);
+        ndt_transform[k] = ndt.getFinalTransformation();
+      }
+      if (ndt_transform[1] == ndt_transform[0]) {
+        std::cout << "SUCCESS: " << direct_method_names[m]
+                  << " NDT result matches single thread result" << std::endl;
+      } else {
+        std::cerr << "FAILURE: " << direct_method_names[m]
+                  << " NDT result does not match single thread result"
+                  << std::endl;
+        success = false;
+      }
+      if ((ndt_transform[0] - kdtree_transform).cwiseAbs().maxCoeff() <
+          kdtree_tolerances[m]) {
+        std::cout << "SUCCESS: " << direct_method_names[m]
+                  << " NDT matches KDTREE NDT" << std::endl;
+      } else {
+        std::cerr << "FAILURE: " << direct_method_names[m]
+                  << " NDT does not match KDTREE NDT" << std::endl;
+        success = false;
+      }
+    }
+  }
+
+  // Cached DIRECT7 neighbourhoods give the same result as looking them up at
+  // every evaluation. The offset guess moves most points by more than half a
+  // voxel, so they change voxel between the trials of the line search
+  {
+    Eigen::Matrix4f offset_guess = Eigen::Matrix4f::Identity();
+    offset_guess.topLeftCorner<3, 3>() =
+        Eigen::AngleAxisf(0.05f, Eigen::Vector3f::UnitZ()).toRotationMatrix();
+    offset_guess(0, 3) = 0.6f;
+    const Eigen::Matrix4f cache_guesses[2] = {Eigen::Matrix4f::Identity(),
+                                              offset_guess};
+    bool cache_matches = true;
+    for (const Eigen::Matrix4f& guess : cache_guesses) {
+      Eigen::Matrix4f ndt_transform[2];
+      for (int k = 0; k < 2; k++) {
+        pclomp::NormalDistributionsTransform<PointF, PointF> ndt;
+        setUpNdt(ndt);
+        ndt.setNeighborhoodSearchMethod(pclomp::DIRECT7);
+        ndt.setNeighborhoodCache(k == 1);
+        ndt.setInputSource(query);
+        ndt.setInputTarget(reference);
+        PointCloudF aligned_points;
+        ndt.align(aligned_points, guess);
+        ndt_transform[k] = ndt.getFinalTransformation();
+      }
+      cache_matches = cache_matches && ndt_transform[1] == ndt_transform[0];
+    }
+    if (cache_matches) {
+      std::cout << "SUCCESS: Cached NDT neighbourhoods match uncached ones"
+                << std::endl;
+    } else {
+      std::cerr << "FAILURE: Cached NDT neighbourhoods do not match uncached "
+                   "ones"
+                << std::endl;
+      success = false;
+    }
+  }
+
+  // NDT batch items running in parallel match a standalone registration
+  {
+    pclomp::NormalDistributionsTransform<PointF, PointF> ndt;
+    setUpNdt(ndt);
+    ndt.setNumThreads(4);
+    ndt.setInputSource(query);
+    ndt.setInputTarget(reference);
+    PointCloudF aligned_points;
+    ndt.align(aligned_points);
+    const Eigen::Matrix4f standalone_transform = ndt.getFinalTransformation();
+    const double standalone_fitness_score = ndt.getFitnessScore();
+
+    pclomp::NormalDistributionsTransform<PointF, PointF> batch_ndt;
+    setUpNdt(batch_ndt);
+    batch_ndt.setNumThreads(4);
+    batch_ndt.setInputTarget(reference);
+    RegistrationBatchResults results;
+    RegistrationTransformations guesses(3, Eigen::Matrix4f::Identity());
+    if (!batch_ndt.alignBatch({query, query, query}, guesses, results) ||
+        results.size() != 3) {
+      std::cerr << "FAILURE: NDT batch registration failed" << std::endl;
+      success = false;
+    }
+    for (const RegistrationBatchResult& result : results) {
+      if (result.transformation == standalone_transform &&
+          result.fitness_score == standalone_fitness_score) {
+        std::cout << "SUCCESS: NDT batch result matches standalone result"
+                  << std::endl;
+      } else {
+        std::cerr << "FAILURE: NDT batch result does not match standalone "
+                     "result"
+                  << std::endl;
+        success = false;
+      }
+    }
+  }
+
+  // Gauss-Newton NDT reaches the minimum of the line search NDT
+  {
+    const NdtSolver ndt_solvers[2] = {NdtSolver::NEWTON_LINE_SEARCH,
+                                      NdtSolver::GAUSS_NEWTON};
+    Eigen::Matrix4f ndt_transform[2];
+    for (int k = 0; k < 2; k++) {
+      pclomp::NormalDistributionsTransform<PointF, PointF> ndt;
+      setUpNdt(ndt, 30);
+      ndt.setSolver(ndt_solvers[k]);
+      ndt.setInputSource(query);
+      ndt.setInputTarget(reference);
+      PointCloudF aligned_points;
+      ndt.align(aligned_points);
+      ndt_transform[k] = ndt.getFinalTransformation();
+    }
+    if ((ndt_transform[1] - ndt_transform[0]).cwiseAbs().maxCoeff() < 1e-2) {
+      std::cout << "SUCCESS: Gauss-Newton NDT matches line search NDT"
+                << std::endl;
+    } else {
+      std::cerr << "FAILURE: Gauss-Newton NDT does not match line search NDT"
+                << std::endl;
+      success = false;
+    }
+  }
+
+  // Cascaded NDT ends up at the same minimum
+  {
+    Eigen::Matrix4f ndt_transform[2];
+    for (int k = 0; k < 2; k++) {
+      pclomp::NormalDistributionsTransform<PointF, PointF> ndt;
+      setUpNdt(ndt, 30);
+      if (k == 1)
+        ndt.setCascadeLevels({4, 2}, {10, 10});
+      ndt.setInputSource(query);
+      ndt.setInputTarget(reference);
+      PointCloudF aligned_points;
+      ndt.align(aligned_points);
+      ndt_transform[k] = ndt.getFinalTransformation();
+    }
+    if ((ndt_transform[1] - ndt_transform[0]).cwiseAbs().maxCoeff() < 1e-2) {
+      std::cout << "SUCCESS: Cascaded NDT matches single resolution NDT"
+                << std::endl;
+    } else {
+      std::cerr << "FAILURE: Cascaded NDT does not match single resolution NDT"
+                << std::endl;
+      success = false;
+    }
+  }
+
+  // Target grid built incrementally matches the grid built at once
+  {
+    PointCloudF::Ptr first_half(new PointCloudF);
+    PointCloudF second_half;
+    for (size_t i = 0; i < reference->size(); i++) {
+      if (i % 2 == 0)
+        first_half->push_back(reference->points[i]);
+      else
+        second_half.push_back(reference->points[i]);
+    }
+    Eigen::Matrix4f ndt_transform[2];
+    for (int k = 0; k < 2; k++) {
+      pclomp::NormalDistributionsTransform<PointF, PointF> ndt;
+      setUpNdt(ndt);
+      ndt.setInputSource(query);
+      if (k == 0) {
+        ndt.setInputTarget(reference);
+      } else {
+        ndt.setInputTarget(first_half);
+        ndt.addTargetPoints(second_half);
+      }
+      PointCloudF aligned_points;
+      ndt.align(aligned_points);
+      ndt_transform[k] = ndt.getFinalTransformation();
+    }
+    if ((ndt_transform[1] - ndt_transform[0]).cwiseAbs().maxCoeff() <
+        transform_tolerance) {
+      std::cout << "SUCCESS: Incremental NDT target matches full target"
+                << std::endl;
+    } else {
+      std::cerr << "FAILURE: Incremental NDT target does not match full target"
+                << std::endl;
+      success = false;
+    }
+  }
+
+  // Points added then removed leave the target grid as it was, and their
+  // voxels are released
+  {
+    PointCloudF shifted;
+    Eigen::Matrix4f shift = Eigen::Matrix4f::Identity();
+    shift(0, 3) = 100.f;
+    pcl::transformPointCloud(*reference, shifted, shift);
+    Eigen::Matrix4f ndt_transform[2];
+    for (int k = 0; k < 2; k++) {
+      pclomp::NormalDistributionsTransform<PointF, PointF> ndt;
+      setUpNdt(ndt);
+      ndt.setInputSource(query);
+      ndt.setInputTarget(reference);
+      if (k == 1) {
+        ndt.addTargetPoints(shifted);
+        ndt.removeTargetPoints(shifted);
+      }
+      PointCloudF aligned_points;
+      ndt.align(aligned_points);
+      ndt_transform[k] = ndt.getFinalTransformation();
+    }
+
+    // A sliding window reuses the leaves of the voxels it leaves
+    pclomp::VoxelGridCovariance<PointF> grid;
+    grid.setLeafSize(1.f, 1.f, 1.f);
+    grid.setInputCloud(reference);
+    grid.filter(true);
+    const size_t num_centroids = grid.getCentroids()->size();
+    PointCloudF windows[2];
+    for (int w = 0; w < 2; w++) {
+      shift(0, 3) = 100.f * (w + 1);
+      pcl::transformPointCloud(*reference, windows[w], shift);
+    }
+    size_t num_leaves = 0;
+    bool bounded = true;
+    for (int window = 0; window < 6; window++) {
+      grid.addPoints(windows[window % 2]);
+      grid.updateDirtyLeaves();
+      grid.removePoints(windows[window % 2]);
+      grid.updateDirtyLeaves();
+      // Both windows have been seen once, the leaves must not grow anymore
+      if (window == 1)
+        num_leaves = grid.getLeaves().size();
+      if (window >= 1)
+        bounded = bounded && grid.getLeaves().size() == num_leaves;
+      bounded = bounded && grid.getCentroids()->size() == num_centroids;
+    }
+
+    if ((ndt_transform[1] - ndt_transform[0]).cwiseAbs().maxCoeff() <
+            transform_tolerance &&
+        bounded) {
+      std::cout << "SUCCESS: Removed NDT target points leave the grid as it was"
+                << std::endl;
+    } else {
+      std::cerr << "FAILURE: Removed NDT target points change the grid"
+                << std::endl;
+      success = false;
+    }
+  }
+
+  // GICP exposes the inlier correspondences of its last iteration, the
+  // nearest neighbours of the source at the pose of the last search
+  {
+    pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF> icp;
+    setUpGicp(icp);
+    icp.setInputSource(query);
+    icp.setInputTarget(reference);
+    PointCloudF aligned_points;
+    icp.align(aligned_points);
+    const Eigen::Matrix4f T = icp.getFinalTransformation();
+    // A single iteration from T searches the correspondences at exactly T
+    icp.setMaximumIterations(1);
+    icp.align(aligned_points, T);
+    PointCloudF query_at_T;
+    pcl::transformPointCloud(*query, query_at_T, T);
+    pcl::KdTreeFLANN<PointF> reference_tree;
+    reference_tree.setInputCloud(reference);
+    std::vector<int> nn_indices(1);
+    std::vector<float> nn_dists(1);
+
+    const pcl::Correspondences& correspondences = icp.getFinalCorrespondences();
+    bool valid = !correspondences.empty() &&
+        int(correspondences.size()) ==
+            icp.getRegistrationStats().num_inliers;
+    for (const pcl::Correspondence& correspondence : correspondences) {
+      if (correspondence.index_query < 0 ||
+          correspondence.index_query >= int(query->size())) {
+        valid = false;
+        break;
+      }
+      reference_tree.nearestKSearch(query_at_T[correspondence.index_query],
+                                    1,
+                                    nn_indices,
+                                    nn_dists);
+      // Equidistant neighbours may be returned in either order
+      valid = valid &&
+          (correspondence.index_match == nn_indices[0] ||
+           correspondence.distance == nn_dists[0]) &&
+          std::fabs(correspondence.distance - nn_dists[0]) <= 1e-6f &&
+          correspondence.distance < 0.2f * 0.2f;
+    }
+
+    // A rejected source still drops the correspondences of the previous one
+    icp.setInputSource(PointCloudF::Ptr(new PointCloudF));
+    valid = valid && icp.getFinalCorrespondences().empty();
+    if (valid) {
+      std::cout << "SUCCESS: GICP final correspondences are the inliers"
+                << std::endl;
+    } else {
+      std::cerr << "FAILURE: GICP final correspondences are not the inliers"
+                << std::endl;
+      success = false;
+    }
+  }
+
+  // NDT reports the in plane directions of a planar target as degenerate
+  {
+    PointCloudF::Ptr plane(new PointCloudF);
+    PointCloudF::Ptr plane_subset(new PointCloudF);
+    for (int i = -100; i < 100; i++) {
+      for (int j = -100; j < 100; j++) {
+        PointF point;
+        point.x = 0.1f * i;
+        point.y = 0.1f * j;
+        point.z = 0.f;
+        plane->push_back(point);
+        if (i % 2 == 0 && j % 2 == 0)
+          plane_subset->push_back(point);
+      }
+    }
+    pclomp::NormalDistributionsTransform<PointF, PointF> ndt;
+    setUpNdt(ndt);
+    ndt.setInputSource(plane_subset);
+    ndt.setInputTarget(plane);
+    PointCloudF aligned_points;
+    ndt.align(aligned_points);
+    // Degenerate directions come first and may only move within the plane,
+    // along x, y and yaw
+    bool in_plane = true;
+    for (int k = 0; k < ndt.getNumDegenerateDirections(); k++) {
+      const Eigen::Matrix<double, 6, 1> direction =
+          ndt.getInformationEigenvectors().col(k);
+      in_plane = in_plane &&
+          Eigen::Vector3d(direction(2), direction(3), direction(4)).norm() <
+              0.1;
+    }
+    if (ndt.isDegenerate() && in_plane) {
+      std::cout << "SUCCESS: NDT reports " << ndt.getNumDegenerateDirections()
+                << " in plane degenerate directions on a plane" << std::endl;
+    } else {
+      std::cerr << "FAILURE: NDT degeneracy report does not match the plane ("
+                << ndt.getNumDegenerateDirections() << " directions)"
+                << std::endl;
+      success = false;
+    }
+  }
+
   if (success) {
     std::cout << "All checks passed!" << std::endl;
   } else {
     std::cerr << "At least one check failed" << std::endl;
   }
+  return success ? 0 : 1;
 }
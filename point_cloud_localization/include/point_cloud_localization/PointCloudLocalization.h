@@ -98,6 +98,15 @@ public:
                                   const Eigen::Matrix4f& T,
                                   Eigen::Matrix<double, 6, 6>* covariance);
 
+  // Find the nearest reference point of each aligned query point, reusing
+  // the correspondences of GICP where it has them
+  void FindCorrespondences(const PointCloudF& aligned_query,
+                           std::vector<size_t>* correspondences);
+
+  // Bound the eigenvalues of a covariance between zero and the maximum
+  // covariance and store its condition number
+  bool BoundCovariance(Eigen::Matrix<double, 6, 6>* covariance);
+
   // Compute observability of ICP for two pointclouds
   void ComputeIcpObservability(const PointCloudF& query_cloud,
                                const PointCloudF& reference_cloud,
@@ -190,6 +199,39 @@ private:
   struct Parameters {
     // What registration method should be used: GICP, NDT
     std::string registration_method;
+    // GICP solver: bfgs, gauss_newton, levenberg_marquardt
+    std::string gicp_solver;
+    // GICP correspondence search: kdtree, voxel_hash1, voxel_hash7, voxel_hash27
+    std::string gicp_search_method;
+    // Reuse GICP mahalanobis matrices within this rotation (rad), 0 disables
+    double mahalanobis_cache_rotation_threshold;
+    // GICP early exit on inlier ratio change / relative cost decrease
+    double inlier_ratio_epsilon;
+    double cost_decrease_epsilon;
+    // Evaluate the GICP BFGS cost function in single precision
+    bool gicp_single_precision;
+    // GICP coarse to fine pyramid: voxel sizes (coarsest first) and maximum
+    // iterations of the levels run before the full resolution registration
+    std::vector<double> pyramid_resolutions;
+    std::vector<int> pyramid_iterations;
+    // GICP robust kernel: none, huber, cauchy, geman_mcclure, and its width
+    std::string gicp_robust_kernel;
+    double gicp_robust_kernel_width;
+    // NDT solver: newton_line_search, gauss_newton, and the relative damping
+    // of the Gauss-Newton hessian diagonal
+    std::string ndt_solver;
+    double ndt_gauss_newton_damping;
+    // NDT voxel neighbourhood: kdtree, direct26, direct7, direct1
+    std::string ndt_search_method;
+    // NDT voxel size, and the cascade levels aligned before it: ratios of
+    // their voxel size to ndt_resolution (coarsest first) and their maximum
+    // iterations
+    double ndt_resolution;
+    std::vector<int> ndt_cascade_factors;
+    std::vector<int> ndt_cascade_iterations;
+    // Reuse the GICP covariances of the map points that were already in the
+    // previous reference
+    bool target_covariance_cache;
     // Compute ICP covariance and condition number
     bool compute_icp_covariance;
     // Point-to-point or Point-to-plane
@@ -207,6 +249,8 @@ private:
     unsigned int iterations;
     // Number of threads GICP is allowed to use
     int num_threads;
+    // CPUs the registration worker threads are pinned to, empty for no pinning
+    std::vector<int> cpu_affinity;
     // Enable GICP timing information print logs
     bool enable_timing_output;
     // Radius used when computing ptcld normals
@@ -226,6 +270,18 @@ private:
   // ICP
 
   pcl::Registration<PointF, PointF>::Ptr icp_;
+  // Set only if GICP is the registration method
+  pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF>::Ptr
+      gicp_;
+  // Set only if NDT is the registration method
+  pclomp::NormalDistributionsTransform<PointF, PointF>::Ptr ndt_;
+  // Workers shared by the registration and the correspondence search
+  RegistrationThreadPool::Ptr thread_pool_;
+  // Reference index of each aligned query point, reused across scans
+  std::vector<size_t> correspondences_;
+  // Per thread nearest neighbour buffers of FindCorrespondences
+  std::vector<std::vector<int>> correspondence_nn_indices_;
+  std::vector<std::vector<float>> correspondence_nn_dists_;
 
   bool SetupICP();
 
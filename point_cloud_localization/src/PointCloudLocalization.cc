@@ -64,6 +64,50 @@ bool PointCloudLocalization::LoadParameters(const ros::NodeHandle& n) {
 
   if (!pu::Get("localization/registration_method", params_.registration_method))
     return false;
+  if (!pu::Get("localization/gicp_solver", params_.gicp_solver))
+    return false;
+  if (!pu::Get("localization/gicp_search_method",
+               params_.gicp_search_method))
+    return false;
+  if (!pu::Get("localization/mahalanobis_cache_rotation_threshold",
+               params_.mahalanobis_cache_rotation_threshold))
+    return false;
+  if (!pu::Get("localization/inlier_ratio_epsilon",
+               params_.inlier_ratio_epsilon))
+    return false;
+  if (!pu::Get("localization/cost_decrease_epsilon",
+               params_.cost_decrease_epsilon))
+    return false;
+  if (!pu::Get("localization/gicp_single_precision",
+               params_.gicp_single_precision))
+    return false;
+  if (!pu::Get("localization/pyramid_resolutions",
+               params_.pyramid_resolutions))
+    return false;
+  if (!pu::Get("localization/pyramid_iterations", params_.pyramid_iterations))
+    return false;
+  if (!pu::Get("localization/gicp_robust_kernel", params_.gicp_robust_kernel))
+    return false;
+  if (!pu::Get("localization/gicp_robust_kernel_width",
+               params_.gicp_robust_kernel_width))
+    return false;
+  if (!pu::Get("localization/ndt_solver", params_.ndt_solver))
+    return false;
+  if (!pu::Get("localization/ndt_gauss_newton_damping",
+               params_.ndt_gauss_newton_damping))
+    return false;
+  if (!pu::Get("localization/ndt_search_method", params_.ndt_search_method))
+    return false;
+  if (!pu::Get("localization/ndt_resolution", params_.ndt_resolution))
+    return false;
+  if (!pu::Get("localization/ndt_cascade_factors", params_.ndt_cascade_factors))
+    return false;
+  if (!pu::Get("localization/ndt_cascade_iterations",
+               params_.ndt_cascade_iterations))
+    return false;
+  if (!pu::Get("localization/target_covariance_cache",
+               params_.target_covariance_cache))
+    return false;
   if (!pu::Get("localization/compute_icp_covariance",
                params_.compute_icp_covariance))
     return false;
@@ -85,6 +129,8 @@ bool PointCloudLocalization::LoadParameters(const ros::NodeHandle& n) {
     return false;
   if (!pu::Get("localization/num_threads", params_.num_threads))
     return false;
+  if (!pu::Get("localization/cpu_affinity", params_.cpu_affinity))
+    return false;
   if (!pu::Get("localization/enable_timing_output",
                params_.enable_timing_output))
     return false;
@@ -223,6 +269,11 @@ bool PointCloudLocalization::TransformPointsToSensorFrame(
 bool PointCloudLocalization::SetupICP() {
   ROS_INFO("PointCloudLocalization - SetupICP");
 
+  // Worker pool owned by this registration engine, so that its thread count
+  // does not interfere with the other components of the process
+  thread_pool_ = std::make_shared<RegistrationThreadPool>(
+      params_.num_threads, params_.cpu_affinity);
+
   switch (getRegistrationMethodFromString(params_.registration_method)) {
   case RegistrationMethod::GICP: {
     ROS_INFO_STREAM("RegistrationMethod::GICP activated.");
@@ -236,13 +287,28 @@ bool PointCloudLocalization::SetupICP() {
     gicp->setMaximumIterations(params_.iterations);
     gicp->setRANSACIterations(0);
     gicp->setMaximumOptimizerIterations(50);
-    gicp->setNumThreads(params_.num_threads);
+    gicp->setThreadPool(thread_pool_);
     gicp->enableTimingOutput(params_.enable_timing_output);
     gicp->RecomputeTargetCovariance(recompute_covariance_local_map_);
     gicp->RecomputeSourceCovariance(
         recompute_covariance_scan_); // local scan we don't need to
                                      // recompute
     gicp->setEuclideanFitnessEpsilon(0.01);
+    gicp->setSolver(getGicpSolverFromString(params_.gicp_solver));
+    gicp->setSearchMethod(
+        getGicpSearchMethodFromString(params_.gicp_search_method));
+    gicp->setMahalanobisCacheRotationThreshold(
+        params_.mahalanobis_cache_rotation_threshold);
+    gicp->setInlierRatioEpsilon(params_.inlier_ratio_epsilon);
+    gicp->setCostDecreaseEpsilon(params_.cost_decrease_epsilon);
+    gicp->setSinglePrecision(params_.gicp_single_precision);
+    gicp->setRobustKernel(getRobustKernelFromString(params_.gicp_robust_kernel),
+                          params_.gicp_robust_kernel_width);
+    if (!gicp->setPyramidLevels(params_.pyramid_resolutions,
+                                params_.pyramid_iterations)) {
+      ROS_ERROR("Invalid pyramid_resolutions / pyramid_iterations");
+      return false;
+    }
     ROS_INFO_STREAM("GICP activated.");
     ROS_INFO_STREAM(
         "MaxCorrespondenceDistance: " << gicp->getMaxCorrespondenceDistance());
@@ -260,7 +326,13 @@ bool PointCloudLocalization::SetupICP() {
     ROS_INFO_STREAM("ConvergeCriteria:" << gicp->getConvergeCriteria());
     ROS_INFO_STREAM("RANSACOutlierRejectionThreshold: "
                     << gicp->getRANSACOutlierRejectionThreshold());
+    ROS_INFO_STREAM("GicpSolver: " << params_.gicp_solver);
+    ROS_INFO_STREAM("GicpSearchMethod: " << params_.gicp_search_method);
+    ROS_INFO_STREAM("Pyramid levels: " << gicp->getNumPyramidLevels());
+    ROS_INFO_STREAM("RobustKernel: " << params_.gicp_robust_kernel << " width "
+                                     << params_.gicp_robust_kernel_width);
     icp_ = gicp;
+    gicp_ = gicp;
 
     break;
   }
@@ -268,15 +340,30 @@ bool PointCloudLocalization::SetupICP() {
     ROS_INFO_STREAM("RegistrationMethod::NDT activated.");
     pclomp::NormalDistributionsTransform<PointF, PointF>::Ptr ndt_omp =
         boost::make_shared<
-            pclomp::NormalDistributionsTransform<PointF, PointF>>();
+            pclomp::NormalDistributionsTransform<PointF, PointF>>(thread_pool_);
 
     ndt_omp->setTransformationEpsilon(params_.tf_epsilon);
     ndt_omp->setMaxCorrespondenceDistance(params_.corr_dist);
     ndt_omp->setMaximumIterations(params_.iterations);
     ndt_omp->setRANSACIterations(0);
-    ndt_omp->setNumThreads(params_.num_threads);
     ndt_omp->enableTimingOutput(params_.enable_timing_output);
+    ndt_omp->setSolver(getNdtSolverFromString(params_.ndt_solver),
+                       params_.ndt_gauss_newton_damping);
+    ROS_INFO_STREAM("NdtSolver: " << params_.ndt_solver);
+    ndt_omp->setNeighborhoodSearchMethod(
+        pclomp::getNeighborSearchMethodFromString(params_.ndt_search_method));
+    ROS_INFO_STREAM("NdtSearchMethod: " << params_.ndt_search_method);
+    ndt_omp->setResolution(params_.ndt_resolution);
+    if (!ndt_omp->setCascadeLevels(params_.ndt_cascade_factors,
+                                   params_.ndt_cascade_iterations)) {
+      ROS_ERROR("Invalid ndt_cascade_factors / ndt_cascade_iterations");
+      return false;
+    }
+    ROS_INFO_STREAM("NDT resolution: " << params_.ndt_resolution
+                                       << " cascade levels: "
+                                       << ndt_omp->getNumCascadeLevels());
     icp_ = ndt_omp;
+    ndt_ = ndt_omp;
     break;
   }
   default:
@@ -304,7 +391,21 @@ bool PointCloudLocalization::MeasurementUpdate(
   stamp_ = readed_stamp;
 
   icp_->setInputSource(query);
-  icp_->setInputTarget(reference);
+  if (gicp_ && params_.target_covariance_cache) {
+    // The reference neighbours come from the map, moved into the sensor frame
+    // with the current estimate. Identify them in the fixed frame, where they
+    // do not move between scans
+    const gu::Transform3 estimate =
+        gu::PoseUpdate(integrated_estimate_, incremental_estimate_);
+    Eigen::Matrix4f fixed_from_sensor = Eigen::Matrix4f::Identity();
+    fixed_from_sensor.block<3, 3>(0, 0) =
+        estimate.rotation.Eigen().cast<float>();
+    fixed_from_sensor.block<3, 1>(0, 3) =
+        estimate.translation.Eigen().cast<float>();
+    gicp_->setInputTargetCached(reference, fixed_from_sensor);
+  } else {
+    icp_->setInputTarget(reference);
+  }
 
   PointCloudF icpAlignedPointsLocalization_;
   icp_->align(icpAlignedPointsLocalization_);
@@ -324,15 +425,26 @@ bool PointCloudLocalization::MeasurementUpdate(
 
   pcl::transformPointCloudWithNormals(*query, *aligned_query, T);
 
-  KdTree::Ptr search_tree_ = icp_->getSearchMethodTarget();
-
-  // Get the correspondence indices iterate over references TODO?
-  std::vector<size_t> correspondences;
-  for (auto point : aligned_query->points) {
-    std::vector<int> matched_indices;
-    std::vector<float> matched_distances;
-    search_tree_->nearestKSearch(point, 1, matched_indices, matched_distances);
-    correspondences.push_back(matched_indices[0]);
+  // NDT provides its covariance, the correspondences are only needed for the
+  // point to plane matrices
+  Eigen::Matrix<double, 6, 6> ndt_covariance;
+  if (ndt_) {
+    // NDT orders parameters [translation, rotation], the point to plane
+    // matrices below are ordered [rotation, translation]
+    Eigen::Matrix<double, 6, 6> permutation =
+        Eigen::Matrix<double, 6, 6>::Zero();
+    permutation.block<3, 3>(0, 3).setIdentity();
+    permutation.block<3, 3>(3, 0).setIdentity();
+    ndt_covariance = permutation * ndt_->getMetricCovariance() * permutation;
+    if (ndt_->isDegenerate()) {
+      ROS_WARN_THROTTLE(1.0,
+                        "%s: NDT alignment is degenerate in %d directions",
+                        name_.c_str(),
+                        ndt_->getNumDegenerateDirections());
+    }
+  }
+  if (!ndt_ || params_.compute_icp_observability) {
+    FindCorrespondences(*aligned_query, &correspondences_);
   }
 
   gu::Transform3 pose_update;
@@ -388,7 +500,7 @@ bool PointCloudLocalization::MeasurementUpdate(
     observability_matrix_ = Eigen::Matrix<double, 6, 6>::Zero();
     ComputeIcpObservability(*query,
                             *reference,
-                            correspondences,
+                            correspondences_,
                             T,
                             &eigenvectors_new,
                             &eigenvalues_new,
@@ -410,8 +522,13 @@ bool PointCloudLocalization::MeasurementUpdate(
         break;
       }
       case (1):
-        ComputePoint2PlaneICPCovariance(
-            *query, *reference, correspondences, T, &icp_covariance_);
+        if (ndt_) {
+          icp_covariance_ = ndt_covariance;
+          BoundCovariance(&icp_covariance_);
+        } else {
+          ComputePoint2PlaneICPCovariance(
+              *query, *reference, correspondences_, T, &icp_covariance_);
+        }
         break;
       default:
         ROS_ERROR(
@@ -426,6 +543,40 @@ bool PointCloudLocalization::MeasurementUpdate(
   return true;
 }
 
+void PointCloudLocalization::FindCorrespondences(
+    const PointCloudF& aligned_query, std::vector<size_t>* correspondences) {
+  const size_t no_match = std::numeric_limits<size_t>::max();
+  correspondences->assign(aligned_query.size(), no_match);
+
+  // GICP already matched the points within the correspondence distance
+  if (gicp_) {
+    for (const pcl::Correspondence& match : gicp_->getFinalCorrespondences()) {
+      // Guards against correspondences of another source
+      if (match.index_query < 0 ||
+          size_t(match.index_query) >= aligned_query.size())
+        continue;
+      (*correspondences)[match.index_query] = match.index_match;
+    }
+  }
+
+  // Search the remaining points, with buffers kept across scans
+  KdTree::Ptr search_tree = icp_->getSearchMethodTarget();
+  correspondence_nn_indices_.resize(thread_pool_->numThreads());
+  correspondence_nn_dists_.resize(thread_pool_->numThreads());
+  thread_pool_->parallelFor(
+      int(aligned_query.size()), 256, [&](int begin, int end, int thread_id) {
+        std::vector<int>& nn_indices = correspondence_nn_indices_[thread_id];
+        std::vector<float>& nn_dists = correspondence_nn_dists_[thread_id];
+        for (int i = begin; i < end; i++) {
+          if ((*correspondences)[i] != no_match)
+            continue;
+          search_tree->nearestKSearch(
+              aligned_query.points[i], 1, nn_indices, nn_dists);
+          (*correspondences)[i] = nn_indices[0];
+        }
+      });
+}
+
 void PointCloudLocalization::SetFlatGroundAssumptionValue(const bool& value) {
   ROS_INFO_STREAM(
       "PointCloudLocalization - SetFlatGroundAssumptionValue - Received: "
@@ -486,6 +637,11 @@ bool PointCloudLocalization::ComputePoint2PlaneICPCovariance(
   // 1 cm covariance for now hard coded
   *covariance = 0.05 * 0.05 * Ap.inverse();
 
+  return BoundCovariance(covariance);
+}
+
+bool PointCloudLocalization::BoundCovariance(
+    Eigen::Matrix<double, 6, 6>* covariance) {
   // Here bound the covariance using eigen values
   //// First find ldlt decomposition
   auto ldlt = covariance->ldlt();
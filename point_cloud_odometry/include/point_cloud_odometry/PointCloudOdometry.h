@@ -99,6 +99,10 @@ private:
 
   // Use ICP between a query and reference point cloud to estimate pose
   bool UpdateICP();
+  // UpdateICP variant reusing the previous query as reference (GICP only)
+  bool UpdateRollingICP();
+  // Apply the registration result to the incremental and integrated estimates
+  bool UpdateIncrementalEstimate(const Eigen::Matrix4d& T);
 
   // Publish incremental and integrated pose estimates
   void PublishPose(const geometry_utils::Transform3& pose,
@@ -141,17 +145,54 @@ private:
   struct Parameters {
     // Registration method
     std::string registration_method;
+    // GICP solver: bfgs, gauss_newton, levenberg_marquardt
+    std::string gicp_solver;
+    // GICP correspondence search: kdtree, voxel_hash1, voxel_hash7, voxel_hash27
+    std::string gicp_search_method;
+    // Reuse GICP mahalanobis matrices within this rotation (rad), 0 disables
+    double mahalanobis_cache_rotation_threshold;
+    // GICP early exit on inlier ratio change / relative cost decrease
+    double inlier_ratio_epsilon;
+    double cost_decrease_epsilon;
+    // Evaluate the GICP BFGS cost function in single precision
+    bool gicp_single_precision;
+    // GICP coarse to fine pyramid: voxel sizes (coarsest first) and maximum
+    // iterations of the levels run before the full resolution registration
+    std::vector<double> pyramid_resolutions;
+    std::vector<int> pyramid_iterations;
+    // GICP robust kernel: none, huber, cauchy, geman_mcclure, and its width
+    std::string gicp_robust_kernel;
+    double gicp_robust_kernel_width;
+    // NDT solver: newton_line_search, gauss_newton, and the relative damping
+    // of the Gauss-Newton hessian diagonal
+    std::string ndt_solver;
+    double ndt_gauss_newton_damping;
+    // NDT voxel neighbourhood: kdtree, direct26, direct7, direct1
+    std::string ndt_search_method;
+    // NDT voxel size, and the cascade levels aligned before it: ratios of
+    // their voxel size to ndt_resolution (coarsest first) and their maximum
+    // iterations
+    double ndt_resolution;
+    std::vector<int> ndt_cascade_factors;
+    std::vector<int> ndt_cascade_iterations;
     double icp_tf_epsilon;
     double icp_corr_dist;
     unsigned int icp_iterations;
     // Number of threads GICP is allowed to use
     int num_threads;
+    // CPUs the registration worker threads are pinned to, empty for no pinning
+    std::vector<int> cpu_affinity;
     // Enable GICP timing information print logs
     bool enable_timing_output;
+    // Reuse the previous query (tree and covariances) as the next reference
+    bool rolling_registration;
 
   } params_;
 
   pcl::Registration<PointF, PointF>::Ptr icp_;
+  // Set only if GICP is the registration method, needed for rolling mode
+  pcl::MultithreadedGeneralizedIterativeClosestPoint<PointF, PointF>::Ptr
+      gicp_;
 
   bool SetupICP();
 
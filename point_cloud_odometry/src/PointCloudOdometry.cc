@@ -71,6 +71,41 @@ bool PointCloudOdometry::LoadParameters(const ros::NodeHandle& n) {
 
   if (!pu::Get("icp/registration_method", params_.registration_method))
     return false;
+  if (!pu::Get("icp/gicp_solver", params_.gicp_solver))
+    return false;
+  if (!pu::Get("icp/gicp_search_method", params_.gicp_search_method))
+    return false;
+  if (!pu::Get("icp/mahalanobis_cache_rotation_threshold",
+               params_.mahalanobis_cache_rotation_threshold))
+    return false;
+  if (!pu::Get("icp/inlier_ratio_epsilon", params_.inlier_ratio_epsilon))
+    return false;
+  if (!pu::Get("icp/cost_decrease_epsilon", params_.cost_decrease_epsilon))
+    return false;
+  if (!pu::Get("icp/gicp_single_precision", params_.gicp_single_precision))
+    return false;
+  if (!pu::Get("icp/pyramid_resolutions", params_.pyramid_resolutions))
+    return false;
+  if (!pu::Get("icp/pyramid_iterations", params_.pyramid_iterations))
+    return false;
+  if (!pu::Get("icp/gicp_robust_kernel", params_.gicp_robust_kernel))
+    return false;
+  if (!pu::Get("icp/gicp_robust_kernel_width",
+               params_.gicp_robust_kernel_width))
+    return false;
+  if (!pu::Get("icp/ndt_solver", params_.ndt_solver))
+    return false;
+  if (!pu::Get("icp/ndt_gauss_newton_damping",
+               params_.ndt_gauss_newton_damping))
+    return false;
+  if (!pu::Get("icp/ndt_search_method", params_.ndt_search_method))
+    return false;
+  if (!pu::Get("icp/ndt_resolution", params_.ndt_resolution))
+    return false;
+  if (!pu::Get("icp/ndt_cascade_factors", params_.ndt_cascade_factors))
+    return false;
+  if (!pu::Get("icp/ndt_cascade_iterations", params_.ndt_cascade_iterations))
+    return false;
   if (!pu::Get("icp/tf_epsilon", params_.icp_tf_epsilon))
     return false;
   if (!pu::Get("icp/corr_dist", params_.icp_corr_dist))
@@ -85,10 +120,14 @@ bool PointCloudOdometry::LoadParameters(const ros::NodeHandle& n) {
     return false;
   if (!pu::Get("icp/num_threads", params_.num_threads))
     return false;
+  if (!pu::Get("icp/cpu_affinity", params_.cpu_affinity))
+    return false;
   if (!pu::Get("icp/enable_timing_output", params_.enable_timing_output))
     return false;
   if (!pu::Get("icp/recompute_covariances", recompute_covariances_))
     return false;
+  if (!pu::Get("icp/rolling_registration", params_.rolling_registration))
+    return false;
 
   if (!pu::Get("b_verbose", b_verbose_))
     return false;
@@ -136,6 +175,12 @@ bool PointCloudOdometry::RegisterCallbacks(const ros::NodeHandle& n) {
 bool PointCloudOdometry::SetupICP() {
   ROS_INFO("PointCloudOdometry - SetupICP");
 
+  // Worker pool owned by this registration engine, so that its thread count
+  // does not interfere with the other components of the process
+  RegistrationThreadPool::Ptr thread_pool =
+      std::make_shared<RegistrationThreadPool>(params_.num_threads,
+                                               params_.cpu_affinity);
+
   switch (getRegistrationMethodFromString(params_.registration_method)) {
   case RegistrationMethod::GICP: {
     ROS_INFO_STREAM("RegistrationMethod::GICP activated.");
@@ -148,11 +193,26 @@ bool PointCloudOdometry::SetupICP() {
     gicp->setMaxCorrespondenceDistance(params_.icp_corr_dist);
     gicp->setMaximumIterations(params_.icp_iterations);
     gicp->setRANSACIterations(0);
-    gicp->setNumThreads(params_.num_threads);
+    gicp->setThreadPool(thread_pool);
     gicp->enableTimingOutput(params_.enable_timing_output);
     gicp->RecomputeTargetCovariance(recompute_covariances_);
     gicp->RecomputeSourceCovariance(recompute_covariances_);
     gicp->setEuclideanFitnessEpsilon(0.005);
+    gicp->setSolver(getGicpSolverFromString(params_.gicp_solver));
+    gicp->setSearchMethod(
+        getGicpSearchMethodFromString(params_.gicp_search_method));
+    gicp->setMahalanobisCacheRotationThreshold(
+        params_.mahalanobis_cache_rotation_threshold);
+    gicp->setInlierRatioEpsilon(params_.inlier_ratio_epsilon);
+    gicp->setCostDecreaseEpsilon(params_.cost_decrease_epsilon);
+    gicp->setSinglePrecision(params_.gicp_single_precision);
+    gicp->setRobustKernel(getRobustKernelFromString(params_.gicp_robust_kernel),
+                          params_.gicp_robust_kernel_width);
+    if (!gicp->setPyramidLevels(params_.pyramid_resolutions,
+                                params_.pyramid_iterations)) {
+      ROS_ERROR("Invalid pyramid_resolutions / pyramid_iterations");
+      return false;
+    }
     ROS_INFO_STREAM("GICP");
     ROS_INFO_STREAM("getMaxCorrespondenceDistance: "
                     << gicp->getMaxCorrespondenceDistance());
@@ -175,22 +235,46 @@ bool PointCloudOdometry::SetupICP() {
     ROS_INFO_STREAM(
         "RANSACOutlie: " << gicp->getRANSACOutlierRejectionThreshold());
     ROS_INFO_STREAM("CLASS NAME: " << gicp->getClassName());
+    ROS_INFO_STREAM("GicpSolver: " << params_.gicp_solver);
+    ROS_INFO_STREAM("GicpSearchMethod: " << params_.gicp_search_method);
+    ROS_INFO_STREAM("Pyramid levels: " << gicp->getNumPyramidLevels());
+    ROS_INFO_STREAM("RobustKernel: " << params_.gicp_robust_kernel << " width "
+                                     << params_.gicp_robust_kernel_width);
 
     icp_ = gicp;
+    gicp_ = gicp;
     break;
   }
   case RegistrationMethod::NDT: {
     ROS_INFO_STREAM("RegistrationMethod::NDT activated.");
     pclomp::NormalDistributionsTransform<PointF, PointF>::Ptr ndt_omp =
         boost::make_shared<
-            pclomp::NormalDistributionsTransform<PointF, PointF>>();
+            pclomp::NormalDistributionsTransform<PointF, PointF>>(thread_pool);
 
     ndt_omp->setTransformationEpsilon(params_.icp_tf_epsilon);
     ndt_omp->setMaxCorrespondenceDistance(params_.icp_corr_dist);
     ndt_omp->setMaximumIterations(params_.icp_iterations);
     ndt_omp->setRANSACIterations(0);
-    ndt_omp->setNumThreads(params_.num_threads);
     ndt_omp->enableTimingOutput(params_.enable_timing_output);
+    ndt_omp->setSolver(getNdtSolverFromString(params_.ndt_solver),
+                       params_.ndt_gauss_newton_damping);
+    ROS_INFO_STREAM("NdtSolver: " << params_.ndt_solver);
+    ndt_omp->setNeighborhoodSearchMethod(
+        pclomp::getNeighborSearchMethodFromString(params_.ndt_search_method));
+    ROS_INFO_STREAM("NdtSearchMethod: " << params_.ndt_search_method);
+    ndt_omp->setResolution(params_.ndt_resolution);
+    if (!ndt_omp->setCascadeLevels(params_.ndt_cascade_factors,
+                                   params_.ndt_cascade_iterations)) {
+      ROS_ERROR("Invalid ndt_cascade_factors / ndt_cascade_iterations");
+      return false;
+    }
+    ROS_INFO_STREAM("NDT resolution: " << params_.ndt_resolution
+                                       << " cascade levels: "
+                                       << ndt_omp->getNumCascadeLevels());
+    if (params_.rolling_registration) {
+      ROS_WARN("Rolling registration is only supported with GICP, disabling");
+      params_.rolling_registration = false;
+    }
     icp_ = ndt_omp;
     break;
   }
@@ -240,13 +324,21 @@ bool PointCloudOdometry::UpdateEstimate() {
     initialized_ = true;
     return false;
   } else {
-    copyPointCloud(*query_, *reference_);
+    if (params_.rolling_registration) {
+      // The registration keeps its own copy of the previous query as target
+      reference_.swap(query_);
+    } else {
+      copyPointCloud(*query_, *reference_);
+    }
     copyPointCloud(points_, *query_);
     return UpdateICP();
   }
 }
 
 bool PointCloudOdometry::UpdateICP() {
+  if (params_.rolling_registration)
+    return UpdateRollingICP();
+
   query_trans_->clear();
 
   if (b_use_imu_integration_) {
@@ -274,6 +366,36 @@ bool PointCloudOdometry::UpdateICP() {
     T = T * odometry_prior_;
   } 
 
+  return UpdateIncrementalEstimate(T);
+}
+
+bool PointCloudOdometry::UpdateRollingICP() {
+  Eigen::Matrix4d prior = Eigen::Matrix4d::Identity();
+  if (b_use_imu_integration_) {
+    imu_prior_ = Eigen::Matrix4d::Identity();
+    imu_prior_.block(0, 0, 3, 3) = imu_delta_;
+    prior = imu_prior_;
+  } else if (b_use_odometry_integration_) {
+    Eigen::Matrix4f temp;
+    pcl_ros::transformAsMatrix(odometry_delta_, temp);
+    odometry_prior_ = temp.cast<double>();
+    prior = odometry_prior_;
+  }
+
+  // The previous query becomes the target, its search tree and covariances
+  // are reused. Falls back to a full target setup on the first registration
+  if (!gicp_->rollSourceToTarget())
+    icp_->setInputTarget(reference_);
+  // The query is registered untransformed so that its covariances stay valid
+  // once it is rolled over as the next target, the prior is the initial guess
+  icp_->setInputSource(query_);
+  icp_->align(icpAlignedPointsOdometry_, prior.cast<float>());
+
+  return UpdateIncrementalEstimate(
+      icp_->getFinalTransformation().cast<double>());
+}
+
+bool PointCloudOdometry::UpdateIncrementalEstimate(const Eigen::Matrix4d& T) {
   if (b_is_flat_ground_assumption_) {
     tf::Matrix3x3 rotation(T(0, 0),
                            T(0, 1),
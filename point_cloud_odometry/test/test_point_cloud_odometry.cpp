@@ -304,6 +304,38 @@ TEST_F(PointCloudOdometryTest, UpdateEstimateUpdateICP) {
       GetICP()->getFinalTransformation().inverse()(2, 3), 0.0f, epsiliond);
 }
 
+TEST_F(PointCloudOdometryTest, UpdateEstimateRollingRegistration) {
+  auto pc_box = GenerateHollowCubic(10, 10, 10, 0.1, 0.1, 0.1);
+  float offset = 0.05f;
+  ros::NodeHandle nh;
+  ros::param::set("icp/rolling_registration", true);
+
+  EXPECT_TRUE(pco.Initialize(nh));
+  EXPECT_TRUE(pco.SetLidar(*pc_box));
+  EXPECT_FALSE(pco.UpdateEstimate());
+  // The second and third scans are registered against the rolled over target
+  for (int k = 1; k <= 2; k++) {
+    PointCloudF::Ptr translated_pc_box(new PointCloudF());
+    translated_pc_box->resize(pc_box->size());
+    for (size_t i = 0; i < pc_box->points.size(); i++) {
+      translated_pc_box->at(i).x = pc_box->at(i).x + k * offset;
+      translated_pc_box->at(i).y = pc_box->at(i).y + k * offset;
+      translated_pc_box->at(i).z = pc_box->at(i).z + 0;
+    }
+    EXPECT_TRUE(pco.SetLidar(*translated_pc_box));
+    EXPECT_TRUE(pco.UpdateEstimate());
+    ASSERT_EQ(GetICP()->hasConverged(), true);
+    EXPECT_LT(GetICP()->getFitnessScore(), 0.1);
+    EXPECT_NEAR(
+        GetICP()->getFinalTransformation().inverse()(0, 3), offset, epsiliond);
+    EXPECT_NEAR(
+        GetICP()->getFinalTransformation().inverse()(1, 3), offset, epsiliond);
+    EXPECT_NEAR(
+        GetICP()->getFinalTransformation().inverse()(2, 3), 0.0f, epsiliond);
+  }
+  ros::param::set("icp/rolling_registration", false);
+}
+
 int main(int argc, char** argv) {
   testing::InitGoogleTest(&argc, argv);
   ros::init(argc, argv, "PointCloudOdometryTest");